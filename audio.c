@@ -0,0 +1,37 @@
+#include "audio.h"
+
+#include <string.h>
+
+#include "scheduler.h"
+
+void audio_tone_init(AUDIO_TONE *tone, unsigned int sample_rate, unsigned int frequency, int16_t volume)
+{
+    tone->sample_rate = sample_rate;
+    tone->remainder = 0;
+    tone->phase = 0;
+    tone->step = (uint32_t)((((uint64_t)frequency << 32) + sample_rate / 2) / sample_rate);
+    tone->volume = volume;
+}
+
+unsigned int audio_tone_frame(AUDIO_TONE *tone, int sounding, int16_t *samples)
+{
+    unsigned int count = (tone->sample_rate + tone->remainder) / TIMER_RATE;
+
+    tone->remainder = (tone->sample_rate + tone->remainder) % TIMER_RATE;
+
+    if (!sounding)
+    {
+        memset(samples, 0, count * sizeof(int16_t));
+        tone->phase = 0;
+
+        return count;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        samples[i] = tone->phase < 0x80000000 ? tone->volume : -tone->volume;
+        tone->phase += tone->step;
+    }
+
+    return count;
+}
@@ -0,0 +1,38 @@
+#ifndef AUDIO_HEADER
+#define AUDIO_HEADER
+
+#include <stdint.h>
+
+#define AUDIO_DEFAULT_SAMPLE_RATE 48000
+#define AUDIO_DEFAULT_BUFFER_SAMPLES 512
+#define AUDIO_TONE_FREQUENCY 440
+#define AUDIO_TONE_VOLUME 3000
+
+// Most samples one frame can take, at sample rates up to 192 kHz
+#define AUDIO_MAX_FRAME_SAMPLES (192000 / 60 + 1)
+
+// The buzzer, played a whole 60 Hz frame at a time. Every frame's samples
+// start exactly where the last one's ended, and a tone always starts at the
+// beginning of its wave, so starting and stopping is sample accurate.
+typedef struct
+{
+    unsigned int sample_rate;
+
+    // Samples owed to the next frame, in 1/60ths of a sample, so frames of
+    // whole samples add up to the sample rate without drifting
+    unsigned int remainder;
+
+    // Position in the wave and how far it moves per sample, in 1/2^32ths
+    uint32_t phase;
+    uint32_t step;
+
+    int16_t volume;
+} AUDIO_TONE;
+
+void audio_tone_init(AUDIO_TONE *tone, unsigned int sample_rate, unsigned int frequency, int16_t volume);
+
+// Writes the next frame of square wave, or of silence, and returns how many
+// samples that was, never more than AUDIO_MAX_FRAME_SAMPLES
+unsigned int audio_tone_frame(AUDIO_TONE *tone, int sounding, int16_t *samples);
+
+#endif
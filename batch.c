@@ -0,0 +1,775 @@
+// Needed for pthread_setaffinity_np() and the CPU_* macros
+#define _GNU_SOURCE
+
+#include "batch.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+// A key pressed or released at the start of a frame
+typedef struct
+{
+    uint64_t frame;
+    unsigned char key;
+    unsigned char down;
+} BATCH_EVENT;
+
+// Jobs still waiting to run on one worker. Its own thread takes them from
+// the back and idle threads steal them from the front, so the two only meet
+// over the last job.
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned int head;
+    unsigned int tail;
+} BATCH_QUEUE;
+
+typedef struct BATCH_CONTEXT BATCH_CONTEXT;
+
+typedef struct
+{
+    BATCH_CONTEXT *context;
+    unsigned int index;
+    pthread_t thread;
+
+    CHP chip8;
+
+    unsigned int stolen;
+} BATCH_WORKER;
+
+struct BATCH_CONTEXT
+{
+    const BATCH_CONFIG *config;
+
+    BATCH_JOB *jobs;
+    BATCH_RESULT *results;
+    unsigned int job_count;
+
+    BATCH_QUEUE queues[BATCH_MAX_THREADS];
+    BATCH_WORKER *workers;
+    unsigned int worker_count;
+
+    // Mapped for the whole batch when the jobs come from a pack
+    PACK *pack;
+};
+
+static const char *exit_reasons[] = { "completed", "halted", "load_failed", "bad_script", "truncated", "too_large", "corrupt" };
+
+// Exit reasons for the ROM_ results that stop a job
+static const int load_failures[] =
+{
+    [ROM_MISSING] = BATCH_LOAD_FAILED,
+    [ROM_TRUNCATED] = BATCH_TRUNCATED,
+    [ROM_TOO_LARGE] = BATCH_TOO_LARGE,
+    [ROM_CORRUPT] = BATCH_CORRUPT
+};
+
+
+// --- Input scripts ---
+
+// Reads lines of "<frame> <key> <down|up>", with the key in hex. Blank lines
+// and lines starting with '#' are ignored, and frames may not go backwards.
+// Returns the number of events, or -1 when the script is invalid.
+static int load_script(const char *path, BATCH_EVENT **events)
+{
+    FILE *fptr = fopen(path, "r");
+
+    if (fptr == NULL)
+    {
+        return -1;
+    }
+
+    char line[256];
+    int count = 0;
+    int capacity = 0;
+
+    *events = NULL;
+
+    while (fgets(line, sizeof(line), fptr))
+    {
+        unsigned long long frame;
+        unsigned int key;
+        char state[8];
+
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+
+        if (sscanf(line, "%llu %x %7s", &frame, &key, state) != 3 || key >= KEYPAD_SIZE ||
+            (strcmp(state, "down") != 0 && strcmp(state, "up") != 0) ||
+            (count > 0 && frame < (*events)[count - 1].frame))
+        {
+            count = -1;
+            break;
+        }
+
+        if (count == capacity)
+        {
+            unsigned int grown = capacity ? capacity * 2 : 16;
+            BATCH_EVENT *resized = realloc(*events, grown * sizeof(BATCH_EVENT));
+
+            if (resized == NULL)
+            {
+                count = -1;
+                break;
+            }
+
+            *events = resized;
+            capacity = grown;
+        }
+
+        (*events)[count].frame = frame;
+        (*events)[count].key = key;
+        (*events)[count].down = strcmp(state, "down") == 0;
+        count += 1;
+    }
+
+    fclose(fptr);
+
+    if (count < 0)
+    {
+        free(*events);
+        *events = NULL;
+    }
+
+    return count;
+}
+
+
+// --- Running jobs ---
+
+// Whether the next instruction is a jump to itself
+static int halted(CHP *chip8)
+{
+    return fetch(chip8) == (0x1000 | (chip8->PC & 0x0FFF));
+}
+
+void run_batch_job(const BATCH_JOB *job, unsigned int instructions_per_frame, JIT *jit, CHP *chip8, BATCH_RESULT *result)
+{
+    BATCH_EVENT *events = NULL;
+    int event_count = 0;
+    int next_event = 0;
+
+    uint64_t start = monotonic_ns();
+
+    result->frames = 0;
+    result->instructions = 0;
+    result->display_hash = 0;
+
+    initialise_chip8(chip8);
+    seed_random(chip8, job->seed);
+    set_quirks(chip8, job->quirks);
+
+    // ROMs in a pack are copied out of its mapping, without any file access
+    int loaded = job->pack ? pack_load(job->pack, job->pack_index, chip8) : load_rom_file(job->rom_path, chip8);
+
+    if (loaded != ROM_LOADED)
+    {
+        result->exit_reason = load_failures[loaded];
+        result->wall_ns = monotonic_ns() - start;
+        return;
+    }
+
+    if (job->instructions_per_frame > 0)
+    {
+        instructions_per_frame = job->instructions_per_frame;
+    }
+
+    if (job->script_path[0] != '\0')
+    {
+        event_count = load_script(job->script_path, &events);
+
+        if (event_count < 0)
+        {
+            result->exit_reason = BATCH_BAD_SCRIPT;
+            result->wall_ns = monotonic_ns() - start;
+            return;
+        }
+    }
+
+    if (jit)
+    {
+        jit_flush(jit);
+    }
+
+    result->exit_reason = BATCH_COMPLETED;
+
+    while (result->frames < job->frames)
+    {
+        while (next_event < event_count && events[next_event].frame <= result->frames)
+        {
+            set_key(chip8, events[next_event].key, events[next_event].down);
+            next_event += 1;
+        }
+
+        if (jit)
+        {
+            jit_run_frame(jit, chip8, instructions_per_frame);
+        } else
+        {
+            run_frame(chip8, instructions_per_frame);
+        }
+
+        result->frames += 1;
+        result->instructions += instructions_per_frame;
+
+        // Nothing can change once the program spins on itself with no input
+        // left to come
+        if (next_event == event_count && halted(chip8))
+        {
+            result->exit_reason = BATCH_HALTED;
+            break;
+        }
+    }
+
+    free(events);
+
+    result->display_hash = display_hash(chip8);
+    result->wall_ns = monotonic_ns() - start;
+}
+
+
+// --- Work stealing ---
+
+static int take_job(BATCH_CONTEXT *context, unsigned int worker, unsigned int *job)
+{
+    BATCH_QUEUE *own = &context->queues[worker];
+    int found = 0;
+
+    pthread_mutex_lock(&own->lock);
+
+    if (own->head < own->tail)
+    {
+        own->tail -= 1;
+        *job = own->tail;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&own->lock);
+
+    // Out of work, so take the oldest job from the next worker that has any
+    for (unsigned int i = 1; i < context->worker_count && !found; i++)
+    {
+        BATCH_QUEUE *victim = &context->queues[(worker + i) % context->worker_count];
+
+        pthread_mutex_lock(&victim->lock);
+
+        if (victim->head < victim->tail)
+        {
+            *job = victim->head;
+            victim->head += 1;
+            found = 1;
+            context->workers[worker].stolen += 1;
+        }
+
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return found;
+}
+
+static void pin_to_core(unsigned int index)
+{
+#if defined(__linux__)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(index % (cores > 0 ? cores : 1), &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        fprintf(stderr, "Could not pin worker %u to a core.\n", index);
+    }
+#else
+    (void)index;
+#endif
+}
+
+static void *worker_main(void *argument)
+{
+    BATCH_WORKER *worker = argument;
+    BATCH_CONTEXT *context = worker->context;
+    const BATCH_CONFIG *config = context->config;
+    JIT *jit = NULL;
+    unsigned int job;
+
+    if (config->pin)
+    {
+        pin_to_core(worker->index);
+    }
+
+    if (config->jit)
+    {
+        jit = jit_create(JIT_MAX_BLOCK_LENGTH);
+    }
+
+    while (take_job(context, worker->index, &job))
+    {
+        run_batch_job(&context->jobs[job], config->instructions_per_frame, jit, &worker->chip8, &context->results[job]);
+        context->results[job].worker = worker->index;
+    }
+
+    if (jit)
+    {
+        jit_destroy(jit);
+    }
+
+    return NULL;
+}
+
+
+// --- Finding jobs ---
+
+static int add_job(BATCH_CONTEXT *context, unsigned int *capacity, const char *rom_path, uint64_t frames, const char *script_path, uint64_t seed)
+{
+    if (context->job_count == *capacity)
+    {
+        unsigned int grown = *capacity ? *capacity * 2 : 64;
+        BATCH_JOB *resized = realloc(context->jobs, grown * sizeof(BATCH_JOB));
+
+        if (resized == NULL)
+        {
+            fprintf(stderr, "Out of memory for the batch jobs.\n");
+            return -1;
+        }
+
+        context->jobs = resized;
+        *capacity = grown;
+    }
+
+    BATCH_JOB *job = &context->jobs[context->job_count];
+
+    // Both paths are already known to fit
+    strcpy(job->rom_path, rom_path);
+    strcpy(job->script_path, script_path);
+    job->frames = frames;
+    job->seed = seed;
+    job->quirks = context->config->quirks;
+    job->pack = NULL;
+    job->pack_index = 0;
+    job->instructions_per_frame = 0;
+
+    context->job_count += 1;
+
+    return 0;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    return strcmp(((const BATCH_JOB *)a)->rom_path, ((const BATCH_JOB *)b)->rom_path);
+}
+
+// Every regular file in the directory is a ROM, run in name order
+static int find_directory_jobs(BATCH_CONTEXT *context, const char *path)
+{
+    DIR *directory = opendir(path);
+    unsigned int capacity = 0;
+    struct dirent *entry;
+    char rom_path[BATCH_PATH_SIZE];
+
+    if (directory == NULL)
+    {
+        fprintf(stderr, "Invalid batch directory: '%s'\n", path);
+        return -1;
+    }
+
+    while ((entry = readdir(directory)) != NULL)
+    {
+        struct stat info;
+
+        if (snprintf(rom_path, sizeof(rom_path), "%s/%s", path, entry->d_name) >= (int)sizeof(rom_path))
+        {
+            continue;
+        }
+
+        if (stat(rom_path, &info) == 0 && S_ISREG(info.st_mode))
+        {
+            if (add_job(context, &capacity, rom_path, context->config->frames, "", context->config->seed) != 0)
+            {
+                closedir(directory);
+                return -1;
+            }
+        }
+    }
+
+    closedir(directory);
+
+    qsort(context->jobs, context->job_count, sizeof(BATCH_JOB), compare_jobs);
+
+    return 0;
+}
+
+// Every ROM in the pack, in the order they were packed, run with the speed
+// and quirks stored alongside it
+static int find_pack_jobs(BATCH_CONTEXT *context, const char *path)
+{
+    unsigned int capacity = 0;
+
+    context->pack = pack_open(path);
+
+    if (context->pack == NULL)
+    {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < pack_count(context->pack); i++)
+    {
+        PACK_ROM rom;
+
+        // Damaged entries still get a job, which reports why they failed
+        pack_get(context->pack, i, &rom);
+
+        if (add_job(context, &capacity, "", context->config->frames, "", context->config->seed) != 0)
+        {
+            return -1;
+        }
+
+        BATCH_JOB *job = &context->jobs[context->job_count - 1];
+
+        snprintf(job->rom_path, sizeof(job->rom_path), "%s", rom.name ? rom.name : "");
+        job->quirks |= rom.quirks;
+        job->pack = context->pack;
+        job->pack_index = i;
+        job->instructions_per_frame = rom.instructions_per_frame;
+    }
+
+    return 0;
+}
+
+// Whether the file starts with the pack magic
+static int is_pack(const char *path)
+{
+    char magic[4];
+    FILE *fptr = fopen(path, "rb");
+
+    if (fptr == NULL)
+    {
+        return 0;
+    }
+
+    int found = fread(magic, 1, sizeof(magic), fptr) == sizeof(magic) && memcmp(magic, PACK_MAGIC, 4) == 0;
+
+    fclose(fptr);
+
+    return found;
+}
+
+// Each line is "<rom> [frames [script [seed]]]", where a budget of zero
+// means the default and a script of "-" means none. Blank lines and lines
+// starting with '#' are ignored.
+static int find_listed_jobs(BATCH_CONTEXT *context, const char *path)
+{
+    FILE *fptr = fopen(path, "r");
+    unsigned int capacity = 0;
+    char line[3 * BATCH_PATH_SIZE];
+    unsigned int number = 0;
+
+    if (fptr == NULL)
+    {
+        fprintf(stderr, "Invalid batch list: '%s'\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fptr))
+    {
+        char rom_path[BATCH_PATH_SIZE];
+        char script_path[BATCH_PATH_SIZE] = "";
+        unsigned long long frames = 0;
+        unsigned long long seed = context->config->seed;
+
+        number += 1;
+
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+
+        if (sscanf(line, "%1023s %llu %1023s %llu", rom_path, &frames, script_path, &seed) < 1)
+        {
+            fprintf(stderr, "Invalid job on line %u of '%s'\n", number, path);
+            fclose(fptr);
+            return -1;
+        }
+
+        if (strcmp(script_path, "-") == 0)
+        {
+            script_path[0] = '\0';
+        }
+
+        if (add_job(context, &capacity, rom_path, frames ? frames : context->config->frames, script_path, seed) != 0)
+        {
+            fclose(fptr);
+            return -1;
+        }
+    }
+
+    fclose(fptr);
+
+    return 0;
+}
+
+
+// --- Writing results ---
+
+static void write_csv_string(FILE *output, const char *text)
+{
+    fputc('"', output);
+
+    for (; *text; text++)
+    {
+        // Quotes are escaped by doubling them
+        if (*text == '"')
+        {
+            fputc('"', output);
+        }
+
+        fputc(*text, output);
+    }
+
+    fputc('"', output);
+}
+
+static void write_json_string(FILE *output, const char *text)
+{
+    fputc('"', output);
+
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+        {
+            fprintf(output, "\\%c", *text);
+        } else if ((unsigned char)*text < 0x20)
+        {
+            fprintf(output, "\\u%04x", *text);
+        } else
+        {
+            fputc(*text, output);
+        }
+    }
+
+    fputc('"', output);
+}
+
+static void write_results(const BATCH_CONTEXT *context, FILE *output)
+{
+    if (context->config->format == BATCH_JSON)
+    {
+        fprintf(output, "[\n");
+    } else
+    {
+        fprintf(output, "rom,script,seed,frames,instructions,exit_reason,display_hash,wall_ms,worker\n");
+    }
+
+    for (unsigned int i = 0; i < context->job_count; i++)
+    {
+        const BATCH_JOB *job = &context->jobs[i];
+        const BATCH_RESULT *result = &context->results[i];
+
+        if (context->config->format == BATCH_JSON)
+        {
+            fprintf(output, "  { \"rom\": ");
+            write_json_string(output, job->rom_path);
+            fprintf(output, ", \"script\": ");
+            write_json_string(output, job->script_path);
+            fprintf(output, ", \"seed\": %llu, \"frames\": %llu, \"instructions\": %llu, \"exit_reason\": \"%s\", "
+                    "\"display_hash\": \"%016llx\", \"wall_ms\": %.3f, \"worker\": %u }%s\n",
+                    (unsigned long long)job->seed, (unsigned long long)result->frames, (unsigned long long)result->instructions,
+                    exit_reasons[result->exit_reason], (unsigned long long)result->display_hash,
+                    result->wall_ns / 1e6, result->worker, i + 1 < context->job_count ? "," : "");
+        } else
+        {
+            write_csv_string(output, job->rom_path);
+            fputc(',', output);
+            write_csv_string(output, job->script_path);
+            fprintf(output, ",%llu,%llu,%llu,%s,%016llx,%.3f,%u\n",
+                    (unsigned long long)job->seed, (unsigned long long)result->frames, (unsigned long long)result->instructions,
+                    exit_reasons[result->exit_reason], (unsigned long long)result->display_hash,
+                    result->wall_ns / 1e6, result->worker);
+        }
+    }
+
+    if (context->config->format == BATCH_JSON)
+    {
+        fprintf(output, "]\n");
+    }
+}
+
+
+int run_batch(const BATCH_CONFIG *config)
+{
+    BATCH_CONTEXT context;
+    struct stat info;
+
+    memset(&context, 0, sizeof(context));
+    context.config = config;
+
+    if (config->instructions_per_frame == 0 || config->threads > BATCH_MAX_THREADS)
+    {
+        fprintf(stderr, "Invalid batch configuration.\n");
+        return -1;
+    }
+
+    int found = stat(config->jobs_path, &info) == 0 && S_ISDIR(info.st_mode)
+        ? find_directory_jobs(&context, config->jobs_path)
+        : is_pack(config->jobs_path)
+        ? find_pack_jobs(&context, config->jobs_path)
+        : find_listed_jobs(&context, config->jobs_path);
+
+    if (found != 0)
+    {
+        free(context.jobs);
+
+        if (context.pack)
+        {
+            pack_close(context.pack);
+        }
+
+        return -1;
+    }
+
+    FILE *output = stdout;
+
+    if (config->output_path)
+    {
+        output = fopen(config->output_path, "w");
+
+        if (output == NULL)
+        {
+            fprintf(stderr, "Could not open '%s' for writing.\n", config->output_path);
+            free(context.jobs);
+
+            if (context.pack)
+            {
+                pack_close(context.pack);
+            }
+
+            return -1;
+        }
+    }
+
+    context.worker_count = config->threads;
+
+    if (context.worker_count == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        context.worker_count = cores < 1 ? 1 : cores > BATCH_MAX_THREADS ? BATCH_MAX_THREADS : cores;
+    }
+
+    context.results = calloc(context.job_count ? context.job_count : 1, sizeof(BATCH_RESULT));
+    context.workers = calloc(context.worker_count, sizeof(BATCH_WORKER));
+
+    if (context.results == NULL || context.workers == NULL)
+    {
+        fprintf(stderr, "Out of memory for the batch results.\n");
+        free(context.workers);
+        free(context.results);
+        free(context.jobs);
+
+        if (output != stdout)
+        {
+            fclose(output);
+        }
+
+        if (context.pack)
+        {
+            pack_close(context.pack);
+        }
+
+        return -1;
+    }
+
+    // Each worker starts with an equal run of the jobs, and the ones that
+    // finish early steal from the rest
+    for (unsigned int i = 0; i < context.worker_count; i++)
+    {
+        pthread_mutex_init(&context.queues[i].lock, NULL);
+        context.queues[i].head = (uint64_t)context.job_count * i / context.worker_count;
+        context.queues[i].tail = (uint64_t)context.job_count * (i + 1) / context.worker_count;
+
+        context.workers[i].context = &context;
+        context.workers[i].index = i;
+    }
+
+    uint64_t start = monotonic_ns();
+
+    int started[BATCH_MAX_THREADS];
+
+    for (unsigned int i = 0; i < context.worker_count; i++)
+    {
+        started[i] = pthread_create(&context.workers[i].thread, NULL, worker_main, &context.workers[i]) == 0;
+
+        if (!started[i])
+        {
+            fprintf(stderr, "Could not start worker %u, running its jobs on this thread.\n", i);
+        }
+    }
+
+    // A worker that never started still has its queue, which this thread
+    // works through, stealing from the others like any worker would
+    for (unsigned int i = 0; i < context.worker_count; i++)
+    {
+        if (!started[i])
+        {
+            worker_main(&context.workers[i]);
+        }
+    }
+
+    unsigned int stolen = 0;
+
+    for (unsigned int i = 0; i < context.worker_count; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(context.workers[i].thread, NULL);
+        }
+
+        stolen += context.workers[i].stolen;
+    }
+
+    // Workers steal from every queue, so none can go until all have stopped
+    for (unsigned int i = 0; i < context.worker_count; i++)
+    {
+        pthread_mutex_destroy(&context.queues[i].lock);
+    }
+
+    uint64_t elapsed = monotonic_ns() - start;
+
+    write_results(&context, output);
+
+    int failed = 0;
+
+    for (unsigned int i = 0; i < context.job_count; i++)
+    {
+        failed += context.results[i].exit_reason != BATCH_COMPLETED && context.results[i].exit_reason != BATCH_HALTED;
+    }
+
+    // Results may be going to standard output, so the summary goes elsewhere
+    fprintf(stderr, "%u jobs on %u threads in %.3f ms, %u stolen, %d failed\n",
+            context.job_count, context.worker_count, elapsed / 1e6, stolen, failed);
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+
+    free(context.workers);
+    free(context.results);
+    free(context.jobs);
+
+    if (context.pack)
+    {
+        pack_close(context.pack);
+    }
+
+    return failed;
+}
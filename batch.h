@@ -0,0 +1,104 @@
+#ifndef BATCH_HEADER
+#define BATCH_HEADER
+
+#include <stdint.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "pack.h"
+
+#define BATCH_DEFAULT_FRAMES 600
+#define BATCH_MAX_THREADS 256
+#define BATCH_PATH_SIZE 1024
+
+// Why a job stopped running
+enum
+{
+    BATCH_COMPLETED,   // Ran for its whole budget
+    BATCH_HALTED,      // Reached a jump to itself, so nothing more can happen
+    BATCH_LOAD_FAILED, // The ROM could not be opened
+    BATCH_BAD_SCRIPT,  // The input script could not be read
+    BATCH_TRUNCATED,   // The ROM ended early, or its file could not be read in full
+    BATCH_TOO_LARGE,   // The ROM does not fit in memory
+    BATCH_CORRUPT      // The ROM in a pack does not match its hash
+};
+
+enum
+{
+    BATCH_CSV,
+    BATCH_JSON
+};
+
+typedef struct
+{
+    char rom_path[BATCH_PATH_SIZE];
+
+    // Optional input script, empty when the job runs without input
+    char script_path[BATCH_PATH_SIZE];
+
+    // Budget in 60 Hz frames
+    uint64_t frames;
+
+    // Seed for the machine's random number generator
+    uint64_t seed;
+
+    // QUIRK_ flags to run the ROM with
+    unsigned int quirks;
+
+    // Pack holding the ROM, in which case rom_path is its name there
+    const PACK *pack;
+    unsigned int pack_index;
+
+    // Instructions per frame for this ROM, 0 to use the batch's
+    unsigned int instructions_per_frame;
+} BATCH_JOB;
+
+typedef struct
+{
+    int exit_reason;
+
+    uint64_t frames;
+    uint64_t instructions;
+    uint64_t display_hash;
+    uint64_t wall_ns;
+
+    // Thread that ran the job
+    unsigned int worker;
+} BATCH_RESULT;
+
+typedef struct
+{
+    // A directory of ROMs, a pack of them, or a file listing one job per line
+    const char *jobs_path;
+
+    // Where results are written, standard output when NULL
+    const char *output_path;
+    int format;
+
+    // Number of worker threads, one per online core when zero
+    unsigned int threads;
+
+    // Pin each worker thread to its own core
+    int pin;
+
+    // Run each job through a JIT owned by its worker
+    int jit;
+
+    unsigned int instructions_per_frame;
+
+    // Budget and seed for jobs that do not give their own
+    uint64_t frames;
+    uint64_t seed;
+
+    // QUIRK_ flags for every job
+    unsigned int quirks;
+} BATCH_CONFIG;
+
+// Runs a single job from a freshly initialised machine. jit may be NULL.
+void run_batch_job(const BATCH_JOB *job, unsigned int instructions_per_frame, JIT *jit, CHP *chip8, BATCH_RESULT *result);
+
+// Writes a result for every job, then returns how many of them could not
+// be loaded, or -1 when the batch could not be run at all
+int run_batch(const BATCH_CONFIG *config);
+
+#endif
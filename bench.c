@@ -0,0 +1,260 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "scheduler.h"
+
+typedef struct
+{
+    uint64_t instructions;
+    uint64_t frames;
+    uint64_t idle_instructions;
+    uint64_t elapsed_ns;
+    double lanes_per_dispatch;
+} BENCH_RESULT;
+
+static void run_lockstep_once(const CHP *loaded, const BENCH_CONFIG *config, BENCH_RESULT *result)
+{
+    static LOCKSTEP group;
+
+    initialise_lockstep(&group, loaded, LOCKSTEP_LANES);
+
+    uint64_t start = monotonic_ns();
+
+    if (config->frames > 0)
+    {
+        for (uint64_t i = 0; i < config->frames; i++)
+        {
+            lockstep_run_frame(&group, config->instructions_per_frame);
+        }
+
+        result->frames = config->frames;
+    } else
+    {
+        uint64_t remaining = config->instructions;
+
+        while (remaining > 0)
+        {
+            unsigned int count = remaining < config->instructions_per_frame ? remaining : config->instructions_per_frame;
+
+            lockstep_run(&group, count);
+
+            remaining -= count;
+
+            if (count == config->instructions_per_frame)
+            {
+                lockstep_tick_timers(&group);
+            }
+        }
+
+        result->frames = config->instructions / config->instructions_per_frame;
+    }
+
+    result->elapsed_ns = monotonic_ns() - start;
+
+    // Rates are reported summed over the whole group
+    result->instructions = group.instructions;
+    result->frames *= LOCKSTEP_LANES;
+    result->idle_instructions = 0;
+    result->lanes_per_dispatch = (double)group.instructions / group.dispatches;
+
+    for (unsigned int l = 0; l < LOCKSTEP_LANES; l++)
+    {
+        result->idle_instructions += group.lanes[l].idle_instructions;
+    }
+}
+
+
+static void run_once(const CHP *loaded, const BENCH_CONFIG *config, JIT *jit, BENCH_RESULT *result)
+{
+    static CHP chip8;
+
+    if (config->lockstep)
+    {
+        run_lockstep_once(loaded, config, result);
+        return;
+    }
+
+    // Every run starts from the same freshly loaded machine
+    memcpy(&chip8, loaded, sizeof(chip8));
+
+    // Translation is part of what is being measured, so each run starts cold
+    if (jit)
+    {
+        jit_flush(jit);
+    }
+
+    uint64_t start = monotonic_ns();
+
+    if (config->frames > 0)
+    {
+        for (uint64_t i = 0; i < config->frames; i++)
+        {
+            if (jit)
+            {
+                jit_run_frame(jit, &chip8, config->instructions_per_frame);
+            } else
+            {
+                run_frame(&chip8, config->instructions_per_frame);
+            }
+        }
+
+        result->instructions = config->frames * config->instructions_per_frame;
+        result->frames = config->frames;
+    } else
+    {
+        uint64_t remaining = config->instructions;
+
+        // Keep the timers running at the same rate as in a real session
+        while (remaining > 0)
+        {
+            unsigned int count = remaining < config->instructions_per_frame ? remaining : config->instructions_per_frame;
+
+            if (jit)
+            {
+                jit_run(jit, &chip8, count);
+            } else
+            {
+                run_instructions(&chip8, count);
+            }
+
+            remaining -= count;
+
+            if (count == config->instructions_per_frame)
+            {
+                tick_timers(&chip8);
+            }
+        }
+
+        result->instructions = config->instructions;
+        result->frames = config->instructions / config->instructions_per_frame;
+    }
+
+    result->elapsed_ns = monotonic_ns() - start;
+    result->idle_instructions = chip8.idle_instructions;
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static void print_summary(const char *name, double *values, unsigned int count)
+{
+    qsort(values, count, sizeof(double), compare_doubles);
+
+    double median = values[count / 2];
+
+    if (count % 2 == 0)
+    {
+        median = (values[count / 2 - 1] + values[count / 2]) / 2;
+    }
+
+    printf("%-16s min %14.3f  median %14.3f  max %14.3f\n", name, values[0], median, values[count - 1]);
+}
+
+
+int run_benchmark(const char *rom_path, const BENCH_CONFIG *config)
+{
+    static CHP loaded;
+
+    BENCH_RESULT result = { 0 };
+    double instruction_rates[BENCH_MAX_REPEATS];
+    double frame_rates[BENCH_MAX_REPEATS];
+    double wall_times[BENCH_MAX_REPEATS];
+
+    if (config->repeats == 0 || config->repeats > BENCH_MAX_REPEATS || config->instructions_per_frame == 0)
+    {
+        printf("Invalid benchmark configuration.\n");
+        return -1;
+    }
+
+    if (config->jit && config->lockstep)
+    {
+        printf("The JIT and lockstep groups cannot be benchmarked together.\n");
+        return -1;
+    }
+
+    JIT *jit = NULL;
+
+    if (config->jit)
+    {
+        jit = jit_create(JIT_MAX_BLOCK_LENGTH);
+
+        if (!jit)
+        {
+            printf("JIT unavailable on this host, benchmarking the interpreter instead.\n");
+        }
+    }
+
+    initialise_chip8(&loaded);
+    set_quirks(&loaded, config->quirks);
+
+    if (load_rom(rom_path, &loaded) != 0)
+    {
+        if (jit)
+        {
+            jit_destroy(jit);
+        }
+
+        return -1;
+    }
+
+    if (config->frames > 0)
+    {
+        printf("Benchmarking '%s': %u runs of %llu frames at %u instructions per frame\n",
+               rom_path, config->repeats, (unsigned long long)config->frames, config->instructions_per_frame);
+    } else
+    {
+        printf("Benchmarking '%s': %u runs of %llu instructions at %u instructions per frame\n",
+               rom_path, config->repeats, (unsigned long long)config->instructions, config->instructions_per_frame);
+    }
+
+    for (unsigned int i = 0; i < config->repeats; i++)
+    {
+        run_once(&loaded, config, jit, &result);
+
+        double seconds = result.elapsed_ns / 1e9;
+
+        instruction_rates[i] = result.instructions / seconds;
+        frame_rates[i] = result.frames / seconds;
+        wall_times[i] = result.elapsed_ns / 1e6;
+
+        printf("run %-4u %12llu instructions %10.3f ms %14.1f instructions/s %12.1f frames/s\n",
+               i + 1, (unsigned long long)result.instructions, wall_times[i], instruction_rates[i], frame_rates[i]);
+    }
+
+    print_summary("instructions/s", instruction_rates, config->repeats);
+    print_summary("frames/s", frame_rates, config->repeats);
+    print_summary("wall time (ms)", wall_times, config->repeats);
+
+    // Every run executes the same program, so report the last one
+    printf("%-16s %.1f%% of instructions fast-forwarded in idle loops\n", "idle",
+           100.0 * result.idle_instructions / result.instructions);
+
+    if (config->lockstep)
+    {
+        printf("%-16s %u instances, %.2f running together per dispatch\n", "lockstep",
+               LOCKSTEP_LANES, result.lanes_per_dispatch);
+    }
+
+    if (jit)
+    {
+        printf("%-16s %llu blocks translated, %llu flushes\n", "jit",
+               (unsigned long long)jit_blocks_translated(jit), (unsigned long long)jit_flushes(jit));
+
+        jit_destroy(jit);
+    }
+
+    return 0;
+}
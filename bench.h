@@ -0,0 +1,32 @@
+#ifndef BENCH_HEADER
+#define BENCH_HEADER
+
+#include <stdint.h>
+
+#define BENCH_DEFAULT_FRAMES 100000
+#define BENCH_DEFAULT_REPEATS 5
+#define BENCH_MAX_REPEATS 1000
+
+typedef struct
+{
+    // Exactly one of these is non-zero: run a fixed number of instructions
+    // or a fixed number of 60 Hz frames
+    uint64_t instructions;
+    uint64_t frames;
+
+    unsigned int instructions_per_frame;
+    unsigned int repeats;
+
+    // Run the translated code instead of the interpreter when available
+    int jit;
+
+    // Run a group of LOCKSTEP_LANES copies of the ROM together instead of one
+    int lockstep;
+
+    // QUIRK_ flags to run the ROM with
+    unsigned int quirks;
+} BENCH_CONFIG;
+
+int run_benchmark(const char *rom_path, const BENCH_CONFIG *config);
+
+#endif
@@ -1,30 +1,9 @@
 #include "chip8.h"
 
-#include <SDL2/SDL.h>
-
-static int keymap[0x10] = 
-{
-    SDL_SCANCODE_0,
-    SDL_SCANCODE_1,
-    SDL_SCANCODE_2,
-    SDL_SCANCODE_3,
-    SDL_SCANCODE_4,
-    SDL_SCANCODE_5,
-    SDL_SCANCODE_6,
-    SDL_SCANCODE_7,
-    SDL_SCANCODE_8,
-    SDL_SCANCODE_9,
-    SDL_SCANCODE_A,
-    SDL_SCANCODE_B,
-    SDL_SCANCODE_C,
-    SDL_SCANCODE_D,
-    SDL_SCANCODE_E,
-    SDL_SCANCODE_F
-};
-
-unsigned char pixel_coords[64][32];
+#include <stdio.h>
+#include <string.h>
 
-unsigned char font[80] =
+const unsigned char font[80] =
 {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -44,8 +23,10 @@ unsigned char font[80] =
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-CHP chip8;
-SDLapp app;
+static inline uint64_t rotate_right(uint64_t value, unsigned int shift)
+{
+    return (value >> shift) | (value << ((64 - shift) & 63));
+}
 
 void initialise_chip8(CHP *chip8)
 {	
@@ -61,32 +42,174 @@ void initialise_chip8(CHP *chip8)
     memset(chip8->memory, 0, sizeof(chip8->memory));
     memset(chip8->stack, 0, sizeof(chip8->stack));
     memset(chip8->V, 0, sizeof(chip8->V));
+    chip8->keypad = 0;
+    chip8->key_wait = 0;
+
+    // Start with a blank screen
+    memset(chip8->display, 0, sizeof(chip8->display));
+    chip8->draw_flag = 1;
+    chip8->sound_flag = 0;
 
     // Load the font into memory
     memcpy(chip8->memory, font, sizeof(font));
+
+    // Nothing has been decoded yet
+    invalidate_instructions(chip8, 0, MEMORY_SIZE);
+
+    chip8->idle_instructions = 0;
+    seed_random(chip8, 0);
+    chip8->quirks = 0;
+}
+
+
+int load_program(CHP *chip8, const unsigned char *program, size_t size)
+{
+    if (size > MAX_PROGRAM_SIZE)
+    {
+        return ROM_TOO_LARGE;
+    }
+
+    memcpy(chip8->memory + PROGRAM_START, program, size);
+    invalidate_instructions(chip8, PROGRAM_START, size);
+
+    return ROM_LOADED;
 }
 
 
-void load_rom(const char* rom_path, CHP *chip8)
+int load_rom_file(const char *rom_path, CHP *chip8)
 {
+    unsigned char program[MAX_PROGRAM_SIZE];
+
     FILE *fptr = fopen(rom_path, "rb");
 
     if (fptr == NULL)
     {
-        printf("Invalid ROM path: '%s'\n", rom_path);
-    } else {
-        // Load the program into the program space of memory
-        fread(chip8->memory + 0x200, sizeof(char), sizeof(chip8->memory) - 0x200, fptr);
+        return ROM_MISSING;
+    }
+
+    size_t size = fread(program, 1, sizeof(program), fptr);
+
+    // A full buffer could be the whole ROM or only the start of it
+    int result = ferror(fptr) ? ROM_TRUNCATED
+        : size == sizeof(program) && fgetc(fptr) != EOF ? ROM_TOO_LARGE
+        : ROM_LOADED;
+
+    fclose(fptr);
 
-        fclose(fptr);
+    if (result != ROM_LOADED)
+    {
+        return result;
     }
+
+    return load_program(chip8, program, size);
+}
+
+
+int load_rom(const char* rom_path, CHP *chip8)
+{
+    switch (load_rom_file(rom_path, chip8))
+    {
+        case ROM_LOADED:
+            return 0;
+        case ROM_MISSING:
+            printf("Invalid ROM path: '%s'\n", rom_path);
+            break;
+        case ROM_TOO_LARGE:
+            printf("ROM is larger than the %d bytes of program space: '%s'\n", MAX_PROGRAM_SIZE, rom_path);
+            break;
+        default:
+            printf("Could not read ROM: '%s'\n", rom_path);
+            break;
+    }
+
+    return -1;
+}
+
+
+// Names of the quirks, in the order of the QUIRK_ bits
+static const char *quirk_names[] = { "shift", "load-store", "jump", "clip", "vf-reset" };
+
+int parse_quirks(const char *list, unsigned int *quirks)
+{
+    char names[256];
+
+    *quirks = 0;
+
+    if (strcmp(list, "vip") == 0)
+    {
+        *quirks = QUIRK_LOAD_STORE_I | QUIRK_CLIP_SPRITES | QUIRK_VF_RESET;
+        return 0;
+    } else if (strcmp(list, "schip") == 0)
+    {
+        *quirks = QUIRK_SHIFT_VX | QUIRK_JUMP_VX | QUIRK_CLIP_SPRITES;
+        return 0;
+    } else if (strcmp(list, "none") == 0)
+    {
+        return 0;
+    }
+
+    snprintf(names, sizeof(names), "%s", list);
+
+    for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        unsigned int i = 0;
+
+        while (i < sizeof(quirk_names) / sizeof(quirk_names[0]) && strcmp(name, quirk_names[i]) != 0)
+        {
+            i++;
+        }
+
+        if (i == sizeof(quirk_names) / sizeof(quirk_names[0]))
+        {
+            printf("Unknown quirk: '%s'\n", name);
+            return -1;
+        }
+
+        *quirks |= 1 << i;
+    }
+
+    return 0;
+}
+
+
+void seed_random(CHP *chip8, uint64_t seed)
+{
+    // SplitMix64 spreads any seed, even 0, over the generator's whole state
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    // xorshift never leaves, or reaches, a state of zero
+    chip8->random_state = z ? z : 1;
+}
+
+void set_key(CHP *chip8, unsigned int key, int down)
+{
+    uint16_t bit = 1 << (key & 0xF);
+
+    chip8->keypad = down ? chip8->keypad | bit : chip8->keypad & ~bit;
+}
+
+// xorshift64*, keeping the top byte of the product since it is the best mixed
+static inline unsigned char next_random(CHP *chip8)
+{
+    uint64_t x = chip8->random_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    chip8->random_state = x;
+
+    return (x * 0x2545F4914F6CDD1DULL) >> 56;
 }
 
 
 unsigned short fetch(CHP *chip)
 {	
-    unsigned short large = (unsigned short)chip8.memory[chip8.PC] << 8;
-    unsigned short small = (unsigned short)chip8.memory[chip8.PC + 1];
+    unsigned short large = (unsigned short)chip->memory[chip->PC & (MEMORY_SIZE - 1)] << 8;
+    unsigned short small = (unsigned short)chip->memory[(chip->PC + 1) & (MEMORY_SIZE - 1)];
 	
     // Combine large and small bytes to get final opcode
     // 0x00FF is ANDed with small to remove C sign extension
@@ -96,311 +219,1107 @@ unsigned short fetch(CHP *chip)
 }	
 
 
-void decode(unsigned short opcode, CHP *chip8)
+// Secondary lookup tables for the opcode families that share a top nibble.
+// Anything not listed decodes to OP_NOP, which is ignored like before.
+static const unsigned char primary_ops[0x10] =
+{
+    OP_NOP,  OP_1NNN, OP_2NNN, OP_3XNN, OP_4XNN, OP_5XY0, OP_6XNN, OP_7XNN,
+    OP_NOP,  OP_9XY0, OP_ANNN, OP_BNNN, OP_CXNN, OP_DXYN, OP_NOP,  OP_NOP
+};
+
+static const unsigned char alu_ops[0x10] =
+{
+    [0x0] = OP_8XY0,
+    [0x1] = OP_8XY1,
+    [0x2] = OP_8XY2,
+    [0x3] = OP_8XY3,
+    [0x4] = OP_8XY4,
+    [0x5] = OP_8XY5,
+    [0x6] = OP_8XY6,
+    [0x7] = OP_8XY7,
+    [0xE] = OP_8XYE
+};
+
+static const unsigned char key_ops[0x100] =
 {
-    unsigned short x;
-    unsigned short y;
-    unsigned short n;
-    unsigned short value;
+    [0x9E] = OP_EX9E,
+    [0xA1] = OP_EXA1
+};
+
+static const unsigned char misc_ops[0x100] =
+{
+    [0x07] = OP_FX07,
+    [0x0A] = OP_FX0A,
+    [0x15] = OP_FX15,
+    [0x18] = OP_FX18,
+    [0x1E] = OP_FX1E,
+    [0x29] = OP_FX29,
+    [0x33] = OP_FX33,
+    [0x55] = OP_FX55,
+    [0x65] = OP_FX65
+};
 
-    Uint8 *keyboard;
+
+void decode_instruction(unsigned short opcode, INSTRUCTION *ins)
+{
+    ins->x = (opcode & 0x0F00) >> 8;
+    ins->y = (opcode & 0x00F0) >> 4;
+    ins->n = opcode & 0x000F;
+    ins->nn = opcode & 0x00FF;
+    ins->nnn = opcode & 0x0FFF;
 
     switch (opcode & 0xF000)
     {
         case 0x0000:
-            switch (opcode)
+            if (opcode == 0x00E0)
+            {
+                ins->op = OP_00E0;
+            } else if (opcode == 0x00EE)
+            {
+                ins->op = OP_00EE;
+            } else
             {
-                case 0x00E0: // 00E0: Clear the screen
-                    SDL_SetRenderDrawColor(app.renderer, 0, 0, 0, 255);
-                    SDL_RenderClear(app.renderer);
-
-                    break;
-                case 0x00EE: // 00EE: Returning from a subroutine
-                    chip8->SP -= 1;
-                    chip8->PC = chip8->stack[chip8->SP];
-					
-                    break;
+                ins->op = OP_NOP;
             }
             break;
-        case 0x1000: // 1NNN: Jump
-            chip8->PC = opcode & 0x0FFF;
-
+        case 0x8000:
+            ins->op = alu_ops[ins->n];
             break;
-        case 0x2000: // 2NNN: Calls subroutine at memory location NNN
-            chip8->stack[chip8->SP] = chip8->PC;
-			
-            // Increase the stack pointer
-            chip8->SP += 1;
-
-            // Change value of program counter
-            chip8->PC = opcode & 0x0FFF;
-
+        case 0xE000:
+            ins->op = key_ops[ins->nn];
+            break;
+        case 0xF000:
+            ins->op = misc_ops[ins->nn];
             break;
-        case 0x3000: // 3XNN: Skip
-            x = (opcode & 0x0F00) >> 8;
-            value = opcode & 0x00FF;
+        default:
+            ins->op = primary_ops[opcode >> 12];
+            break;
+    }
+}
 
-            if (chip8->V[x] == value)
+void apply_quirks(unsigned int quirks, INSTRUCTION *ins)
+{
+    switch (ins->op)
+    {
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+            if (quirks & QUIRK_VF_RESET)
             {
-                chip8->PC += 2;
+                ins->op += OP_8XY1_RESET - OP_8XY1;
             }
-				
             break;
-        case 0x4000: // 4XNN: Skip
-            x = (opcode & 0x0F00) >> 8;
-            value = opcode & 0x00FF;
-
-            if (chip8->V[x] != value)
+        case OP_8XY6:
+        case OP_8XYE:
+            // Shifting VX in place is the same as shifting VX into VX, so
+            // every engine's usual shifts handle it
+            if (quirks & QUIRK_SHIFT_VX)
             {
-                chip8->PC += 2;
+                ins->y = ins->x;
             }
-
             break;
-        case 0x5000: // 5XY0: Skip
-            x = (opcode & 0x0F00) >> 8;
-            y = (opcode & 0x00F0) >> 4;
-				
-            if (chip8->V[x] == chip8->V[y])
+        case OP_BNNN:
+            if (quirks & QUIRK_JUMP_VX)
             {
-                chip8->PC += 2;
+                ins->op = OP_BXNN;
             }
-
             break;
-        case 0x6000: // 6XNN: Set register VX to NN
-            x = (opcode & 0x0F00) >> 8;
-            value = opcode & 0x00FF;
-            chip8->V[x] = value;
-
+        case OP_DXYN:
+            if (quirks & QUIRK_CLIP_SPRITES)
+            {
+                ins->op = OP_DXYN_CLIP;
+            }
             break;
-        case 0x7000: // 7XNN: Add value NN to register VX
-            x = (opcode & 0x0F00) >> 8;
-            value = opcode & 0x00FF;
-            chip8->V[x] += value;
-
+        case OP_FX55:
+        case OP_FX65:
+            if (quirks & QUIRK_LOAD_STORE_I)
+            {
+                ins->op = ins->op == OP_FX55 ? OP_FX55_I : OP_FX65_I;
+            }
             break;
-        case 0x8000:
-            x = (opcode & 0x0F00) >> 8;
-            y = (opcode & 0x00F0) >> 4;
+    }
+}
 
-            switch (opcode & 0x000F)
-            {
-                case 0x0000: // 8XY0: Set VX to VY
-                    chip8->V[x] = chip8->V[y];
+void set_quirks(CHP *chip8, unsigned int quirks)
+{
+    chip8->quirks = quirks;
 
-                    break;
-                case 0x0001: // 8XY1
-                    chip8->V[x] = (chip8->V[x] | chip8->V[y]);
-	
-                    break;
-                case 0x0002: // 8XY2
-                    chip8->V[x] = (chip8->V[x] & chip8->V[y]);
+    invalidate_instructions(chip8, 0, MEMORY_SIZE);
+}
 
-                    break;
-                case 0x0003: // 8XY3
-                    chip8->V[x] = (chip8->V[x] ^ chip8->V[y]);
 
-                    break;
-                case 0x0004: // 8XY4
-                    value = chip8->V[x] + chip8->V[y];
+// Longest sequence a superinstruction replaces, see fuse_instruction()
+#define FUSED_MAX_LENGTH 3
 
-                    chip8->V[0xF] = 0;
+void invalidate_instructions(CHP *chip8, unsigned int address, unsigned int length)
+{
+    if (length >= MEMORY_SIZE)
+    {
+        for (int i = 0; i < MEMORY_SIZE; i++)
+        {
+            chip8->decoded[i].op = OP_DECODE;
+        }
 
-                    if (value > 255) {
-                        chip8->V[0xF] = 1;	
-                    }
+        return;
+    }
 
-                    chip8->V[x] += chip8->V[y];
+    // The instruction starting one byte before the write overlaps it too,
+    // as does any superinstruction starting up to two instructions earlier
+    unsigned int overlap = FUSED_MAX_LENGTH * 2 - 1;
 
-                    break;
-                case 0x0005: // 8XY5
-                    chip8->V[0xF] = 0;
+    for (unsigned int i = 0; i < length + overlap; i++)
+    {
+        chip8->decoded[(address - overlap + i) & (MEMORY_SIZE - 1)].op = OP_DECODE;
+    }
+}
 
-                    if (chip8->V[x] > chip8->V[y])
-                    {
-                        chip8->V[0xF] = 1;
-                    }
-					
-                    chip8->V[x] -= chip8->V[y];
 
-                    break;
-                case 0x0006: // 8XY6
-                    chip8->V[0xF] = 0 < ((chip8->V[y] << 7) & 0xFF);
+// --- Instruction handlers ---
+// Every dispatch strategy below calls these, so each opcode's behaviour is
+// defined exactly once. The program counter has already been advanced past
+// the instruction when a handler runs.
 
-                    chip8->V[x] = (chip8->V[y] >> 1);
+static inline void op_NOP(CHP *chip8, const INSTRUCTION *ins)
+{
+}
 
-                    break;
-                case 0x0007: // 8XY7	
-                    chip8->V[0xF] = 0;
+static inline void op_00E0(CHP *chip8, const INSTRUCTION *ins) // 00E0: Clear the screen
+{
+    memset(chip8->display, 0, sizeof(chip8->display));
+    chip8->draw_flag = 1;
+}
 
-                    if (chip8->V[x] < chip8->V[y])
-                    {
-                        chip8->V[0xF] = 1;
-                    }
+static inline void op_00EE(CHP *chip8, const INSTRUCTION *ins) // 00EE: Returning from a subroutine
+{
+    chip8->SP -= 1;
+    chip8->PC = chip8->stack[chip8->SP & (STACK_SIZE - 1)];
+}
 
-                    chip8->V[x] = chip8->V[y] - chip8->V[x];
+static inline void op_1NNN(CHP *chip8, const INSTRUCTION *ins) // 1NNN: Jump
+{
+    chip8->PC = ins->nnn;
+}
 
-                    break;
-                case 0x000E: // 8XYE
-                    chip8->V[0xF] = 0 < ((chip8->V[y] >> 7) & 0xFF);
+static inline void op_2NNN(CHP *chip8, const INSTRUCTION *ins) // 2NNN: Calls subroutine at memory location NNN
+{
+    chip8->stack[chip8->SP & (STACK_SIZE - 1)] = chip8->PC;
 
-                    chip8->V[x] = (chip8->V[y] << 1);
+    // Increase the stack pointer
+    chip8->SP += 1;
 
-                    break;
-            }
+    // Change value of program counter
+    chip8->PC = ins->nnn;
+}
 
-            break;
-        case 0x9000: // 9XY0: Skip
-            x = (opcode & 0x0F00) >> 8;
-            y = (opcode & 0x00F0) >> 4;
+static inline void op_3XNN(CHP *chip8, const INSTRUCTION *ins) // 3XNN: Skip
+{
+    if (chip8->V[ins->x] == ins->nn)
+    {
+        chip8->PC += 2;
+    }
+}
 
-            if (chip8->V[x] != chip8->V[y])
-            {
-                chip8->PC += 2;
-            }
+static inline void op_4XNN(CHP *chip8, const INSTRUCTION *ins) // 4XNN: Skip
+{
+    if (chip8->V[ins->x] != ins->nn)
+    {
+        chip8->PC += 2;
+    }
+}
 
-            break;
-        case 0xA000: // ANNN: Set index
-            value = opcode & 0x0FFF;
-            chip8->I = value;
+static inline void op_5XY0(CHP *chip8, const INSTRUCTION *ins) // 5XY0: Skip
+{
+    if (chip8->V[ins->x] == chip8->V[ins->y])
+    {
+        chip8->PC += 2;
+    }
+}
 
-            break;
-        case 0xB000: // BNNN: Jump with offset
-            chip8->PC = (opcode & 0x0FFF) + chip8->V[0];
+static inline void op_6XNN(CHP *chip8, const INSTRUCTION *ins) // 6XNN: Set register VX to NN
+{
+    chip8->V[ins->x] = ins->nn;
+}
 
-            break;
-        case 0xC000: // CXNN: Random
-            x = (opcode & 0x0F00) >> 8;
-            value = opcode & 0x00FF;
+static inline void op_7XNN(CHP *chip8, const INSTRUCTION *ins) // 7XNN: Add value NN to register VX
+{
+    chip8->V[ins->x] += ins->nn;
+}
 
-            chip8->V[x] = rand() & value;
-            break;
-        case 0xD000: // DXYN: Display
-            n = opcode & 0x000F;
-	
-            chip8->V[0xF] = 0;
+static inline void op_8XY0(CHP *chip8, const INSTRUCTION *ins) // 8XY0: Set VX to VY
+{
+    chip8->V[ins->x] = chip8->V[ins->y];
+}
 
-            for (int i = 0; i < n; i++)
-            {
-                char data = chip8->memory[chip8->I + i];
-				
-                for (int j = 0; j < 8; j++)
-                {
-                    x = (chip8->V[(opcode & 0x0F00) >> 8] + j) & 63;
-                    y = (chip8->V[(opcode & 0x00F0) >> 4] + i) & 31;
-
-                    if (data & (0x80 >> j))
-                    {
-                        if (pixel_coords[x][y])
-                        {
-                            chip8->V[0xF] = 1;
-                            pixel_coords[x][y] = 0; // Turn off the pixel
-                            SDL_SetRenderDrawColor(app.renderer, 0, 0, 0, 255);
-                            draw_pixel(x, y);
-                            SDL_SetRenderDrawColor(app.renderer, 255, 255, 255, 255);
-                        } else
-                        {
-                            pixel_coords[x][y] = 1; // Turn on the pixel 
-                            SDL_SetRenderDrawColor(app.renderer, 255, 255, 255, 255);
-                            draw_pixel(x, y);
-                            SDL_SetRenderDrawColor(app.renderer, 0, 0, 0, 255);
-                        }
-                    }
-                }	
-            }
+static inline void op_8XY1(CHP *chip8, const INSTRUCTION *ins) // 8XY1
+{
+    chip8->V[ins->x] = (chip8->V[ins->x] | chip8->V[ins->y]);
+}
 
-            break;
-        case 0xE000:
-            x = (opcode & 0x0F00) >> 8;
-			
-            printf("Need to press button: %d\n", chip8->V[x]);
+static inline void op_8XY2(CHP *chip8, const INSTRUCTION *ins) // 8XY2
+{
+    chip8->V[ins->x] = (chip8->V[ins->x] & chip8->V[ins->y]);
+}
 
-            switch (opcode & 0x00FF)
-            {
-                case 0x009E: // EX9E: Skip if key
-                    keyboard = (Uint8 *)SDL_GetKeyboardState(NULL);
-				
-                    if (keyboard[keymap[chip8->V[x]]])
-                    {
-                        chip8->PC += 2;
-                    }
-			
-                    break;
-                case 0x00A1: // EXA1: Skip if key
-                    keyboard = (Uint8 *)SDL_GetKeyboardState(NULL);		
-
-                    if (!keyboard[keymap[chip8->V[x]]])
-                    {
-                        chip8->PC += 2;
-                    }
-
-                    break;
-            }
+static inline void op_8XY3(CHP *chip8, const INSTRUCTION *ins) // 8XY3
+{
+    chip8->V[ins->x] = (chip8->V[ins->x] ^ chip8->V[ins->y]);
+}
 
-            break;
-        case 0xF000:
-            x = (opcode & 0x0F00) >> 8;
+static inline void op_8XY4(CHP *chip8, const INSTRUCTION *ins) // 8XY4
+{
+    unsigned short value = chip8->V[ins->x] + chip8->V[ins->y];
 
-            switch (opcode & 0x00FF)
-            {
-                case 0x0007: // FX07: Sets VX to the current value of the delay timer
-                    chip8->V[x] = chip8->DT;
-                    break;
-                case 0x0015: // FX15: Sets the delay timer to the value in VX
-                    chip8->DT = chip8->V[x];
-                    break;
-                case 0x0018: // FX18: Sets the sound timer to the value in VX
-                    chip8->ST = chip8->V[x];
-                    break;
-                case 0x001E: // FX1E: Add to index
-                    chip8->I += chip8->V[x];
-                    break;
-                case 0x000A: // FX0A: Get key
-                    keyboard = (Uint8 *)SDL_GetKeyboardState(NULL);
-
-                    for (int i = 0; i < 0x10; i++)
-                    {
-                        if (keyboard[keymap[i]])
-                        {
-                            chip8->V[x] = i;
-                            chip8->PC += 2;
-                        }
-                    }
-					
-                    break;
-                case 0x0029: // FX29: Font character
-                    chip8->I = chip8->V[x] * 5;
-                    break;
-                case 0x0033: // FX33: Binary-coded decimal conversion
-                    chip8->memory[chip8->I] = chip8->V[x] / 100;
-                    chip8->memory[chip8->I + 1] = (chip8->V[x] / 10) % 10;
-                    chip8->memory[chip8->I + 2] = chip8->V[x] % 10;
-                    break;
-                case 0x0055: // FX55: Store memory
-                    for (int i = 0; i <= x; i++)
-                    {
-                        chip8->memory[chip8->I + i] = chip8->V[i];
-                    }
-                    break;
-                case 0x0065: // FX65: Load memory
-                    for (int i = 0; i <= x; i++)
-                    {
-                        chip8->V[i] = chip8->memory[chip8->I + i];
-                    }
-                    break;
-            }
+    chip8->V[0xF] = 0;
 
-            break;
-        default:
-            printf("Invalid instruction.\n");
-            exit(-1);
+    if (value > 255)
+    {
+        chip8->V[0xF] = 1;
+    }
 
-            break;
+    chip8->V[ins->x] += chip8->V[ins->y];
+}
+
+static inline void op_8XY5(CHP *chip8, const INSTRUCTION *ins) // 8XY5
+{
+    chip8->V[0xF] = 0;
+
+    if (chip8->V[ins->x] > chip8->V[ins->y])
+    {
+        chip8->V[0xF] = 1;
+    }
+
+    chip8->V[ins->x] -= chip8->V[ins->y];
+}
+
+static inline void op_8XY6(CHP *chip8, const INSTRUCTION *ins) // 8XY6
+{
+    chip8->V[0xF] = 0 < ((chip8->V[ins->y] << 7) & 0xFF);
+
+    chip8->V[ins->x] = (chip8->V[ins->y] >> 1);
+}
+
+static inline void op_8XY7(CHP *chip8, const INSTRUCTION *ins) // 8XY7
+{
+    chip8->V[0xF] = 0;
+
+    if (chip8->V[ins->x] < chip8->V[ins->y])
+    {
+        chip8->V[0xF] = 1;
+    }
+
+    chip8->V[ins->x] = chip8->V[ins->y] - chip8->V[ins->x];
+}
+
+static inline void op_8XYE(CHP *chip8, const INSTRUCTION *ins) // 8XYE
+{
+    chip8->V[0xF] = 0 < ((chip8->V[ins->y] >> 7) & 0xFF);
+
+    chip8->V[ins->x] = (chip8->V[ins->y] << 1);
+}
+
+static inline void op_9XY0(CHP *chip8, const INSTRUCTION *ins) // 9XY0: Skip
+{
+    if (chip8->V[ins->x] != chip8->V[ins->y])
+    {
+        chip8->PC += 2;
+    }
+}
+
+static inline void op_ANNN(CHP *chip8, const INSTRUCTION *ins) // ANNN: Set index
+{
+    chip8->I = ins->nnn;
+}
+
+static inline void op_BNNN(CHP *chip8, const INSTRUCTION *ins) // BNNN: Jump with offset
+{
+    chip8->PC = ins->nnn + chip8->V[0];
+}
+
+static inline void op_CXNN(CHP *chip8, const INSTRUCTION *ins) // CXNN: Random
+{
+    chip8->V[ins->x] = next_random(chip8) & ins->nn;
+}
+
+static inline void op_DXYN(CHP *chip8, const INSTRUCTION *ins) // DXYN: Display
+{
+    unsigned int x = chip8->V[ins->x] & (DISPLAY_WIDTH - 1);
+    unsigned int y = chip8->V[ins->y] & (DISPLAY_HEIGHT - 1);
+
+    chip8->V[0xF] = 0;
+
+    for (int i = 0; i < ins->n; i++)
+    {
+        uint64_t *row = &chip8->display[(y + i) & (DISPLAY_HEIGHT - 1)];
+
+        // Line the sprite byte up with column x, wrapping off the right edge
+        uint64_t data = (uint64_t)chip8->memory[(chip8->I + i) & (MEMORY_SIZE - 1)] << 56;
+        data = rotate_right(data, x);
+
+        // Any overlap means a pixel is about to be turned off
+        if (*row & data)
+        {
+            chip8->V[0xF] = 1;
+        }
+
+        *row ^= data;
+    }
+
+    chip8->draw_flag = 1;
+}
+
+static inline void op_EX9E(CHP *chip8, const INSTRUCTION *ins) // EX9E: Skip if key
+{
+    if ((chip8->keypad >> (chip8->V[ins->x] & 0xF)) & 1)
+    {
+        chip8->PC += 2;
+    }
+}
+
+static inline void op_EXA1(CHP *chip8, const INSTRUCTION *ins) // EXA1: Skip if not key
+{
+    if (!((chip8->keypad >> (chip8->V[ins->x] & 0xF)) & 1))
+    {
+        chip8->PC += 2;
+    }
+}
+
+static inline void op_FX07(CHP *chip8, const INSTRUCTION *ins) // FX07: Sets VX to the current value of the delay timer
+{
+    chip8->V[ins->x] = chip8->DT;
+}
+
+static inline void op_FX0A(CHP *chip8, const INSTRUCTION *ins) // FX0A: Wait for a key to be pressed and released
+{
+    // Runs again until the key is let go, as on the original interpreter
+    if (chip8->key_wait == 0)
+    {
+        if (chip8->keypad)
+        {
+            chip8->key_wait = __builtin_ctz(chip8->keypad) + 1;
+        }
+
+        chip8->PC -= 2;
+    } else if ((chip8->keypad >> (chip8->key_wait - 1)) & 1)
+    {
+        chip8->PC -= 2;
+    } else
+    {
+        chip8->V[ins->x] = chip8->key_wait - 1;
+        chip8->key_wait = 0;
     }
 }
 
+static inline void op_FX15(CHP *chip8, const INSTRUCTION *ins) // FX15: Sets the delay timer to the value in VX
+{
+    chip8->DT = chip8->V[ins->x];
+}
+
+static inline void op_FX18(CHP *chip8, const INSTRUCTION *ins) // FX18: Sets the sound timer to the value in VX
+{
+    chip8->ST = chip8->V[ins->x];
+}
+
+static inline void op_FX1E(CHP *chip8, const INSTRUCTION *ins) // FX1E: Add to index
+{
+    chip8->I += chip8->V[ins->x];
+}
+
+static inline void op_FX29(CHP *chip8, const INSTRUCTION *ins) // FX29: Font character
+{
+    chip8->I = chip8->V[ins->x] * 5;
+}
+
+static inline void op_FX33(CHP *chip8, const INSTRUCTION *ins) // FX33: Binary-coded decimal conversion
+{
+    chip8->memory[chip8->I & (MEMORY_SIZE - 1)] = chip8->V[ins->x] / 100;
+    chip8->memory[(chip8->I + 1) & (MEMORY_SIZE - 1)] = (chip8->V[ins->x] / 10) % 10;
+    chip8->memory[(chip8->I + 2) & (MEMORY_SIZE - 1)] = chip8->V[ins->x] % 10;
+
+    invalidate_instructions(chip8, chip8->I, 3);
+}
+
+static inline void op_FX55(CHP *chip8, const INSTRUCTION *ins) // FX55: Store memory
+{
+    for (int i = 0; i <= ins->x; i++)
+    {
+        chip8->memory[(chip8->I + i) & (MEMORY_SIZE - 1)] = chip8->V[i];
+    }
+
+    invalidate_instructions(chip8, chip8->I, ins->x + 1);
+}
+
+static inline void op_FX65(CHP *chip8, const INSTRUCTION *ins) // FX65: Load memory
+{
+    for (int i = 0; i <= ins->x; i++)
+    {
+        chip8->V[i] = chip8->memory[(chip8->I + i) & (MEMORY_SIZE - 1)];
+    }
+}
+
+static inline void op_8XY1_RESET(CHP *chip8, const INSTRUCTION *ins) // 8XY1 with QUIRK_VF_RESET
+{
+    op_8XY1(chip8, ins);
+    chip8->V[0xF] = 0;
+}
+
+static inline void op_8XY2_RESET(CHP *chip8, const INSTRUCTION *ins) // 8XY2 with QUIRK_VF_RESET
+{
+    op_8XY2(chip8, ins);
+    chip8->V[0xF] = 0;
+}
+
+static inline void op_8XY3_RESET(CHP *chip8, const INSTRUCTION *ins) // 8XY3 with QUIRK_VF_RESET
+{
+    op_8XY3(chip8, ins);
+    chip8->V[0xF] = 0;
+}
+
+static inline void op_BXNN(CHP *chip8, const INSTRUCTION *ins) // BXNN: Jump with offset, with QUIRK_JUMP_VX
+{
+    chip8->PC = ins->nnn + chip8->V[ins->x];
+}
+
+static inline void op_DXYN_CLIP(CHP *chip8, const INSTRUCTION *ins) // DXYN with QUIRK_CLIP_SPRITES
+{
+    // Only the starting position wraps
+    unsigned int x = chip8->V[ins->x] & (DISPLAY_WIDTH - 1);
+    unsigned int y = chip8->V[ins->y] & (DISPLAY_HEIGHT - 1);
+
+    chip8->V[0xF] = 0;
+
+    for (int i = 0; i < ins->n && y + i < DISPLAY_HEIGHT; i++)
+    {
+        uint64_t *row = &chip8->display[y + i];
+
+        // Columns shifted off the right edge are lost
+        uint64_t data = ((uint64_t)chip8->memory[(chip8->I + i) & (MEMORY_SIZE - 1)] << 56) >> x;
+
+        if (*row & data)
+        {
+            chip8->V[0xF] = 1;
+        }
+
+        *row ^= data;
+    }
+
+    chip8->draw_flag = 1;
+}
+
+static inline void op_FX55_I(CHP *chip8, const INSTRUCTION *ins) // FX55 with QUIRK_LOAD_STORE_I
+{
+    op_FX55(chip8, ins);
+    chip8->I += ins->x + 1;
+}
+
+static inline void op_FX65_I(CHP *chip8, const INSTRUCTION *ins) // FX65 with QUIRK_LOAD_STORE_I
+{
+    op_FX65(chip8, ins);
+    chip8->I += ins->x + 1;
+}
+
+
+// --- Superinstructions ---
+// Sequences that show up in nearly every ROM's hot loops are cached as one
+// entry so the whole sequence costs a single dispatch. They only run fused
+// when the instruction budget covers the whole sequence, so the machine is
+// in exactly the state single stepping would leave it in whenever
+// run_instructions() returns. Each returns how many instructions it ran.
+// The idle loops and FX0A are also given the instruction budget left,
+// including themselves, which they use up once nothing can change.
+
+// Number of instructions each superinstruction replaces, zero for the rest.
+// FX0A is not fused with anything but waits the same way an idle loop does.
+static const unsigned char fused_length[OP_COUNT] =
+{
+    [OP_FX0A] = 1,
+    [OP_ANNN_DXYN] = 2,
+    [OP_6XNN_6XNN] = 2,
+    [OP_7XNN_3XNN_1NNN] = 3,
+    [OP_FX07_3XNN_1NNN] = 3,
+    [OP_1NNN_SELF] = 1,
+    [OP_FX07_WAIT] = 3
+};
+
+static inline unsigned int fuse_ANNN_DXYN(CHP *chip8, const INSTRUCTION *ins) // Point I at a sprite and draw it
+{
+    op_ANNN(chip8, ins);
+    chip8->PC += 2;
+    op_DXYN(chip8, ins);
+
+    return 2;
+}
+
+static inline unsigned int fuse_6XNN_6XNN(CHP *chip8, const INSTRUCTION *ins) // Load a pair of registers
+{
+    op_6XNN(chip8, ins);
+    chip8->PC += 2;
+    chip8->V[ins->y] = ins->n;
+
+    return 2;
+}
+
+// Shared tail of the loops: 3XNN followed by a 1NNN back to the loop body
+static inline unsigned int fuse_3XNN_1NNN(CHP *chip8, const INSTRUCTION *ins)
+{
+    chip8->PC += 2;
+
+    if (chip8->V[ins->y] == ins->n)
+    {
+        chip8->PC += 2;
+        return 2;
+    }
+
+    chip8->PC = ins->nnn;
+    return 3;
+}
+
+static inline unsigned int fuse_7XNN_3XNN_1NNN(CHP *chip8, const INSTRUCTION *ins) // Counting loop
+{
+    op_7XNN(chip8, ins);
+
+    return fuse_3XNN_1NNN(chip8, ins);
+}
+
+static inline unsigned int fuse_FX07_3XNN_1NNN(CHP *chip8, const INSTRUCTION *ins) // Wait on the delay timer
+{
+    op_FX07(chip8, ins);
+
+    return fuse_3XNN_1NNN(chip8, ins);
+}
+
+static inline unsigned int fuse_1NNN_SELF(CHP *chip8, const INSTRUCTION *ins, unsigned int budget) // Spin forever
+{
+    op_1NNN(chip8, ins);
+
+    // Every later iteration lands on the same address, so spend the budget
+    chip8->idle_instructions += budget - 1;
+
+    return budget;
+}
+
+static inline unsigned int fuse_FX07_WAIT(CHP *chip8, const INSTRUCTION *ins, unsigned int budget) // Spin until DT changes
+{
+    unsigned int executed = fuse_FX07_3XNN_1NNN(chip8, ins);
+
+    // DT only changes between runs, so if the first pass went round the
+    // loop every further whole pass would too, without changing anything
+    if (executed == 3)
+    {
+        unsigned int skipped = (budget - 3) / 3 * 3;
+
+        chip8->idle_instructions += skipped;
+        executed += skipped;
+    }
+
+    return executed;
+}
+
+static inline unsigned int fuse_FX0A(CHP *chip8, const INSTRUCTION *ins, unsigned int budget) // Wait for a key
+{
+    unsigned short next = chip8->PC;
+
+    op_FX0A(chip8, ins);
+
+    // The keypad only changes between runs, so once the wait has gone round
+    // again every further pass would leave the machine as it is
+    if (chip8->PC != next)
+    {
+        chip8->idle_instructions += budget - 1;
+        return budget;
+    }
+
+    return 1;
+}
+
+static unsigned short read_opcode(const CHP *chip8, unsigned int address)
+{
+    return (chip8->memory[address & (MEMORY_SIZE - 1)] << 8) | chip8->memory[(address + 1) & (MEMORY_SIZE - 1)];
+}
+
+// Replaces the freshly decoded instruction at address with a superinstruction
+// when it starts one of the sequences above
+static void fuse_instruction(const CHP *chip8, unsigned int address, INSTRUCTION *ins)
+{
+    INSTRUCTION second;
+    INSTRUCTION third;
+
+    if (ins->op == OP_1NNN && ins->nnn == address)
+    {
+        ins->op = OP_1NNN_SELF;
+        return;
+    }
+
+    // Sequences are never fused across the end of memory
+    if (address + 4 > MEMORY_SIZE)
+    {
+        return;
+    }
+
+    decode_instruction(read_opcode(chip8, address + 2), &second);
+    apply_quirks(chip8->quirks, &second);
+
+    if (ins->op == OP_ANNN && second.op == OP_DXYN)
+    {
+        ins->op = OP_ANNN_DXYN;
+        ins->x = second.x;
+        ins->y = second.y;
+        ins->n = second.n;
+        return;
+    }
+
+    if (ins->op == OP_6XNN && second.op == OP_6XNN)
+    {
+        ins->op = OP_6XNN_6XNN;
+        ins->y = second.x;
+        ins->n = second.nn;
+        return;
+    }
+
+    if ((ins->op != OP_7XNN && ins->op != OP_FX07) || second.op != OP_3XNN || address + 6 > MEMORY_SIZE)
+    {
+        return;
+    }
+
+    decode_instruction(read_opcode(chip8, address + 4), &third);
+
+    if (third.op == OP_1NNN)
+    {
+        ins->op = ins->op == OP_7XNN ? OP_7XNN_3XNN_1NNN : OP_FX07_3XNN_1NNN;
+        ins->y = second.x;
+        ins->n = second.nn;
+        ins->nnn = third.nnn;
+
+        if (ins->op == OP_FX07_3XNN_1NNN && ins->nnn == address)
+        {
+            ins->op = OP_FX07_WAIT;
+        }
+    }
+}
+
+// Decodes the instruction at address into the cache, fusing it with the
+// instructions that follow where possible
+static INSTRUCTION *cache_instruction(CHP *chip8, unsigned int address)
+{
+    INSTRUCTION *ins = &chip8->decoded[address];
+
+    decode_instruction(read_opcode(chip8, address), ins);
+    apply_quirks(chip8->quirks, ins);
+    fuse_instruction(chip8, address, ins);
+
+    return ins;
+}
+
+// Runs one superinstruction, returning how many instructions it covered
+static unsigned int execute_fused(CHP *chip8, const INSTRUCTION *ins, unsigned int budget)
+{
+    switch (ins->op)
+    {
+        case OP_ANNN_DXYN: return fuse_ANNN_DXYN(chip8, ins);
+        case OP_6XNN_6XNN: return fuse_6XNN_6XNN(chip8, ins);
+        case OP_7XNN_3XNN_1NNN: return fuse_7XNN_3XNN_1NNN(chip8, ins);
+        case OP_FX07_3XNN_1NNN: return fuse_FX07_3XNN_1NNN(chip8, ins);
+        case OP_1NNN_SELF: return fuse_1NNN_SELF(chip8, ins, budget);
+        case OP_FX07_WAIT: return fuse_FX07_WAIT(chip8, ins, budget);
+        case OP_FX0A: return fuse_FX0A(chip8, ins, budget);
+    }
+
+    return 0;
+}
+
+unsigned int skip_idle_loop(CHP *chip8, unsigned int count)
+{
+    INSTRUCTION *ins = &chip8->decoded[chip8->PC & (MEMORY_SIZE - 1)];
+
+    if (ins->op == OP_DECODE)
+    {
+        ins = cache_instruction(chip8, chip8->PC & (MEMORY_SIZE - 1));
+    }
+
+    if ((ins->op != OP_1NNN_SELF && ins->op != OP_FX07_WAIT && ins->op != OP_FX0A) || count < fused_length[ins->op])
+    {
+        return 0;
+    }
+
+    // A key that was pressed and has now been let go ends the wait
+    if (ins->op == OP_FX0A && chip8->key_wait != 0 && !((chip8->keypad >> (chip8->key_wait - 1)) & 1))
+    {
+        return 0;
+    }
+
+    chip8->PC += 2;
+
+    return execute_fused(chip8, ins, count);
+}
+
+
+// --- Dispatch ---
+// CHIP8_DISPATCH_TABLE calls handlers through a table of function pointers,
+// CHIP8_DISPATCH_THREADED jumps between handlers with computed gotos, and the
+// default is a flat switch on the decoded operation. Executing a single
+// superinstruction only runs the first instruction it replaces.
+
+#if defined(CHIP8_DISPATCH_THREADED) && !defined(__GNUC__)
+// Computed gotos are a GNU extension, so fall back to the portable table
+#undef CHIP8_DISPATCH_THREADED
+#define CHIP8_DISPATCH_TABLE
+#endif
+
+#if defined(CHIP8_DISPATCH_TABLE) || defined(CHIP8_DISPATCH_THREADED)
+
+typedef void (*HANDLER)(CHP *chip8, const INSTRUCTION *ins);
+
+static const HANDLER handlers[OP_COUNT] =
+{
+    [OP_NOP] = op_NOP,
+    [OP_00E0] = op_00E0,
+    [OP_00EE] = op_00EE,
+    [OP_1NNN] = op_1NNN,
+    [OP_2NNN] = op_2NNN,
+    [OP_3XNN] = op_3XNN,
+    [OP_4XNN] = op_4XNN,
+    [OP_5XY0] = op_5XY0,
+    [OP_6XNN] = op_6XNN,
+    [OP_7XNN] = op_7XNN,
+    [OP_8XY0] = op_8XY0,
+    [OP_8XY1] = op_8XY1,
+    [OP_8XY2] = op_8XY2,
+    [OP_8XY3] = op_8XY3,
+    [OP_8XY4] = op_8XY4,
+    [OP_8XY5] = op_8XY5,
+    [OP_8XY6] = op_8XY6,
+    [OP_8XY7] = op_8XY7,
+    [OP_8XYE] = op_8XYE,
+    [OP_9XY0] = op_9XY0,
+    [OP_ANNN] = op_ANNN,
+    [OP_BNNN] = op_BNNN,
+    [OP_CXNN] = op_CXNN,
+    [OP_DXYN] = op_DXYN,
+    [OP_EX9E] = op_EX9E,
+    [OP_EXA1] = op_EXA1,
+    [OP_FX07] = op_FX07,
+    [OP_FX0A] = op_FX0A,
+    [OP_FX15] = op_FX15,
+    [OP_FX18] = op_FX18,
+    [OP_FX1E] = op_FX1E,
+    [OP_FX29] = op_FX29,
+    [OP_FX33] = op_FX33,
+    [OP_FX55] = op_FX55,
+    [OP_FX65] = op_FX65,
+    [OP_8XY1_RESET] = op_8XY1_RESET,
+    [OP_8XY2_RESET] = op_8XY2_RESET,
+    [OP_8XY3_RESET] = op_8XY3_RESET,
+    [OP_BXNN] = op_BXNN,
+    [OP_DXYN_CLIP] = op_DXYN_CLIP,
+    [OP_FX55_I] = op_FX55_I,
+    [OP_FX65_I] = op_FX65_I,
+    [OP_ANNN_DXYN] = op_ANNN,
+    [OP_6XNN_6XNN] = op_6XNN,
+    [OP_7XNN_3XNN_1NNN] = op_7XNN,
+    [OP_FX07_3XNN_1NNN] = op_FX07,
+    [OP_1NNN_SELF] = op_1NNN,
+    [OP_FX07_WAIT] = op_FX07,
+    [OP_DECODE] = op_NOP
+};
+
+void execute(CHP *chip8, const INSTRUCTION *ins)
+{
+    handlers[ins->op](chip8, ins);
+}
+
+#else
+
+void execute(CHP *chip8, const INSTRUCTION *ins)
+{
+    switch (ins->op)
+    {
+        case OP_NOP: op_NOP(chip8, ins); break;
+        case OP_00E0: op_00E0(chip8, ins); break;
+        case OP_00EE: op_00EE(chip8, ins); break;
+        case OP_1NNN: op_1NNN(chip8, ins); break;
+        case OP_2NNN: op_2NNN(chip8, ins); break;
+        case OP_3XNN: op_3XNN(chip8, ins); break;
+        case OP_4XNN: op_4XNN(chip8, ins); break;
+        case OP_5XY0: op_5XY0(chip8, ins); break;
+        case OP_6XNN: op_6XNN(chip8, ins); break;
+        case OP_7XNN: op_7XNN(chip8, ins); break;
+        case OP_8XY0: op_8XY0(chip8, ins); break;
+        case OP_8XY1: op_8XY1(chip8, ins); break;
+        case OP_8XY2: op_8XY2(chip8, ins); break;
+        case OP_8XY3: op_8XY3(chip8, ins); break;
+        case OP_8XY4: op_8XY4(chip8, ins); break;
+        case OP_8XY5: op_8XY5(chip8, ins); break;
+        case OP_8XY6: op_8XY6(chip8, ins); break;
+        case OP_8XY7: op_8XY7(chip8, ins); break;
+        case OP_8XYE: op_8XYE(chip8, ins); break;
+        case OP_9XY0: op_9XY0(chip8, ins); break;
+        case OP_ANNN: op_ANNN(chip8, ins); break;
+        case OP_BNNN: op_BNNN(chip8, ins); break;
+        case OP_CXNN: op_CXNN(chip8, ins); break;
+        case OP_DXYN: op_DXYN(chip8, ins); break;
+        case OP_EX9E: op_EX9E(chip8, ins); break;
+        case OP_EXA1: op_EXA1(chip8, ins); break;
+        case OP_FX07: op_FX07(chip8, ins); break;
+        case OP_FX0A: op_FX0A(chip8, ins); break;
+        case OP_FX15: op_FX15(chip8, ins); break;
+        case OP_FX18: op_FX18(chip8, ins); break;
+        case OP_FX1E: op_FX1E(chip8, ins); break;
+        case OP_FX29: op_FX29(chip8, ins); break;
+        case OP_FX33: op_FX33(chip8, ins); break;
+        case OP_FX55: op_FX55(chip8, ins); break;
+        case OP_FX65: op_FX65(chip8, ins); break;
+        case OP_8XY1_RESET: op_8XY1_RESET(chip8, ins); break;
+        case OP_8XY2_RESET: op_8XY2_RESET(chip8, ins); break;
+        case OP_8XY3_RESET: op_8XY3_RESET(chip8, ins); break;
+        case OP_BXNN: op_BXNN(chip8, ins); break;
+        case OP_DXYN_CLIP: op_DXYN_CLIP(chip8, ins); break;
+        case OP_FX55_I: op_FX55_I(chip8, ins); break;
+        case OP_FX65_I: op_FX65_I(chip8, ins); break;
+        case OP_ANNN_DXYN: op_ANNN(chip8, ins); break;
+        case OP_6XNN_6XNN: op_6XNN(chip8, ins); break;
+        case OP_7XNN_3XNN_1NNN: op_7XNN(chip8, ins); break;
+        case OP_FX07_3XNN_1NNN: op_FX07(chip8, ins); break;
+        case OP_1NNN_SELF: op_1NNN(chip8, ins); break;
+        case OP_FX07_WAIT: op_FX07(chip8, ins); break;
+        case OP_DECODE: break;
+    }
+}
+
+#endif
+
+
+void decode(unsigned short opcode, CHP *chip8)
+{
+    INSTRUCTION ins;
+
+    decode_instruction(opcode, &ins);
+    apply_quirks(chip8->quirks, &ins);
+    execute(chip8, &ins);
+}
+
 
 void update(CHP *chip8)
 {
+    INSTRUCTION *ins = &chip8->decoded[chip8->PC & (MEMORY_SIZE - 1)];
+
+    // Only fetch and decode the first time this address runs
+    if (ins->op == OP_DECODE)
+    {
+        ins = cache_instruction(chip8, chip8->PC & (MEMORY_SIZE - 1));
+    }
+	
+    // Increment the program counter
+    chip8->PC += 2;
+
+    execute(chip8, ins);
+
+}	
+
+
+#if defined(CHIP8_DISPATCH_THREADED)
+
+// Labels as values and computed gotos are GNU extensions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+void run_instructions(CHP *chip8, unsigned int count)
+{
+    static const void *const labels[OP_COUNT] =
+    {
+        [OP_NOP] = &&do_NOP,
+        [OP_00E0] = &&do_00E0,
+        [OP_00EE] = &&do_00EE,
+        [OP_1NNN] = &&do_1NNN,
+        [OP_2NNN] = &&do_2NNN,
+        [OP_3XNN] = &&do_3XNN,
+        [OP_4XNN] = &&do_4XNN,
+        [OP_5XY0] = &&do_5XY0,
+        [OP_6XNN] = &&do_6XNN,
+        [OP_7XNN] = &&do_7XNN,
+        [OP_8XY0] = &&do_8XY0,
+        [OP_8XY1] = &&do_8XY1,
+        [OP_8XY2] = &&do_8XY2,
+        [OP_8XY3] = &&do_8XY3,
+        [OP_8XY4] = &&do_8XY4,
+        [OP_8XY5] = &&do_8XY5,
+        [OP_8XY6] = &&do_8XY6,
+        [OP_8XY7] = &&do_8XY7,
+        [OP_8XYE] = &&do_8XYE,
+        [OP_9XY0] = &&do_9XY0,
+        [OP_ANNN] = &&do_ANNN,
+        [OP_BNNN] = &&do_BNNN,
+        [OP_CXNN] = &&do_CXNN,
+        [OP_DXYN] = &&do_DXYN,
+        [OP_EX9E] = &&do_EX9E,
+        [OP_EXA1] = &&do_EXA1,
+        [OP_FX07] = &&do_FX07,
+        [OP_FX0A] = &&do_FX0A,
+        [OP_FX15] = &&do_FX15,
+        [OP_FX18] = &&do_FX18,
+        [OP_FX1E] = &&do_FX1E,
+        [OP_FX29] = &&do_FX29,
+        [OP_FX33] = &&do_FX33,
+        [OP_FX55] = &&do_FX55,
+        [OP_FX65] = &&do_FX65,
+        [OP_8XY1_RESET] = &&do_8XY1_RESET,
+        [OP_8XY2_RESET] = &&do_8XY2_RESET,
+        [OP_8XY3_RESET] = &&do_8XY3_RESET,
+        [OP_BXNN] = &&do_BXNN,
+        [OP_DXYN_CLIP] = &&do_DXYN_CLIP,
+        [OP_FX55_I] = &&do_FX55_I,
+        [OP_FX65_I] = &&do_FX65_I,
+        [OP_ANNN_DXYN] = &&do_ANNN_DXYN,
+        [OP_6XNN_6XNN] = &&do_6XNN_6XNN,
+        [OP_7XNN_3XNN_1NNN] = &&do_7XNN_3XNN_1NNN,
+        [OP_FX07_3XNN_1NNN] = &&do_FX07_3XNN_1NNN,
+        [OP_1NNN_SELF] = &&do_1NNN_SELF,
+        [OP_FX07_WAIT] = &&do_FX07_WAIT,
+        [OP_DECODE] = &&do_DECODE
+    };
+
+    INSTRUCTION *ins;
+
+    // Each handler ends by looking up the next instruction and jumping
+    // straight to its handler, so every opcode gets its own indirect branch
+    // for the predictor to learn
+#define DISPATCH()                                                  \
+    do                                                              \
+    {                                                               \
+        if (count-- == 0)                                           \
+        {                                                           \
+            return;                                                 \
+        }                                                           \
+        ins = &chip8->decoded[chip8->PC & (MEMORY_SIZE - 1)];       \
+        chip8->PC += 2;                                             \
+        goto *labels[ins->op];                                      \
+    } while (0)
+
+#define HANDLE(name)                                                \
+    do_##name:                                                      \
+        op_##name(chip8, ins);                                      \
+        DISPATCH()
+
+    // count no longer includes the superinstruction itself, so it runs
+    // fused only when the rest of the sequence fits in the budget
+#define HANDLE_FUSED(name, first)                                   \
+    do_##name:                                                      \
+        if (count + 1 < fused_length[OP_##name])                    \
+        {                                                           \
+            op_##first(chip8, ins);                                 \
+            DISPATCH();                                             \
+        }                                                           \
+        count -= fuse_##name(chip8, ins) - 1;                       \
+        DISPATCH()
+
+    // Idle loops also use up whatever is left of the budget
+#define HANDLE_IDLE(name, first)                                    \
+    do_##name:                                                      \
+        if (count + 1 < fused_length[OP_##name])                    \
+        {                                                           \
+            op_##first(chip8, ins);                                 \
+            DISPATCH();                                             \
+        }                                                           \
+        count -= fuse_##name(chip8, ins, count + 1) - 1;            \
+        DISPATCH()
+
+    DISPATCH();
+
+    // First visit to an address: decode it into the cache and carry on
+    // with the real handler
+do_DECODE:
+    ins = cache_instruction(chip8, (chip8->PC - 2) & (MEMORY_SIZE - 1));
+    goto *labels[ins->op];
+
+    HANDLE(NOP);
+    HANDLE(00E0);
+    HANDLE(00EE);
+    HANDLE(1NNN);
+    HANDLE(2NNN);
+    HANDLE(3XNN);
+    HANDLE(4XNN);
+    HANDLE(5XY0);
+    HANDLE(6XNN);
+    HANDLE(7XNN);
+    HANDLE(8XY0);
+    HANDLE(8XY1);
+    HANDLE(8XY2);
+    HANDLE(8XY3);
+    HANDLE(8XY4);
+    HANDLE(8XY5);
+    HANDLE(8XY6);
+    HANDLE(8XY7);
+    HANDLE(8XYE);
+    HANDLE(9XY0);
+    HANDLE(ANNN);
+    HANDLE(BNNN);
+    HANDLE(CXNN);
+    HANDLE(DXYN);
+    HANDLE(EX9E);
+    HANDLE(EXA1);
+    HANDLE(FX07);
+    HANDLE_IDLE(FX0A, FX0A);
+    HANDLE(FX15);
+    HANDLE(FX18);
+    HANDLE(FX1E);
+    HANDLE(FX29);
+    HANDLE(FX33);
+    HANDLE(FX55);
+    HANDLE(FX65);
+    HANDLE(8XY1_RESET);
+    HANDLE(8XY2_RESET);
+    HANDLE(8XY3_RESET);
+    HANDLE(BXNN);
+    HANDLE(DXYN_CLIP);
+    HANDLE(FX55_I);
+    HANDLE(FX65_I);
+    HANDLE_FUSED(ANNN_DXYN, ANNN);
+    HANDLE_FUSED(6XNN_6XNN, 6XNN);
+    HANDLE_FUSED(7XNN_3XNN_1NNN, 7XNN);
+    HANDLE_FUSED(FX07_3XNN_1NNN, FX07);
+    HANDLE_IDLE(1NNN_SELF, 1NNN);
+    HANDLE_IDLE(FX07_WAIT, FX07);
+
+#undef HANDLE_IDLE
+#undef HANDLE_FUSED
+#undef HANDLE
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+void run_instructions(CHP *chip8, unsigned int count)
+{
+    while (count > 0)
+    {
+        INSTRUCTION *ins = &chip8->decoded[chip8->PC & (MEMORY_SIZE - 1)];
+
+        if (ins->op == OP_DECODE)
+        {
+            ins = cache_instruction(chip8, chip8->PC & (MEMORY_SIZE - 1));
+        }
+
+        chip8->PC += 2;
+
+        // Superinstructions run fused only when the whole sequence fits
+        if (fused_length[ins->op] != 0 && count >= fused_length[ins->op])
+        {
+            count -= execute_fused(chip8, ins, count);
+        } else
+        {
+            execute(chip8, ins);
+            count--;
+        }
+    }
+}
+
+#endif
+
+
+void tick_timers(CHP *chip8)
+{
+    chip8->sound_flag = chip8->ST > 0;
+
     if (chip8->DT > 0)
     {
         chip8->DT -= 1;
@@ -409,23 +1328,40 @@ void update(CHP *chip8)
     {
         chip8->ST -= 1;
     }
+}
 
-    unsigned short opcode = fetch(chip8);
-	
-    // Increment the program counter
-    chip8->PC += 2;
 
-    decode(opcode, chip8);
+void run_frame(CHP *chip8, unsigned int instructions)
+{
+    run_instructions(chip8, instructions);
+
+    // The timers tick once per 60 Hz frame regardless of the instruction rate
+    tick_timers(chip8);
+}
 
-}	
 
-void draw_pixel(unsigned int x, unsigned int y)
+unsigned char get_pixel(const CHP *chip8, unsigned int x, unsigned int y)
 {
-    for (int i = 0; i < 8; i++)
+    // Coordinates wrap around the screen the same way sprites do
+    uint64_t row = chip8->display[y & (DISPLAY_HEIGHT - 1)];
+
+    return (row >> (63 - (x & (DISPLAY_WIDTH - 1)))) & 1;
+}
+
+uint64_t display_hash(const CHP *chip8)
+{
+    // FNV-1a over the framebuffer a byte at a time, leftmost pixels first,
+    // so every pixel reaches every bit of the hash on any host
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (int i = 0; i < DISPLAY_HEIGHT; i++)
     {
-        for (int j = 0; j < 8; j++)
-        {	
-            SDL_RenderDrawPoint(app.renderer, (x * 8) + i , (y * 8) + j);
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            hash ^= (chip8->display[i] >> shift) & 0xFF;
+            hash *= 0x100000001B3ULL;
         }
-    }	
+    }
+
+    return hash;
 }
@@ -1,14 +1,118 @@
 #ifndef CHIP8_HEADER
 #define CHIP8_HEADER
 
-#include <SDL2/SDL.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define MEMORY_SIZE 4096
 #define STACK_SIZE 16
 #define V_SIZE 16
+#define KEYPAD_SIZE 16
 
-extern unsigned char pixel_coords[64][32];
-extern unsigned char font[80];
+// Programs are loaded from here to the end of memory
+#define PROGRAM_START 0x200
+#define MAX_PROGRAM_SIZE (MEMORY_SIZE - PROGRAM_START)
+
+#define DISPLAY_WIDTH 64
+#define DISPLAY_HEIGHT 32
+
+extern const unsigned char font[80];
+
+// Behaviours that differ between CHIP-8 interpreters, which ROMs written
+// for one of them rely on. With none set the machine behaves as it always has.
+enum
+{
+    QUIRK_SHIFT_VX = 1 << 0,     // 8XY6 and 8XYE shift VX in place instead of shifting VY into VX
+    QUIRK_LOAD_STORE_I = 1 << 1, // FX55 and FX65 leave I just past the last register
+    QUIRK_JUMP_VX = 1 << 2,      // BXNN jumps to XNN plus VX instead of NNN plus V0
+    QUIRK_CLIP_SPRITES = 1 << 3, // DXYN cuts sprites off at the edges instead of wrapping them
+    QUIRK_VF_RESET = 1 << 4      // 8XY1, 8XY2 and 8XY3 clear VF
+};
+
+// Results of loading a ROM
+enum
+{
+    ROM_LOADED,
+    ROM_MISSING,   // The file could not be opened
+    ROM_TRUNCATED, // Reading stopped before the end of the ROM
+    ROM_TOO_LARGE, // The ROM does not fit between PROGRAM_START and the end of memory
+    ROM_CORRUPT    // The ROM does not match the hash it was stored with
+};
+
+// Operations an opcode can decode to, named after the opcode patterns
+enum
+{
+    OP_NOP, // Unrecognised opcodes (including 0NNN) do nothing
+    OP_00E0,
+    OP_00EE,
+    OP_1NNN,
+    OP_2NNN,
+    OP_3XNN,
+    OP_4XNN,
+    OP_5XY0,
+    OP_6XNN,
+    OP_7XNN,
+    OP_8XY0,
+    OP_8XY1,
+    OP_8XY2,
+    OP_8XY3,
+    OP_8XY4,
+    OP_8XY5,
+    OP_8XY6,
+    OP_8XY7,
+    OP_8XYE,
+    OP_9XY0,
+    OP_ANNN,
+    OP_BNNN,
+    OP_CXNN,
+    OP_DXYN,
+    OP_EX9E,
+    OP_EXA1,
+    OP_FX07,
+    OP_FX0A,
+    OP_FX15,
+    OP_FX18,
+    OP_FX1E,
+    OP_FX29,
+    OP_FX33,
+    OP_FX55,
+    OP_FX65,
+    // Decoded instead of the operations above when a quirk changes them
+    OP_8XY1_RESET,
+    OP_8XY2_RESET,
+    OP_8XY3_RESET,
+    OP_BXNN,
+    OP_DXYN_CLIP,
+    OP_FX55_I,
+    OP_FX65_I,
+    // Superinstructions, fused from common sequences when they are cached.
+    // The first instruction keeps its usual fields and the ones that follow
+    // are packed into the rest: ANNN_DXYN keeps DXYN's x, y and n, 6XNN_6XNN
+    // puts the second register in y and its value in n, and the loops put
+    // the skip test's register in y, its value in n and the jump target in
+    // nnn.
+    OP_ANNN_DXYN,
+    OP_6XNN_6XNN,
+    OP_7XNN_3XNN_1NNN,
+    OP_FX07_3XNN_1NNN,
+    // Idle loops, which change nothing once they have gone round once: a
+    // jump to itself, and an FX07_3XNN_1NNN that jumps back to its own FX07
+    OP_1NNN_SELF,
+    OP_FX07_WAIT,
+    OP_DECODE, // Placeholder for a cache entry that has not been decoded yet
+    OP_COUNT
+};
+
+// An opcode with its operation and operand fields already extracted
+typedef struct
+{
+    unsigned char op;
+    unsigned char x;
+    unsigned char y;
+    unsigned char n;
+    unsigned char nn;
+    unsigned short nnn;
+} INSTRUCTION;
 
 typedef struct 
 {
@@ -27,29 +131,97 @@ typedef struct
 
     // Index register
     unsigned short I;
-} CHP;
 
-typedef struct
-{
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-} SDLapp;
+    // Framebuffer, one word per row with the leftmost pixel in the top bit
+    uint64_t display[DISPLAY_HEIGHT];
+
+    // Bit N is set while key N of the hex keypad is held. Written by the
+    // frontend, a script or a movie between instructions, with set_key() or
+    // the whole mask at once.
+    uint16_t keypad;
+
+    // One more than the key FX0A saw pressed and is waiting to be released,
+    // or 0 while it is still waiting for a press
+    unsigned char key_wait;
+
+    // Set when the framebuffer changes, cleared by the frontend once presented
+    unsigned char draw_flag;
+
+    // Set by each timer tick to whether the sound timer ran for the frame
+    // that tick ended, so the frontend can sound the buzzer for whole frames
+    unsigned char sound_flag;
+
+    // Instruction starting at each address, decoded the first time it runs.
+    // Anything that writes to memory must call invalidate_instructions().
+    INSTRUCTION decoded[MEMORY_SIZE];
+
+    // Instructions fast-forwarded while spinning in idle loops
+    uint64_t idle_instructions;
 
-extern CHP chip8;
-extern SDLapp app;
+    // State of the generator CXNN draws from, set with seed_random()
+    uint64_t random_state;
+
+    // QUIRK_ flags, set with set_quirks()
+    unsigned char quirks;
+} CHP;
 
 void initialise_chip8(CHP *chip8);
 
-void load_rom(const char* rom_path, CHP *chip8);
+// Prints why the ROM could not be loaded and returns -1, leaving memory
+// untouched, when it is missing, cannot be read in full or does not fit
+int load_rom(const char* rom_path, CHP *chip8);
+
+// The same as load_rom() without printing anything, returning a ROM_ result
+int load_rom_file(const char *rom_path, CHP *chip8);
+
+// Copies a program that is already in memory into the program space,
+// returning ROM_LOADED or ROM_TOO_LARGE
+int load_program(CHP *chip8, const unsigned char *program, size_t size);
 
-void draw_square(unsigned int x, unsigned int y);
+// Parses a comma separated list of quirk names (shift, load-store, jump,
+// clip and vf-reset) or one of the presets vip, schip and none into QUIRK_
+// flags. Returns -1, printing the name it did not know, when it is invalid.
+int parse_quirks(const char *list, unsigned int *quirks);
+
+// The same seed always gives the same random numbers, on every host
+void seed_random(CHP *chip8, uint64_t seed);
+
+// Presses or releases one key, from 0 to 0xF
+void set_key(CHP *chip8, unsigned int key, int down);
+
+// Also throws away the decoded instructions, which depend on the quirks
+void set_quirks(CHP *chip8, unsigned int quirks);
 
 unsigned short fetch(CHP *chip8);
 
+void decode_instruction(unsigned short opcode, INSTRUCTION *ins);
+
+// Swaps a decoded instruction for the variant the quirks call for. Every
+// execution engine decodes through this.
+void apply_quirks(unsigned int quirks, INSTRUCTION *ins);
+
+void execute(CHP *chip8, const INSTRUCTION *ins);
+
 void decode(unsigned short opcode, CHP *chip8);
 
 void update(CHP *chip8);
 
-void draw_pixel(unsigned int x, unsigned int y);
+void run_instructions(CHP *chip8, unsigned int count);
+
+void invalidate_instructions(CHP *chip8, unsigned int address, unsigned int length);
+
+// When the machine is spinning in an idle loop or waiting on FX0A, runs as many
+// passes of it as fit in count and returns how many instructions that was,
+// otherwise zero. run_instructions() already does this, it is for other
+// execution engines.
+unsigned int skip_idle_loop(CHP *chip8, unsigned int count);
+
+void tick_timers(CHP *chip8);
+
+void run_frame(CHP *chip8, unsigned int instructions);
+
+unsigned char get_pixel(const CHP *chip8, unsigned int x, unsigned int y);
+
+uint64_t display_hash(const CHP *chip8);
 
 #endif
@@ -1,11 +1,55 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 
+#include "audio.h"
+#include "batch.h"
 #include "chip8.h"
+#include "exchange.h"
+#include "latency.h"
+#include "lockstep.h"
+#include "movie.h"
+#include "pack.h"
+#include "profile.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "snapshot.h"
 
 CHP chip8;
 
+#if defined(TEST_JIT)
+
+#include "jit.h"
+
+static JIT *jit;
+static JIT *single_jit;
+
+// Runs the opcode as a one instruction JIT block. The tests have already
+// advanced PC past it, as update() would.
+static void jit_decode(unsigned short opcode, CHP *chip)
+{
+    chip->PC -= 2;
+    chip->memory[chip->PC & (MEMORY_SIZE - 1)] = opcode >> 8;
+    chip->memory[(chip->PC + 1) & (MEMORY_SIZE - 1)] = opcode & 0xFF;
+
+    jit_flush(single_jit);
+    jit_run(single_jit, chip, 1);
+}
+
+static void jit_run_instructions(CHP *chip, unsigned int count)
+{
+    jit_flush(jit);
+    jit_run(jit, chip, count);
+}
+
+// Send every opcode test through the JIT instead of the interpreter
+#define decode jit_decode
+#define run_instructions jit_run_instructions
+
+#endif
+
 // To be run before each test
 static void before_each()
 {
@@ -850,13 +894,7 @@ static void decode_DXYN_no_on_test()
     chip8.V[0] = 0x20;
     chip8.V[1] = 0x10;
 
-    for (int i = 0; i < 64; i++)
-    {
-        for (int j = 0; j < 32; j++)
-        {
-            pixel_coords[i][j] = 0;
-        }
-    }
+    memset(chip8.display, 0x00, sizeof(chip8.display));
 
     // Increment the program counter to simulate the update function
     chip8.PC += 2;
@@ -868,22 +906,22 @@ static void decode_DXYN_no_on_test()
     // Check that the values have been set correctly
     assert(chip8.V[0xF] == 0);
 
-    assert(pixel_coords[32][16] == 1); 
-    assert(pixel_coords[33][16] == 1);
-    assert(pixel_coords[34][16] == 1);
-    assert(pixel_coords[35][16] == 1);
-    assert(pixel_coords[32][17] == 1);
-    assert(pixel_coords[33][17] == 1);
-    assert(pixel_coords[34][17] == 1);
-    assert(pixel_coords[35][17] == 1);
-    assert(pixel_coords[32][18] == 1);
-    assert(pixel_coords[33][18] == 1);
-    assert(pixel_coords[34][18] == 1);
-    assert(pixel_coords[35][18] == 1);
-    assert(pixel_coords[32][19] == 1);
-    assert(pixel_coords[33][19] == 1);
-    assert(pixel_coords[34][19] == 1);
-    assert(pixel_coords[35][19] == 1);
+    assert(get_pixel(&chip8, 32, 16) == 1); 
+    assert(get_pixel(&chip8, 33, 16) == 1);
+    assert(get_pixel(&chip8, 34, 16) == 1);
+    assert(get_pixel(&chip8, 35, 16) == 1);
+    assert(get_pixel(&chip8, 32, 17) == 1);
+    assert(get_pixel(&chip8, 33, 17) == 1);
+    assert(get_pixel(&chip8, 34, 17) == 1);
+    assert(get_pixel(&chip8, 35, 17) == 1);
+    assert(get_pixel(&chip8, 32, 18) == 1);
+    assert(get_pixel(&chip8, 33, 18) == 1);
+    assert(get_pixel(&chip8, 34, 18) == 1);
+    assert(get_pixel(&chip8, 35, 18) == 1);
+    assert(get_pixel(&chip8, 32, 19) == 1);
+    assert(get_pixel(&chip8, 33, 19) == 1);
+    assert(get_pixel(&chip8, 34, 19) == 1);
+    assert(get_pixel(&chip8, 35, 19) == 1);
 }
 
 // Test 35
@@ -910,13 +948,7 @@ static void decode_DXYN_on_test()
     chip8.V[0] = 0x20;
     chip8.V[1] = 0x10;
 
-    for (int i = 0; i < 64; i++)
-    {
-        for (int j = 0; j < 32; j++)
-        {
-            pixel_coords[i][j] = 1;
-        }
-    }
+    memset(chip8.display, 0xFF, sizeof(chip8.display));
 
     // Increment the program counter to simulate the update function
     chip8.PC += 2;
@@ -928,22 +960,22 @@ static void decode_DXYN_on_test()
     // Check that the values have been set correctly
     assert(chip8.V[0xF] == 1);
 
-    assert(pixel_coords[32][16] == 0); 
-    assert(pixel_coords[33][16] == 0);
-    assert(pixel_coords[34][16] == 0);
-    assert(pixel_coords[35][16] == 0);
-    assert(pixel_coords[32][17] == 0);
-    assert(pixel_coords[33][17] == 0);
-    assert(pixel_coords[34][17] == 0);
-    assert(pixel_coords[35][17] == 0);
-    assert(pixel_coords[32][18] == 0);
-    assert(pixel_coords[33][18] == 0);
-    assert(pixel_coords[34][18] == 0);
-    assert(pixel_coords[35][18] == 0);
-    assert(pixel_coords[32][19] == 0);
-    assert(pixel_coords[33][19] == 0);
-    assert(pixel_coords[34][19] == 0);
-    assert(pixel_coords[35][19] == 0);
+    assert(get_pixel(&chip8, 32, 16) == 0); 
+    assert(get_pixel(&chip8, 33, 16) == 0);
+    assert(get_pixel(&chip8, 34, 16) == 0);
+    assert(get_pixel(&chip8, 35, 16) == 0);
+    assert(get_pixel(&chip8, 32, 17) == 0);
+    assert(get_pixel(&chip8, 33, 17) == 0);
+    assert(get_pixel(&chip8, 34, 17) == 0);
+    assert(get_pixel(&chip8, 35, 17) == 0);
+    assert(get_pixel(&chip8, 32, 18) == 0);
+    assert(get_pixel(&chip8, 33, 18) == 0);
+    assert(get_pixel(&chip8, 34, 18) == 0);
+    assert(get_pixel(&chip8, 35, 18) == 0);
+    assert(get_pixel(&chip8, 32, 19) == 0);
+    assert(get_pixel(&chip8, 33, 19) == 0);
+    assert(get_pixel(&chip8, 34, 19) == 0);
+    assert(get_pixel(&chip8, 35, 19) == 0);
 }
 
 // Test 36
@@ -1110,18 +1142,1891 @@ static void decode_FX65_test()
     assert(chip8.V[2] == 0x03);
 }
 
-int main()
+// Test 43
+static void decode_00E0_test()
 {
-    // Run each test
-    initialise_chip8_test();
-    load_rom_success_test();
-    load_rom_failure_test();
-    fetch_test();
-    decode_00EE_test();
-    decode_1NNN_test();
-    decode_2NNN_test();
-    decode_3XNN_skip_test();
+    // This test ensures that when given the opcode 00E0, the decode() function
+    // clears every pixel in the framebuffer and flags it for redrawing.
+
+    before_each();
+
+    // Set up some initial values for testing
+    memset(chip8.display, 0xFF, sizeof(chip8.display));
+
+    chip8.draw_flag = 0;
+
+    // Increment the program counter to simulate the update() function
+    chip8.PC += 2;
+
+    // Call the decode function with the opcode 0x00E0
+    decode(0x00E0, &chip8);
+
+    // Check that values have been set correctly
+    for (int i = 0; i < 64; i++)
+    {
+        for (int j = 0; j < 32; j++)
+        {
+            assert(get_pixel(&chip8, i, j) == 0);
+        }
+    }
+
+    assert(chip8.draw_flag == 1);
+}
+
+// Test 44
+static void decode_DXYN_wrap_test()
+{
+    // This test ensures that when given the opcode DXYN, a sprite drawn over
+    // the right and bottom edges of the screen wraps around to the opposite
+    // edges.
+
+    before_each();
+
+    // Set up some initial values for testing
+    chip8.I = 0x000;
+
+    chip8.memory[0x000] =     0xFF;
+    chip8.memory[0x000 + 1] = 0x81;
+
+    chip8.V[0] = 60;
+    chip8.V[1] = 31;
+
+    // Increment the program counter to simulate the update function
+    chip8.PC += 2;
+
+    // Call the decode function with the opcode 0xDXYN, where X and Y are
+    // indexes of V and N is the number of rows of data
+    decode(0xD012, &chip8);
+
+    // Check that the values have been set correctly
+    assert(chip8.V[0xF] == 0);
+
+    assert(chip8.display[31] == 0xF00000000000000FULL);
+    assert(chip8.display[0] == 0x1000000000000008ULL);
+    assert(get_pixel(&chip8, 63, 31) == 1);
+    assert(get_pixel(&chip8, 0, 31) == 1);
+    assert(get_pixel(&chip8, 3, 0) == 1);
+    assert(get_pixel(&chip8, 4, 0) == 0);
+
+    // Drawing the same sprite again should erase it and report a collision
+    decode(0xD012, &chip8);
+
+    assert(chip8.V[0xF] == 1);
+    assert(chip8.display[31] == 0);
+    assert(chip8.display[0] == 0);
+}
+
+// Test 45
+static void display_hash_test()
+{
+    // This test ensures that the display_hash() function changes when the
+    // framebuffer changes and returns to its old value when it is restored.
+
+    before_each();
+
+    uint64_t blank = display_hash(&chip8);
+
+    chip8.display[5] = 0x1ULL;
+    assert(display_hash(&chip8) != blank);
+
+    chip8.display[5] = 0;
+    assert(display_hash(&chip8) == blank);
+
+    // The leftmost column is the top bit of each row, which must still
+    // reach the rest of the hash
+    chip8.display[0] = 1ULL << 63;
+    chip8.display[5] = 1ULL << 63;
+    assert(display_hash(&chip8) != blank);
+}
+
+// Test 46
+static void run_frame_test()
+{
+    // This test ensures that the run_frame() function executes the requested
+    // number of instructions and ticks the timers exactly once.
+
+    before_each();
+
+    // Set up a loop of 7XNN instructions
+    for (int i = 0; i < 8; i++)
+    {
+        chip8.memory[0x200 + i * 2] = 0x70;
+        chip8.memory[0x200 + i * 2 + 1] = 0x01;
+    }
+
+    chip8.DT = 5;
+    chip8.ST = 0;
+
+    run_frame(&chip8, 8);
+
+    // Check that the values have been set correctly
+    assert(chip8.V[0] == 8);
+    assert(chip8.PC == 0x200 + 16);
+    assert(chip8.DT == 4);
+    assert(chip8.ST == 0);
+}
+
+// Test 47
+static void next_frame_deadline_test()
+{
+    // This test ensures that frame deadlines land exactly on the 60 Hz grid
+    // without accumulating rounding error.
+
+    SCHEDULER scheduler;
+
+    initialise_scheduler(&scheduler, 10);
+
+    assert(next_frame_deadline(&scheduler) == scheduler.start_ns + 16666666);
+
+    scheduler.frame = TIMER_RATE - 1;
+    assert(next_frame_deadline(&scheduler) == scheduler.start_ns + 1000000000ULL);
+
+    scheduler.frame = TIMER_RATE * 3600 - 1;
+    assert(next_frame_deadline(&scheduler) == scheduler.start_ns + 3600 * 1000000000ULL);
+}
+
+// Test 48
+static void self_modifying_code_test()
+{
+    // This test ensures that instructions cached by update() are decoded
+    // again after FX55 overwrites them.
+
+    before_each();
+
+    const unsigned char program[] =
+    {
+        0x6A, 0x00, // VA = 0
+        0x7A, 0x01, // VA += 1, rewritten to VA += 2 below
+        0xA2, 0x02, // I = 0x202
+        0x60, 0x7A, // V0 = 0x7A
+        0x61, 0x02, // V1 = 0x02
+        0xF1, 0x55, // Store V0 and V1 over the instruction at 0x202
+        0x12, 0x02  // Jump back to 0x202
+    };
+
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+
+    run_instructions(&chip8, 7);
+
+    // Check the original instruction ran and was cached
+    assert(chip8.V[0xA] == 1);
+    assert(chip8.PC == 0x202);
+    assert(chip8.memory[0x203] == 0x02);
+
+    run_instructions(&chip8, 1);
+
+    // Check the rewritten instruction was the one executed
+    assert(chip8.V[0xA] == 3);
+    assert(chip8.decoded[0x202].op == OP_7XNN);
+    assert(chip8.decoded[0x202].nn == 0x02);
+}
+
+#if defined(TEST_JIT)
+
+// Test 49
+static void jit_matches_interpreter_test()
+{
+    // This test ensures that running a program through the JIT leaves the
+    // machine in exactly the same state as the interpreter does.
+
+    static CHP interpreted;
+
+    const unsigned char program[] =
+    {
+        0x60, 0x05, // V0 = 5
+        0x6B, 0xF0, // VB = 0xF0
+        0x71, 0x01, // V1 += 1
+        0x80, 0x14, // V0 += V1
+        0x81, 0xB5, // V1 -= VB
+        0x8B, 0x06, // VB = V0 >> 1
+        0x8C, 0x0E, // VC = V0 << 1
+        0x8F, 0x17, // VF = V1 - VF
+        0xA3, 0x00, // I = 0x300
+        0xF2, 0x1E, // I += V2
+        0xF3, 0x33, // BCD of V3
+        0xFC, 0x55, // Store V0 - VC
+        0xF4, 0x65, // Load V0 - V4
+        0x44, 0x00, // Skip if V4 != 0
+        0x74, 0x03, // V4 += 3
+        0x50, 0x10, // Skip if V0 == V1
+        0x75, 0x01, // V5 += 1
+        0xF2, 0x07, // V2 = DT
+        0x22, 0x28, // Call 0x228
+        0x12, 0x00, // Jump to start
+        0x76, 0x01, // V6 += 1
+        0x00, 0xEE  // Return
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    chip8.DT = 40;
+
+    memcpy(&interpreted, &chip8, sizeof(chip8));
+
+    jit_flush(jit);
+
+    for (int frame = 0; frame < 50; frame++)
+    {
+        jit_run_frame(jit, &chip8, 37);
+        run_frame(&interpreted, 37);
+    }
+
+    assert(memcmp(chip8.V, interpreted.V, sizeof(chip8.V)) == 0);
+    assert(memcmp(chip8.memory, interpreted.memory, sizeof(chip8.memory)) == 0);
+    assert(memcmp(chip8.stack, interpreted.stack, sizeof(chip8.stack)) == 0);
+    assert(chip8.PC == interpreted.PC);
+    assert(chip8.SP == interpreted.SP);
+    assert(chip8.I == interpreted.I);
+    assert(chip8.DT == interpreted.DT);
+    assert(jit_blocks_translated(jit) > 0);
+}
+
+#endif
+
+// Test 50
+static void superinstruction_test()
+{
+    // This test ensures that fused instruction sequences leave the machine in
+    // the same state as single stepping, whatever instruction count a run
+    // stops at.
+
+    static CHP start, stepped;
+
+    const unsigned char program[] =
+    {
+        0xA2, 0x16, // I = 0x216
+        0xD0, 0x15, // Draw the sprite at (V0, V1)
+        0x60, 0x05, // V0 = 5
+        0x61, 0x00, // V1 = 0
+        0x71, 0x01, // V1 += 1
+        0x31, 0x03, // Skip if V1 == 3
+        0x12, 0x08, // Jump to 0x208
+        0xF2, 0x07, // V2 = DT
+        0x32, 0x00, // Skip if V2 == 0
+        0x12, 0x0E, // Jump to 0x20E
+        0x12, 0x00, // Jump to start
+        0xF0, 0x90, 0xF0, 0x90, 0xF0 // Sprite
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    memcpy(&start, &chip8, sizeof(chip8));
+
+    for (unsigned int count = 1; count <= 40; count++)
+    {
+        memcpy(&chip8, &start, sizeof(chip8));
+        memcpy(&stepped, &start, sizeof(stepped));
+
+        run_instructions(&chip8, count);
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            update(&stepped);
+        }
+
+        assert(memcmp(chip8.V, stepped.V, sizeof(chip8.V)) == 0);
+        assert(memcmp(chip8.display, stepped.display, sizeof(chip8.display)) == 0);
+        assert(chip8.PC == stepped.PC);
+        assert(chip8.I == stepped.I);
+    }
+
+    // Check each sequence was cached as a superinstruction
+    assert(stepped.decoded[0x200].op == OP_ANNN_DXYN);
+    assert(stepped.decoded[0x204].op == OP_6XNN_6XNN);
+    assert(stepped.decoded[0x208].op == OP_7XNN_3XNN_1NNN);
+    assert(stepped.decoded[0x20E].op == OP_FX07_WAIT);
+
+    // Rewriting the jump at the end of a loop breaks the sequence up
+    stepped.memory[0x20D] = 0x0A;
+    invalidate_instructions(&stepped, 0x20D, 1);
+
+    assert(stepped.decoded[0x208].op == OP_DECODE);
+}
+
+// Test 51
+static void idle_loop_test()
+{
+    // This test ensures that idle loops are fast-forwarded without changing
+    // the state they leave the machine in.
+
+    static CHP stepped;
+
+    const unsigned char program[] =
+    {
+        0xF0, 0x07, // V0 = DT
+        0x30, 0x00, // Skip if V0 == 0
+        0x12, 0x00, // Jump to 0x200
+        0x12, 0x06  // Jump to 0x206
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    chip8.DT = 2;
+
+    memcpy(&stepped, &chip8, sizeof(chip8));
+
+    for (int frame = 0; frame < 4; frame++)
+    {
+        run_instructions(&chip8, 1000);
+
+        for (int i = 0; i < 1000; i++)
+        {
+            update(&stepped);
+        }
+
+        assert(chip8.PC == stepped.PC);
+        assert(chip8.V[0] == stepped.V[0]);
+
+        tick_timers(&chip8);
+        tick_timers(&stepped);
+    }
+
+    // Check the machine ended up spinning on the jump to itself
+    assert(chip8.PC == 0x206);
+    assert(chip8.DT == 0);
+    assert(chip8.idle_instructions > 3000);
+}
+
+// Test 52
+static void lockstep_matches_interpreter_test()
+{
+    // This test ensures that a lockstep group leaves every instance in the
+    // same state as running it on its own, even once they go different ways.
+
+    static LOCKSTEP group;
+    static CHP machines[LOCKSTEP_LANES];
+    static CHP lane;
+
+    const unsigned char program[] =
+    {
+        0x61, 0x00, // V1 = 0
+        0x71, 0x01, // V1 += 1
+        0x82, 0x00, // V2 = V0
+        0x82, 0x14, // V2 += V1
+        0x83, 0x25, // V3 -= V2
+        0x84, 0x26, // V4 = V2 >> 1
+        0x85, 0x2E, // V5 = V2 << 1
+        0x86, 0x17, // V6 = V1 - V6
+        0xA3, 0x00, // I = 0x300
+        0xF2, 0x1E, // I += V2
+        0xF3, 0x33, // BCD of V3
+        0xF1, 0x55, // Store V0 and V1
+        0xD3, 0x45, // Draw at (V3, V4)
+        0x30, 0x03, // Skip if V0 == 3
+        0x22, 0x40, // Call 0x240
+        0x41, 0x06, // Skip if V1 != 6
+        0x61, 0x00, // V1 = 0
+        0x50, 0x10, // Skip if V0 == V1
+        0xF7, 0x15, // DT = V7
+        0xF8, 0x07, // V8 = DT
+        0xF3, 0x18, // ST = V3
+        0x8F, 0x14, // VF += V1
+        0x12, 0x02  // Jump to 0x202
+    };
+
+    const unsigned char subroutine[] =
+    {
+        0x77, 0x01, // V7 += 1
+        0x00, 0xEE  // Return
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    memcpy(chip8.memory + 0x240, subroutine, sizeof(subroutine));
+
+    initialise_lockstep(&group, &chip8, LOCKSTEP_LANES);
+
+    // Each instance starts with a different V0, so they take different paths
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+    {
+        memcpy(&machines[i], &chip8, sizeof(chip8));
+        machines[i].V[0] = i;
+        lockstep_set_lane(&group, i, &machines[i]);
+    }
+
+    for (int frame = 0; frame < 40; frame++)
+    {
+        lockstep_run_frame(&group, 37);
+
+        for (int i = 0; i < LOCKSTEP_LANES; i++)
+        {
+            run_instructions(&machines[i], 37);
+            tick_timers(&machines[i]);
+        }
+    }
+
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+    {
+        lockstep_get_lane(&group, i, &lane);
+
+        assert(memcmp(lane.V, machines[i].V, sizeof(lane.V)) == 0);
+        assert(memcmp(lane.memory, machines[i].memory, sizeof(lane.memory)) == 0);
+        assert(memcmp(lane.stack, machines[i].stack, sizeof(lane.stack)) == 0);
+        assert(memcmp(lane.display, machines[i].display, sizeof(lane.display)) == 0);
+        assert(lane.PC == machines[i].PC);
+        assert(lane.SP == machines[i].SP);
+        assert(lane.I == machines[i].I);
+        assert(lane.DT == machines[i].DT);
+        assert(lane.ST == machines[i].ST);
+        assert(lane.sound_flag == machines[i].sound_flag);
+    }
+
+    // Check the instances spent at least some of the time running together
+    assert(group.instructions == 40 * 37 * LOCKSTEP_LANES);
+    assert(group.dispatches < group.instructions / 2);
+}
+
+// Writes the program to a ROM file for the batch tests
+static void write_test_rom(const char *path, const unsigned char *program, size_t size)
+{
+    FILE *fptr = fopen(path, "wb");
+
+    fwrite(program, 1, size, fptr);
+    fclose(fptr);
+}
+
+// Test 53
+static void batch_job_test()
+{
+    // This test ensures that a batch job replays its input script and stops
+    // once the program halts, leaving the same display as running it by hand.
+
+    static CHP batch_chip8;
+    static CHP manual;
+
+    const unsigned char program[] =
+    {
+        0x60, 0x05, // V0 = 5
+        0xE0, 0x9E, // Skip if key V0 is down
+        0x12, 0x02, // Jump to 0x202
+        0xD0, 0x05, // Draw the font's 0 at (V0, V0)
+        0x12, 0x08  // Jump to 0x208
+    };
+
+    BATCH_JOB job = { "/tmp/chip8_batch_test.ch8", "/tmp/chip8_batch_test.txt", 100 };
+    BATCH_RESULT result;
+
+    write_test_rom(job.rom_path, program, sizeof(program));
+
+    FILE *script = fopen(job.script_path, "w");
+    fprintf(script, "# frame key state\n3 5 down\n\n4 5 up\n");
+    fclose(script);
+
+    run_batch_job(&job, 10, NULL, &batch_chip8, &result);
+
+    assert(result.exit_reason == BATCH_HALTED);
+    assert(result.frames == 5);
+    assert(result.instructions == 50);
+
+    // Run the same program by hand, holding the key down for frame 3
+    before_each();
+    memcpy(&manual, &chip8, sizeof(chip8));
+    load_rom(job.rom_path, &manual);
+
+    for (int frame = 0; frame < 5; frame++)
+    {
+        set_key(&manual, 5, frame == 3);
+        run_frame(&manual, 10);
+    }
+
+    assert(result.display_hash == display_hash(&manual));
+    assert(result.display_hash != display_hash(&chip8));
+
+    // Missing ROMs and scripts that go back in time are reported
+    strcpy(job.rom_path, "invalid-rom.ch8");
+    run_batch_job(&job, 10, NULL, &batch_chip8, &result);
+    assert(result.exit_reason == BATCH_LOAD_FAILED);
+
+    strcpy(job.rom_path, "/tmp/chip8_batch_test.ch8");
+    script = fopen(job.script_path, "w");
+    fprintf(script, "4 5 down\n3 5 up\n");
+    fclose(script);
+
+    run_batch_job(&job, 10, NULL, &batch_chip8, &result);
+    assert(result.exit_reason == BATCH_BAD_SCRIPT);
+}
+
+// Test 54
+static void run_batch_test()
+{
+    // This test ensures that a batch spread over several threads runs every
+    // listed job exactly once and writes a result for each in order.
+
+    const unsigned char program[] =
+    {
+        0x70, 0x01, // V0 += 1
+        0x12, 0x00  // Jump to 0x200
+    };
+
+    write_test_rom("/tmp/chip8_batch_test.ch8", program, sizeof(program));
+
+    FILE *list = fopen("/tmp/chip8_batch_test.lst", "w");
+
+    for (int i = 0; i < 20; i++)
+    {
+        fprintf(list, "/tmp/chip8_batch_test.ch8 %d\n", 10 + i);
+    }
+
+    fprintf(list, "invalid-rom.ch8\n");
+    fclose(list);
+
+    BATCH_CONFIG config = { "/tmp/chip8_batch_test.lst", "/tmp/chip8_batch_test.csv", BATCH_CSV, 4, 0, 0, 10, 50 };
+
+    assert(run_batch(&config) == 1);
+
+    FILE *csv = fopen(config.output_path, "r");
+    char line[256];
+    int rows = 0;
+
+    assert(fgets(line, sizeof(line), csv) != NULL);
+    assert(strncmp(line, "rom,", 4) == 0);
+
+    while (fgets(line, sizeof(line), csv))
+    {
+        unsigned long long seed;
+        unsigned long long frames;
+        unsigned long long instructions;
+        char reason[32];
+
+        assert(sscanf(strchr(line, ',') + 4, "%llu,%llu,%llu,%31[a-z_]", &seed, &frames, &instructions, reason) == 4);
+        assert(seed == 0);
+
+        if (rows < 20)
+        {
+            assert(frames == 10 + rows);
+            assert(instructions == frames * 10);
+            assert(strcmp(reason, "completed") == 0);
+        } else
+        {
+            assert(strcmp(reason, "load_failed") == 0);
+        }
+
+        rows += 1;
+    }
+
+    fclose(csv);
+
+    assert(rows == 21);
+}
+
+// Test 55
+static void snapshot_restore_test()
+{
+    // This test ensures that restoring a snapshot makes the machine run
+    // exactly as it did the first time, even after it rewrote its own code.
+
+    static SNAPSHOT snapshot;
+    static CHP first;
+
+    const unsigned char program[] =
+    {
+        0x70, 0x01, // V0 += 1
+        0xA2, 0x09, // I = 0x209
+        0xF0, 0x55, // Store V0 as the value loaded below
+        0x62, 0x05, // V2 = 5
+        0x61, 0x00, // V1 = V0, rewritten by the store
+        0xD1, 0x25, // Draw at (V1, V2)
+        0x12, 0x00  // Jump to 0x200
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    chip8.DT = 50;
+
+    // Stop between the store and the instruction it rewrote
+    run_instructions(&chip8, 3);
+    take_snapshot(&chip8, &snapshot);
+
+    for (int frame = 0; frame < 20; frame++)
+    {
+        run_frame(&chip8, 6);
+    }
+
+    memcpy(&first, &chip8, sizeof(chip8));
+
+    // Going back has to undo the code the program wrote since
+    restore_snapshot(&chip8, &snapshot);
+
+    assert(chip8.DT == 50);
+    assert(chip8.draw_flag == 1);
+
+    for (int frame = 0; frame < 20; frame++)
+    {
+        run_frame(&chip8, 6);
+    }
+
+    assert(memcmp(chip8.memory, first.memory, sizeof(chip8.memory)) == 0);
+    assert(memcmp(chip8.display, first.display, sizeof(chip8.display)) == 0);
+    assert(memcmp(chip8.V, first.V, sizeof(chip8.V)) == 0);
+    assert(chip8.PC == first.PC);
+    assert(chip8.I == first.I);
+    assert(chip8.DT == first.DT);
+}
+
+// Test 56
+static void save_state_file_test()
+{
+    // This test ensures that a save state written to a file loads back into
+    // the same machine, and that damaged files are refused.
+
+    static CHP loaded;
+
+    const char *path = "/tmp/chip8_test.state";
+
+    before_each();
+    load_rom("roms/test-rom.ch8", &chip8);
+
+    for (int frame = 0; frame < 10; frame++)
+    {
+        run_frame(&chip8, 11);
+    }
+
+    set_key(&chip8, 7, 1);
+
+    assert(save_state(path, &chip8) == 0);
+
+    initialise_chip8(&loaded);
+    assert(load_state(path, &loaded) == 0);
+
+    assert(memcmp(loaded.memory, chip8.memory, sizeof(chip8.memory)) == 0);
+    assert(memcmp(loaded.display, chip8.display, sizeof(chip8.display)) == 0);
+    assert(memcmp(loaded.stack, chip8.stack, sizeof(chip8.stack)) == 0);
+    assert(memcmp(loaded.V, chip8.V, sizeof(chip8.V)) == 0);
+    assert(loaded.keypad == chip8.keypad && loaded.key_wait == chip8.key_wait);
+    assert(loaded.PC == chip8.PC && loaded.SP == chip8.SP && loaded.I == chip8.I);
+    assert(loaded.DT == chip8.DT && loaded.ST == chip8.ST);
+
+    // Flip a byte in the middle of the file
+    FILE *fptr = fopen(path, "r+b");
+    fseek(fptr, SAVE_STATE_SIZE / 2, SEEK_SET);
+    int byte = fgetc(fptr);
+    fseek(fptr, SAVE_STATE_SIZE / 2, SEEK_SET);
+    fputc(byte ^ 0xFF, fptr);
+    fclose(fptr);
+
+    FILE *original = stdout;
+    stdout = fopen("/tmp/stdoutput.txt", "w+");
+
+    assert(load_state(path, &loaded) == -1);
+
+    fclose(stdout);
+    stdout = original;
+
+    // A random state of zero would stick there, so it is refused even with
+    // a valid checksum
+    static SNAPSHOT snapshot;
+    unsigned char state[SAVE_STATE_SIZE];
+
+    chip8.random_state = 0;
+    take_snapshot(&chip8, &snapshot);
+    encode_state(&snapshot, state);
+    assert(decode_state(state, sizeof(state), &snapshot) == -1);
+}
+
+// Test 57
+static void rewind_test()
+{
+    // This test ensures that stepping back through the rewind history
+    // restores every captured frame exactly, and that capturing can carry
+    // on from the middle of the history.
+
+    static SNAPSHOT expected[100];
+    static SNAPSHOT actual;
+
+    REWIND *history = rewind_create(REWIND_DEFAULT_BUDGET, 16);
+    assert(history != NULL);
+
+    before_each();
+    load_rom("roms/test-rom.ch8", &chip8);
+
+    for (int frame = 0; frame < 100; frame++)
+    {
+        chip8.keypad ^= 1 << (frame % KEYPAD_SIZE);
+        run_frame(&chip8, 11);
+
+        rewind_capture(history, &chip8);
+        take_snapshot(&chip8, &expected[frame]);
+    }
+
+    // Back past two keyframes, then forwards again
+    for (int frame = 98; frame >= 30; frame--)
+    {
+        assert(rewind_step_back(history, &chip8) == 0);
+
+        take_snapshot(&chip8, &actual);
+        assert(memcmp(&actual, &expected[frame], sizeof(actual)) == 0);
+    }
+
+    for (int frame = 31; frame < 100; frame++)
+    {
+        chip8.keypad ^= 1 << (frame % KEYPAD_SIZE);
+        run_frame(&chip8, 11);
+
+        rewind_capture(history, &chip8);
+    }
+
+    for (int frame = 98; frame >= 0; frame--)
+    {
+        assert(rewind_step_back(history, &chip8) == 0);
+
+        take_snapshot(&chip8, &actual);
+        assert(memcmp(&actual, &expected[frame], sizeof(actual)) == 0);
+    }
+
+    assert(rewind_step_back(history, &chip8) == -1);
+
+    REWIND_STATS stats;
+    rewind_get_stats(history, &stats);
+
+    assert(stats.frames == 1);
+    assert(stats.keyframes == 1);
+    assert(stats.captures == 169);
+
+    rewind_destroy(history);
+}
+
+// Test 58
+static void rewind_budget_test()
+{
+    // This test ensures that the rewind history stays within its memory
+    // budget by dropping the oldest frames, and that what is kept still
+    // restores correctly.
+
+    static SNAPSHOT expected[600];
+    static SNAPSHOT actual;
+
+    const size_t budget = 64 * 1024;
+
+    assert(rewind_create(1024, 16) == NULL);
+
+    REWIND *history = rewind_create(budget, 8);
+    assert(history != NULL);
+
+    before_each();
+    load_rom("roms/test-rom.ch8", &chip8);
+
+    for (int frame = 0; frame < 600; frame++)
+    {
+        // Write to memory every frame so frames cost more than the registers
+        chip8.memory[0x800 + frame] = frame;
+        invalidate_instructions(&chip8, 0x800 + frame, 1);
+        run_frame(&chip8, 11);
+
+        rewind_capture(history, &chip8);
+        take_snapshot(&chip8, &expected[frame]);
+    }
+
+    REWIND_STATS stats;
+    rewind_get_stats(history, &stats);
+
+    assert(stats.bytes <= stats.budget && stats.budget <= budget);
+    assert(stats.frames > 8 && stats.frames < 600);
+
+    // Only whole keyframe groups are dropped
+    assert(stats.keyframes == (stats.frames + 7) / 8);
+
+    for (unsigned int frame = 598; frame >= 600 - stats.frames; frame--)
+    {
+        assert(rewind_step_back(history, &chip8) == 0);
+
+        take_snapshot(&chip8, &actual);
+        assert(memcmp(&actual, &expected[frame], sizeof(actual)) == 0);
+    }
+
+    assert(rewind_step_back(history, &chip8) == -1);
+
+    rewind_destroy(history);
+}
+
+// Test 59
+static void movie_test()
+{
+    // This test ensures that a recorded movie plays back exactly, from the
+    // start or from the middle, and that a changed movie is caught.
+
+    static CHP expected;
+    static MOVIE movie;
+    static MOVIE loaded;
+
+    const char *path = "/tmp/chip8_test.movie";
+    uint64_t desync_frame;
+
+    const unsigned char program[] =
+    {
+        0xC0, 0xFF, // V0 = random
+        0xC1, 0x1F, // V1 = random & 0x1F
+        0xE3, 0x9E, // Skip the next instruction if key V3 is pressed
+        0x12, 0x00, // Jump to 0x200
+        0xD0, 0x15, // Draw at (V0, V1)
+        0x12, 0x00  // Jump to 0x200
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+
+    seed_random(&chip8, 1234);
+    movie_start(&movie, 1234, 11, 50);
+
+    for (int frame = 0; frame < 300; frame++)
+    {
+        set_key(&chip8, 0, frame % 7 < 3);
+
+        assert(movie_record_frame(&movie, &chip8) == 0);
+        run_frame(&chip8, 11);
+    }
+
+    memcpy(&expected, &chip8, sizeof(chip8));
+
+    assert(movie.frames == 300);
+    assert(movie.keyframe_count == 6);
+    assert(save_movie(path, &movie) == 0);
+    assert(load_movie(path, &loaded) == 0);
+
+    assert(loaded.seed == 1234 && loaded.instructions_per_frame == 11);
+    assert(loaded.frames == 300 && loaded.keyframe_count == 6);
+    assert(memcmp(loaded.inputs, movie.inputs, 300 * sizeof(uint16_t)) == 0);
+
+    // Played from the start, on a machine that never saw the ROM
+    initialise_chip8(&chip8);
+    assert(movie_verify(&loaded, &chip8, &desync_frame) == 0);
+
+    assert(memcmp(chip8.display, expected.display, sizeof(chip8.display)) == 0);
+    assert(memcmp(chip8.V, expected.V, sizeof(chip8.V)) == 0);
+    assert(chip8.random_state == expected.random_state);
+
+    // Seeking between keyframes, then playing on from there
+    initialise_chip8(&chip8);
+    assert(movie_seek(&loaded, 175, &chip8) == 0);
+
+    for (int frame = 175; frame < 300; frame++)
+    {
+        movie_apply_input(&loaded, frame, &chip8);
+        run_frame(&chip8, 11);
+    }
+
+    assert(memcmp(chip8.display, expected.display, sizeof(chip8.display)) == 0);
+    assert(memcmp(chip8.V, expected.V, sizeof(chip8.V)) == 0);
+    assert(chip8.PC == expected.PC);
+
+    assert(movie_seek(&loaded, 300, &chip8) == 0);
+    assert(movie_seek(&loaded, 301, &chip8) == -1);
+
+    // A different key press changes the drawing before the next keyframe
+    loaded.inputs[60] ^= 1;
+    assert(movie_verify(&loaded, &chip8, &desync_frame) == -1);
+    assert(desync_frame == 100);
+
+    movie_free(&movie);
+    movie_free(&loaded);
+
+    // Damaged files are refused
+    FILE *fptr = fopen(path, "r+b");
+    fseek(fptr, 4, SEEK_SET);
+    fputc(MOVIE_VERSION + 1, fptr);
+    fclose(fptr);
+
+    FILE *original = stdout;
+    stdout = fopen("/tmp/stdoutput.txt", "w+");
+
+    assert(load_movie(path, &loaded) == -1);
+
+    // Counts too large for the file are refused before anything is
+    // allocated for them, even where their sizes would wrap around
+    const unsigned char huge[] =
+    {
+        'C', '8', 'M', 'V', MOVIE_VERSION, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,                     // Seed
+        11, 0, 0, 0, 1, 0, 0, 0,                    // Speed and keyframe interval
+        0, 0, 0, 0, 0, 0, 0, 0x80,                  // 2^63 frames
+        0, 0, 0, 0, 0, 0, 0, 0x80,                  // 2^63 keyframes
+        0, 0, 0, 0
+    };
+
+    fptr = fopen(path, "wb");
+    fwrite(huge, 1, sizeof(huge), fptr);
+    fclose(fptr);
+
+    assert(load_movie(path, &loaded) == -1);
+
+    fclose(stdout);
+    stdout = original;
+}
+
+// Test 60
+static void seed_random_test()
+{
+    // This test ensures that CXNN draws from the machine's own generator, so
+    // that a seed always gives the same numbers and snapshots carry on the
+    // same sequence.
+
+    static CHP other;
+    static SNAPSHOT snapshot;
+
+    unsigned char drawn[64];
+    int seen[256] = { 0 };
+
+    before_each();
+    memcpy(&other, &chip8, sizeof(chip8));
+
+    seed_random(&chip8, 42);
+    seed_random(&other, 42);
+
+    for (int i = 0; i < 4096; i++)
+    {
+        decode(0xC0FF, &chip8);
+        decode(0xC0FF, &other);
+
+        assert(chip8.V[0] == other.V[0]);
+        seen[chip8.V[0]] = 1;
+
+        decode(0xC10F, &chip8);
+        assert(chip8.V[1] < 0x10);
+        decode(0xC10F, &other);
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        assert(seen[i]);
+    }
+
+    // Other seeds, including 0, give other sequences
+    for (int seed = 0; seed < 2; seed++)
+    {
+        int same = 0;
+
+        seed_random(&chip8, 42);
+        seed_random(&other, seed == 0 ? 0 : 43);
+
+        for (int i = 0; i < 16; i++)
+        {
+            decode(0xC0FF, &chip8);
+            decode(0xC0FF, &other);
+
+            same += chip8.V[0] == other.V[0];
+        }
+
+        assert(same < 4);
+    }
+
+    // Restoring a snapshot goes back to the same point in the sequence
+    take_snapshot(&chip8, &snapshot);
+
+    for (int i = 0; i < 64; i++)
+    {
+        decode(0xC2FF, &chip8);
+        drawn[i] = chip8.V[2];
+    }
+
+    restore_snapshot(&chip8, &snapshot);
+
+    for (int i = 0; i < 64; i++)
+    {
+        decode(0xC2FF, &chip8);
+        assert(drawn[i] == chip8.V[2]);
+    }
+}
+
+// Test 61
+static void quirks_test()
+{
+    // This test ensures that each quirk changes only the instructions it is
+    // meant to, on every execution engine, and that the quirks are kept
+    // per machine and in snapshots.
+
+    static LOCKSTEP group;
+    static CHP machines[LOCKSTEP_LANES];
+    static CHP lane;
+    static SNAPSHOT snapshot;
+
+    // Shifts read VY, or VX in place
+    before_each();
+    chip8.V[1] = 0x81;
+    chip8.V[2] = 0x04;
+    chip8.PC = 0x202;
+    decode(0x8126, &chip8);
+    assert(chip8.V[1] == 0x02 && chip8.V[0xF] == 0);
+
+    set_quirks(&chip8, QUIRK_SHIFT_VX);
+    chip8.V[1] = 0x81;
+    chip8.PC = 0x202;
+    decode(0x8126, &chip8);
+    assert(chip8.V[1] == 0x40 && chip8.V[0xF] == 1);
+
+    chip8.V[1] = 0x81;
+    chip8.PC = 0x202;
+    decode(0x812E, &chip8);
+    assert(chip8.V[1] == 0x02 && chip8.V[0xF] == 1);
+
+    // Loads and stores leave I alone, or just past the last register
+    for (int quirk = 0; quirk < 2; quirk++)
+    {
+        before_each();
+        set_quirks(&chip8, quirk ? QUIRK_LOAD_STORE_I : 0);
+        chip8.V[0] = 1;
+        chip8.V[1] = 2;
+        chip8.V[2] = 3;
+        chip8.I = 0x300;
+        chip8.PC = 0x202;
+        decode(0xF255, &chip8);
+        assert(chip8.memory[0x300] == 1 && chip8.memory[0x301] == 2 && chip8.memory[0x302] == 3);
+        assert(chip8.I == (quirk ? 0x303 : 0x300));
+
+        chip8.I = 0x300;
+        memset(chip8.V, 0, sizeof(chip8.V));
+        chip8.PC = 0x202;
+        decode(0xF165, &chip8);
+        assert(chip8.V[0] == 1 && chip8.V[1] == 2 && chip8.V[2] == 0);
+        assert(chip8.I == (quirk ? 0x302 : 0x300));
+    }
+
+    // Jumps add V0, or the register in the top digit of the address
+    before_each();
+    chip8.V[0] = 0x10;
+    chip8.V[2] = 0x20;
+    chip8.PC = 0x202;
+    decode(0xB234, &chip8);
+    assert(chip8.PC == 0x244);
+
+    set_quirks(&chip8, QUIRK_JUMP_VX);
+    chip8.PC = 0x202;
+    decode(0xB234, &chip8);
+    assert(chip8.PC == 0x254);
+
+    // Sprites drawn over the corner wrap round, or are cut off. The 0 in
+    // the font is 0xF0 followed by three 0x90 and another 0xF0.
+    for (int quirk = 0; quirk < 2; quirk++)
+    {
+        before_each();
+        set_quirks(&chip8, quirk ? QUIRK_CLIP_SPRITES : 0);
+        chip8.V[0] = 62;
+        chip8.V[1] = 30;
+        chip8.I = 0;
+        chip8.PC = 0x202;
+        decode(0xD015, &chip8);
+
+        assert(chip8.V[0xF] == 0);
+        assert(get_pixel(&chip8, 62, 30) && get_pixel(&chip8, 63, 30) && get_pixel(&chip8, 62, 31));
+        assert(get_pixel(&chip8, 0, 30) == !quirk);
+        assert(get_pixel(&chip8, 1, 30) == !quirk);
+        assert(get_pixel(&chip8, 62, 0) == !quirk);
+        assert(get_pixel(&chip8, 62, 2) == !quirk);
+        assert(get_pixel(&chip8, 1, 0) == !quirk);
+
+        // Drawing it again only collides where it was drawn
+        chip8.PC = 0x202;
+        decode(0xD015, &chip8);
+        assert(chip8.V[0xF] == 1);
+
+        for (int row = 0; row < DISPLAY_HEIGHT; row++)
+        {
+            assert(chip8.display[row] == 0);
+        }
+    }
+
+    // Logic instructions keep VF, or clear it
+    for (int quirk = 0; quirk < 2; quirk++)
+    {
+        const unsigned short opcodes[] = { 0x8121, 0x8122, 0x8123 };
+        const unsigned char results[] = { 0xFF, 0x00, 0xFF };
+
+        before_each();
+        set_quirks(&chip8, quirk ? QUIRK_VF_RESET : 0);
+
+        for (int i = 0; i < 3; i++)
+        {
+            chip8.V[1] = 0x0F;
+            chip8.V[2] = 0xF0;
+            chip8.V[0xF] = 0x05;
+            chip8.PC = 0x202;
+            decode(opcodes[i], &chip8);
+
+            assert(chip8.V[1] == results[i]);
+            assert(chip8.V[0xF] == (quirk ? 0 : 0x05));
+        }
+    }
+
+    // Changing the quirks throws away instructions already decoded with the
+    // old ones, including fused ones
+    const unsigned char program[] =
+    {
+        0x81, 0x26, // V1 = V2 >> 1, or V1 >>= 1
+        0xA0, 0x00, // I = 0
+        0xD3, 0x45, // Draw at (V3, V4)
+        0x12, 0x06  // Jump to itself
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    chip8.V[1] = 0x81;
+    chip8.V[2] = 0x04;
+    chip8.V[3] = 62;
+    chip8.V[4] = 30;
+    run_instructions(&chip8, 4);
+    assert(chip8.V[1] == 0x02);
+    assert(get_pixel(&chip8, 0, 30));
+
+    set_quirks(&chip8, QUIRK_SHIFT_VX | QUIRK_CLIP_SPRITES);
+    memset(chip8.display, 0, sizeof(chip8.display));
+    chip8.V[1] = 0x81;
+    chip8.PC = 0x200;
+    run_instructions(&chip8, 4);
+    assert(chip8.V[1] == 0x40);
+    assert(get_pixel(&chip8, 62, 30) && !get_pixel(&chip8, 0, 30));
+
+    // Snapshots carry the quirks with them
+    take_snapshot(&chip8, &snapshot);
+    set_quirks(&chip8, 0);
+    restore_snapshot(&chip8, &snapshot);
+    assert(chip8.quirks == (QUIRK_SHIFT_VX | QUIRK_CLIP_SPRITES));
+
+    memset(chip8.display, 0, sizeof(chip8.display));
+    chip8.V[1] = 0x81;
+    chip8.PC = 0x200;
+    run_instructions(&chip8, 4);
+    assert(chip8.V[1] == 0x40);
+    assert(!get_pixel(&chip8, 0, 30));
+
+    // A lockstep group runs with the quirks of the machine it was started
+    // from, and leaves every instance as running it alone would
+    const unsigned char loop[] =
+    {
+        0x81, 0x21, // V1 |= V2
+        0x81, 0x06, // V1 >>= 1
+        0xA3, 0x00, // I = 0x300
+        0xF1, 0x55, // Store V0 and V1
+        0xF0, 0x65, // Load V0
+        0xD0, 0x15, // Draw at (V0, V1)
+        0x72, 0x10, // V2 += 0x10
+        0xB2, 0x00, // Jump to 0x200 plus V2
+    };
+
+    // A copy of the loop every 0x10 bytes, for wherever the jump lands
+    before_each();
+
+    for (int i = 0; i < 16; i++)
+    {
+        memcpy(chip8.memory + 0x200 + i * 0x10, loop, sizeof(loop));
+    }
+
+    set_quirks(&chip8, QUIRK_SHIFT_VX | QUIRK_LOAD_STORE_I | QUIRK_JUMP_VX |
+        QUIRK_CLIP_SPRITES | QUIRK_VF_RESET);
+
+    initialise_lockstep(&group, &chip8, LOCKSTEP_LANES);
+
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+    {
+        memcpy(&machines[i], &chip8, sizeof(chip8));
+        machines[i].V[0] = 40 + i;
+        machines[i].V[2] = (i & 3) * 0x10;
+        lockstep_set_lane(&group, i, &machines[i]);
+    }
+
+    for (int frame = 0; frame < 20; frame++)
+    {
+        lockstep_run_frame(&group, 8);
+
+        for (int i = 0; i < LOCKSTEP_LANES; i++)
+        {
+            run_instructions(&machines[i], 8);
+            tick_timers(&machines[i]);
+        }
+    }
+
+    for (int i = 0; i < LOCKSTEP_LANES; i++)
+    {
+        lockstep_get_lane(&group, i, &lane);
+
+        assert(memcmp(lane.V, machines[i].V, sizeof(lane.V)) == 0);
+        assert(memcmp(lane.memory, machines[i].memory, sizeof(lane.memory)) == 0);
+        assert(memcmp(lane.display, machines[i].display, sizeof(lane.display)) == 0);
+        assert(lane.PC == machines[i].PC);
+        assert(lane.I == machines[i].I);
+    }
+}
+
+// Test 62
+static void profile_test()
+{
+    // This test ensures that profiling counts every instruction, skip and
+    // collision while leaving the machine as running it normally would.
+
+    static PROFILE profile;
+    static CHP plain;
+    char text[32];
+
+    const unsigned char program[] =
+    {
+        0x60, 0x05, // V0 = 5
+        0x61, 0x00, // V1 = 0
+        0xA0, 0x00, // I = 0
+        0xD1, 0x05, // Draw at (V1, V0)
+        0x71, 0x01, // V1 += 1
+        0x31, 0x02, // Skip if V1 == 2
+        0x12, 0x06, // Jump to 0x206
+        0x12, 0x0E  // Jump to itself
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    memcpy(&plain, &chip8, sizeof(chip8));
+
+    profile_reset(&profile);
+    profile_run_instructions(&profile, &chip8, 15);
+    run_instructions(&plain, 15);
+
+    assert(memcmp(chip8.V, plain.V, sizeof(chip8.V)) == 0);
+    assert(memcmp(chip8.display, plain.display, sizeof(chip8.display)) == 0);
+    assert(chip8.PC == plain.PC);
+
+    // Idle loops are counted one instruction at a time
+    assert(profile.instructions == 15);
+    assert(profile.op_counts[OP_1NNN] == 6);
+    assert(profile.address_counts[0x206] == 2);
+    assert(profile.address_counts[0x20E] == 5);
+    assert(profile.address_counts[0x20C] == 1);
+    assert(profile.opcodes[0x206] == 0xD105);
+
+    // The second sprite overlaps the first, and the second skip is taken
+    assert(profile.op_counts[OP_DXYN] == 2);
+    assert(profile.collisions == 1);
+    assert(profile.op_counts[OP_3XNN] == 2);
+    assert(profile.skips_taken[OP_3XNN] == 1);
+
+    disassemble(0xD105, text, sizeof(text));
+    assert(strcmp(text, "DRW V1, V0, 5") == 0);
+    disassemble(0x0123, text, sizeof(text));
+    assert(strcmp(text, "SYS 0x123") == 0);
+
+    assert(write_profile("/tmp/chip8_test.profile", &profile, PROFILE_JSON) == 0);
+    assert(write_annotated_disassembly("/tmp/chip8_test.profile.asm", &profile) == 0);
+}
+
+// Test 63
+static void call_graph_test()
+{
+    // This test ensures that the profiler attributes instructions to the
+    // subroutines they ran in, and copes with programs that never return
+    // or return without calling.
+
+    static PROFILE profile;
+    char line[64];
+
+    const unsigned char program[] =
+    {
+        0x22, 0x10, // Call 0x210
+        0x22, 0x20, // Call 0x220
+        0x12, 0x04  // Jump to itself
+    };
+
+    const unsigned char first[] =
+    {
+        0x22, 0x20, // Call 0x220
+        0x00, 0xEE  // Return
+    };
+
+    const unsigned char second[] =
+    {
+        0x60, 0x01, // V0 = 1
+        0x00, 0xEE  // Return
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, program, sizeof(program));
+    memcpy(chip8.memory + 0x210, first, sizeof(first));
+    memcpy(chip8.memory + 0x220, second, sizeof(second));
+
+    profile_reset(&profile);
+    profile_run_instructions(&profile, &chip8, 10);
+
+    assert(profile.current_call == 0);
+    assert(profile.call_count == 4);
+    assert(profile.unmatched_returns == 0);
+
+    assert(write_folded_stacks("/tmp/chip8_test.folded", &profile) == 0);
+
+    const char *expected[] = { "main 4\n", "main;0x210 2\n", "main;0x210;0x220 2\n", "main;0x220 2\n" };
+    int found[4] = { 0 };
+    FILE *folded = fopen("/tmp/chip8_test.folded", "r");
+
+    while (fgets(line, sizeof(line), folded))
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            found[i] |= strcmp(line, expected[i]) == 0;
+        }
+    }
+
+    fclose(folded);
+
+    assert(found[0] && found[1] && found[2] && found[3]);
+
+    // Jumping back out of a subroutine without returning nests calls forever
+    const unsigned char escape[] =
+    {
+        0x22, 0x10, // Call 0x210
+    };
+
+    before_each();
+    memcpy(chip8.memory + 0x200, escape, sizeof(escape));
+    chip8.memory[0x210] = 0x12; // Jump to 0x200
+    chip8.memory[0x211] = 0x00;
+
+    profile_reset(&profile);
+    profile_run_instructions(&profile, &chip8, 1000);
+
+    assert(profile.instructions == 1000);
+    assert(profile.calls[profile.current_call].depth == PROFILE_MAX_CALL_DEPTH);
+    assert(profile.untracked_depth == 500 - PROFILE_MAX_CALL_DEPTH);
+    assert(write_folded_stacks("/tmp/chip8_test.folded", &profile) == 0);
+
+    // Returning with an empty stack wraps the stack pointer round
+    before_each();
+    chip8.memory[0x200] = 0x00;
+    chip8.memory[0x201] = 0xEE;
+
+    for (int i = 0; i < STACK_SIZE; i++)
+    {
+        chip8.stack[i] = 0x200;
+    }
+
+    profile_reset(&profile);
+    profile_run_instructions(&profile, &chip8, 100);
+
+    assert(profile.unmatched_returns == 100);
+    assert(profile.current_call == 0);
+}
+
+// Test 64
+static void load_rom_too_large_test()
+{
+    // This test ensures that load_rom() refuses ROMs too large for memory
+    // instead of loading the start of them, and loads ones that just fit.
+
+    static unsigned char rom[MAX_PROGRAM_SIZE + 1];
+
+    memset(rom, 0x12, sizeof(rom));
+
+    before_each();
+    write_test_rom("/tmp/chip8_large.ch8", rom, sizeof(rom));
+    assert(load_rom_file("/tmp/chip8_large.ch8", &chip8) == ROM_TOO_LARGE);
+    assert(chip8.memory[PROGRAM_START] == 0);
+
+    write_test_rom("/tmp/chip8_large.ch8", rom, MAX_PROGRAM_SIZE);
+    assert(load_rom_file("/tmp/chip8_large.ch8", &chip8) == ROM_LOADED);
+    assert(chip8.memory[MEMORY_SIZE - 1] == 0x12);
+
+    assert(load_rom_file("invalid-rom.ch8", &chip8) == ROM_MISSING);
+}
+
+// Test 65
+static void pack_test()
+{
+    // This test ensures that ROMs loaded from a pack match the files they
+    // were packed from, and that damaged packs are reported per ROM.
+
+    static CHP from_file;
+    static unsigned char image[8192];
+
+    const unsigned char program[] =
+    {
+        0x70, 0x01, // V0 += 1
+        0x12, 0x00  // Jump to 0x200
+    };
+
+    write_test_rom("/tmp/chip8_pack_test.ch8", program, sizeof(program));
+
+    FILE *list = fopen("/tmp/chip8_pack_test.lst", "w");
+    fprintf(list, "# rom speed quirks\nroms/test-rom.ch8 20 clip,jump\n\n/tmp/chip8_pack_test.ch8\n");
+    fclose(list);
+
+    assert(build_pack("/tmp/chip8_test.pack", "/tmp/chip8_pack_test.lst") == 0);
+
+    PACK *pack = pack_open("/tmp/chip8_test.pack");
+    PACK_ROM rom;
+
+    assert(pack != NULL);
+    assert(pack_count(pack) == 2);
+    assert(pack_find(pack, "chip8_pack_test.ch8") == 1);
+    assert(pack_find(pack, "missing.ch8") == -1);
+
+    int index = pack_find(pack, "test-rom.ch8");
+
+    assert(index == 0);
+    assert(pack_get(pack, index, &rom) == ROM_LOADED);
+    assert(strcmp(rom.name, "test-rom.ch8") == 0);
+    assert(rom.instructions_per_frame == 20);
+    assert(rom.quirks == (QUIRK_CLIP_SPRITES | QUIRK_JUMP_VX));
+
+    before_each();
+    memcpy(&from_file, &chip8, sizeof(chip8));
+    assert(pack_load(pack, index, &chip8) == ROM_LOADED);
+    assert(load_rom("roms/test-rom.ch8", &from_file) == 0);
+    assert(memcmp(chip8.memory, from_file.memory, sizeof(chip8.memory)) == 0);
+
+    pack_close(pack);
+
+    // Every ROM in a pack runs as a batch job
+    BATCH_CONFIG config = { "/tmp/chip8_test.pack", "/tmp/chip8_pack_test.csv", BATCH_CSV, 2, 0, 0, 10, 5 };
+
+    assert(run_batch(&config) == 0);
+
+    // A changed byte is caught by the ROM's hash, and a cut off file leaves
+    // the last ROM short
+    FILE *fptr = fopen("/tmp/chip8_test.pack", "rb");
+    size_t size = fread(image, 1, sizeof(image), fptr);
+    fclose(fptr);
+
+    image[size - 1] ^= 0xFF;
+    write_test_rom("/tmp/chip8_test.pack", image, size);
+
+    pack = pack_open("/tmp/chip8_test.pack");
+    assert(pack_load(pack, 0, &chip8) == ROM_LOADED);
+    assert(pack_load(pack, 1, &chip8) == ROM_CORRUPT);
+    pack_close(pack);
+
+    write_test_rom("/tmp/chip8_test.pack", image, size - 1);
+
+    pack = pack_open("/tmp/chip8_test.pack");
+    assert(pack_get(pack, 1, &rom) == ROM_TRUNCATED);
+    assert(pack_load(pack, 1, &chip8) == ROM_TRUNCATED);
+    pack_close(pack);
+
+    // Files that are not packs are refused, as are ROMs too large to pack
+    write_test_rom("/tmp/chip8_test.pack", image, 16);
+    assert(pack_open("/tmp/chip8_test.pack") == NULL);
+
+    list = fopen("/tmp/chip8_pack_test.lst", "w");
+    fprintf(list, "/tmp/chip8_large.ch8\n");
+    fclose(list);
+
+    static unsigned char large[MAX_PROGRAM_SIZE + 1];
+    write_test_rom("/tmp/chip8_large.ch8", large, sizeof(large));
+
+    assert(build_pack("/tmp/chip8_test.pack", "/tmp/chip8_pack_test.lst") == -1);
+}
+
+// Test 66
+static void keypad_test()
+{
+    // This test ensures that EX9E and EXA1 test the key named by VX, and that
+    // FX0A waits for a key to be both pressed and released before storing it.
+
+    const unsigned char program[] =
+    {
+        0x61, 0x03, // V1 = 3
+        0xE1, 0x9E, // Skip if key V1 is held
+        0x62, 0x01, // V2 = 1
+        0xE1, 0xA1, // Skip if key V1 is not held
+        0x63, 0x01, // V3 = 1
+        0xF4, 0x0A, // Wait for a key into V4
+        0x65, 0x01  // V5 = 1
+    };
+
+    before_each();
+    load_program(&chip8, program, sizeof(program));
+
+    set_key(&chip8, 3, 1);
+    set_key(&chip8, 9, 1);
+    set_key(&chip8, 9, 0);
+    assert(chip8.keypad == 1 << 3);
+
+    run_instructions(&chip8, 5);
+    assert(chip8.V[2] == 0 && chip8.V[3] == 1);
+
+    // Still held from before, so FX0A takes it as pressed and waits for it
+    run_instructions(&chip8, 3);
+    assert(chip8.PC == 0x20A && chip8.key_wait == 4);
+
+    set_key(&chip8, 0xC, 1);
+    run_instructions(&chip8, 3);
+    assert(chip8.PC == 0x20A && chip8.V[5] == 0);
+
+    set_key(&chip8, 3, 0);
+    run_instructions(&chip8, 2);
+    assert(chip8.V[4] == 3 && chip8.V[5] == 1 && chip8.key_wait == 0);
+}
+
+// Test 67
+#define EXCHANGE_TEST_FRAMES 200000
+
+static void *publish_frames(void *arg)
+{
+    FRAME_EXCHANGE *exchange = arg;
+
+    for (uint64_t number = 1; number <= EXCHANGE_TEST_FRAMES; number++)
+    {
+        FRAME *frame = frame_exchange_back(exchange);
+
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            frame->display[y] = number;
+        }
+
+        frame->frame = number;
+        frame_exchange_publish(exchange);
+    }
+
+    return NULL;
+}
+
+static void frame_exchange_test()
+{
+    // This test ensures that the reader of a frame exchange only ever sees
+    // whole frames, in order, and always ends up with the latest one.
+
+    static FRAME_EXCHANGE exchange;
+    pthread_t writer;
+    uint64_t last = 0;
+
+    frame_exchange_init(&exchange);
+    assert(frame_exchange_latest(&exchange) == NULL);
+
+    // Frames the reader never took are replaced by newer ones
+    frame_exchange_back(&exchange)->frame = 1;
+    frame_exchange_publish(&exchange);
+    frame_exchange_back(&exchange)->frame = 2;
+    frame_exchange_publish(&exchange);
+
+    assert(frame_exchange_latest(&exchange)->frame == 2);
+    assert(frame_exchange_latest(&exchange) == NULL);
+
+    frame_exchange_init(&exchange);
+    pthread_create(&writer, NULL, publish_frames, &exchange);
+
+    while (last < EXCHANGE_TEST_FRAMES)
+    {
+        const FRAME *frame = frame_exchange_latest(&exchange);
+
+        if (frame == NULL)
+        {
+            continue;
+        }
+
+        assert(frame->frame > last);
+
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            assert(frame->display[y] == frame->frame);
+        }
+
+        last = frame->frame;
+    }
+
+    pthread_join(writer, NULL);
+}
+
+// Test 68
+static void input_queue_test()
+{
+    // This test ensures that events come out of the input queue in the order
+    // they went in, and that a full queue refuses events rather than
+    // overwriting ones not yet read.
+
+    static INPUT_QUEUE queue;
+    INPUT_EVENT event = { INPUT_KEY_DOWN, 0 };
+
+    input_queue_init(&queue);
+    assert(input_queue_pop(&queue, &event) == -1);
+
+    // Twice around the ring, to cover the indices wrapping
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < INPUT_QUEUE_SIZE; i++)
+        {
+            event.key = i & 0xF;
+            event.type = i % 2 ? INPUT_KEY_UP : INPUT_KEY_DOWN;
+            assert(input_queue_push(&queue, &event) == 0);
+        }
+
+        assert(input_queue_push(&queue, &event) == -1);
+
+        for (int i = 0; i < INPUT_QUEUE_SIZE; i++)
+        {
+            assert(input_queue_pop(&queue, &event) == 0);
+            assert(event.key == (i & 0xF));
+            assert(event.type == (i % 2 ? INPUT_KEY_UP : INPUT_KEY_DOWN));
+        }
+
+        assert(input_queue_pop(&queue, &event) == -1);
+    }
+}
+
+// Test 69
+static void sound_timer_audio_test()
+{
+    // This test ensures that setting the sound timer to N sounds the buzzer
+    // for exactly N frames, and that the frames of audio always add up to
+    // the sample rate, starting each tone at the beginning of its wave.
+
+    static int16_t samples[AUDIO_MAX_FRAME_SAMPLES];
+    AUDIO_TONE tone;
+    unsigned int total = 0;
+    int sounding = 0;
+
+    const unsigned char program[] =
+    {
+        0x60, 0x03, // V0 = 3
+        0xF0, 0x18, // ST = V0
+        0x12, 0x04  // Jump to 0x204
+    };
+
+    before_each();
+    load_program(&chip8, program, sizeof(program));
+
+    for (int frame = 0; frame < 6; frame++)
+    {
+        run_frame(&chip8, 10);
+        sounding += chip8.sound_flag;
+    }
+
+    assert(sounding == 3 && chip8.ST == 0);
+
+    // 22050 / 60 is not a whole number of samples
+    audio_tone_init(&tone, 22050, 441, 1000);
+
+    for (int frame = 0; frame < TIMER_RATE; frame++)
+    {
+        unsigned int count = audio_tone_frame(&tone, frame % 2, samples);
+
+        assert(count == 367 || count == 368);
+        total += count;
+
+        // At 441 Hz a wave is 50 samples, the first half high
+        if (frame % 2)
+        {
+            assert(samples[0] == 1000 && samples[24] == 1000 && samples[25] == -1000);
+        } else
+        {
+            assert(samples[0] == 0 && samples[count - 1] == 0);
+        }
+    }
+
+    assert(total == 22050);
+}
+
+// Test 70
+static void audio_ring_test()
+{
+    // This test ensures that the audio ring plays samples in order, pads
+    // with silence and counts it when it runs dry, and never overwrites
+    // samples not yet played.
+
+    static AUDIO_RING ring;
+    static int16_t samples[AUDIO_RING_SIZE + 16];
+    int16_t played[32];
+
+    for (int i = 0; i < AUDIO_RING_SIZE + 16; i++)
+    {
+        samples[i] = i + 1;
+    }
+
+    audio_ring_init(&ring);
+
+    assert(audio_ring_write(&ring, samples, 20) == 20);
+    audio_ring_read(&ring, played, 32);
+
+    assert(played[0] == 1 && played[19] == 20 && played[20] == 0 && played[31] == 0);
+    assert(atomic_load(&ring.underruns) == 12 && audio_ring_fill(&ring) == 0);
+
+    assert(audio_ring_write(&ring, samples, AUDIO_RING_SIZE + 16) == AUDIO_RING_SIZE);
+    assert(audio_ring_write(&ring, samples, 1) == 0);
+
+    audio_ring_read(&ring, played, 32);
+    assert(played[0] == 1 && played[31] == 32);
+    assert(audio_ring_fill(&ring) == AUDIO_RING_SIZE - 32);
+}
+
+// Test 71
+static void align_schedule_test()
+{
+    // This test ensures that a schedule locks on to another 60 Hz clock by
+    // the shortest way round, moving less than a frame each time.
+
+    SCHEDULER scheduler;
+
+    initialise_scheduler(&scheduler, 10);
+    scheduler.start_ns = 1000000000ULL;
+
+    // Targets a whole number of frames away are already in line
+    align_schedule(&scheduler, next_frame_deadline(&scheduler) + 5 * FRAME_NS);
+    assert(scheduler.start_ns == 1000000000ULL);
+
+    // A target just before a deadline pulls the schedule earlier, even when
+    // it is given from long ago
+    for (int i = 0; i < 200; i++)
+    {
+        uint64_t before = scheduler.start_ns;
+
+        align_schedule(&scheduler, 1000000000ULL - 100 * FRAME_NS - 1000000);
+        assert(scheduler.start_ns <= before && before - scheduler.start_ns < FRAME_NS / 8);
+
+        scheduler.frame++;
+    }
+
+    // Within a microsecond, FRAME_NS being rounded down from the true period
+    assert(1000000000ULL - scheduler.start_ns > 999000 && 1000000000ULL - scheduler.start_ns < 1001000);
+}
+
+// Test 72
+static void latency_test()
+{
+    // This test ensures that each key press is measured against the first
+    // frame presented that the machine drew after being given it, even when
+    // frames in between were never shown.
+
+    static LATENCY latency;
+
+    latency_reset(&latency);
+
+    latency_key_pressed(&latency, 1000);
+    latency_key_pressed(&latency, 2000);
+
+    // Drawn before either press reached the machine
+    latency_frame_presented(&latency, 0, 5000);
+    assert(latency.sample_count == 0);
+
+    // Drawn after both, the frame after the first press having been skipped
+    latency_frame_presented(&latency, 2, 9000);
+    assert(latency.sample_count == 2);
+
+    latency_key_pressed(&latency, 10000);
+    latency_frame_presented(&latency, 3, 12000);
+
+    assert(latency_percentile(&latency, 0) == 2000);
+    assert(latency_percentile(&latency, 50) == 7000);
+    assert(latency_percentile(&latency, 100) == 8000);
+
+    // Presses that never show are given up on rather than blocking the rest
+    for (int i = 0; i < LATENCY_PENDING + 1; i++)
+    {
+        latency_key_pressed(&latency, 20000);
+    }
+
+    assert(latency.lost == 1);
+
+    latency_frame_presented(&latency, 3 + LATENCY_PENDING + 1, 21000);
+    assert(latency.sample_count == 3 + LATENCY_PENDING);
+}
+
+// Test 73
+static void key_wait_idle_test()
+{
+    // This test ensures that FX0A waiting on the keypad uses up the rest of
+    // the budget as an idle loop, in the interpreter and the JIT alike.
+
+    const unsigned char program[] =
+    {
+        0xF4, 0x0A, // Wait for a key into V4
+        0x65, 0x01  // V5 = 1
+    };
+
+    before_each();
+    load_program(&chip8, program, sizeof(program));
+
+    run_instructions(&chip8, 1000);
+    assert(chip8.PC == 0x200 && chip8.idle_instructions == 999);
+
+    set_key(&chip8, 3, 1);
+    run_instructions(&chip8, 1000);
+    assert(chip8.PC == 0x200 && chip8.key_wait == 4 && chip8.idle_instructions == 1998);
+
+    set_key(&chip8, 3, 0);
+    run_instructions(&chip8, 2);
+    assert(chip8.V[4] == 3 && chip8.V[5] == 1 && chip8.idle_instructions == 1998);
+
+#if defined(TEST_JIT)
+    before_each();
+    load_program(&chip8, program, sizeof(program));
+    jit_flush(jit);
+
+    jit_run(jit, &chip8, 1000);
+    assert(chip8.PC == 0x200 && chip8.idle_instructions > 0);
+
+    set_key(&chip8, 3, 1);
+    jit_run(jit, &chip8, 1000);
+    assert(chip8.PC == 0x200 && chip8.key_wait == 4);
+
+    set_key(&chip8, 3, 0);
+    jit_run(jit, &chip8, 2);
+    assert(chip8.V[4] == 3 && chip8.V[5] == 1);
+#endif
+}
+
+// Test 74
+static void batch_stealing_test()
+{
+    // This test ensures that a batch with far more jobs than workers, where
+    // one worker starts with all the long jobs, still runs each job once
+    // while the others steal from it and finish at different times.
+
+    const unsigned char program[] =
+    {
+        0x70, 0x01, // V0 += 1
+        0x12, 0x00  // Jump to 0x200
+    };
+
+    write_test_rom("/tmp/chip8_stealing_test.ch8", program, sizeof(program));
+
+    FILE *list = fopen("/tmp/chip8_stealing_test.lst", "w");
+
+    for (int i = 0; i < 96; i++)
+    {
+        fprintf(list, "/tmp/chip8_stealing_test.ch8 %d\n", i < 12 ? 2000 : 1);
+    }
+
+    fclose(list);
+
+    BATCH_CONFIG config = { "/tmp/chip8_stealing_test.lst", "/tmp/chip8_stealing_test.csv", BATCH_CSV, 8, 0, 0, 10, 50 };
+
+    for (int round = 0; round < 5; round++)
+    {
+        assert(run_batch(&config) == 0);
+
+        FILE *csv = fopen(config.output_path, "r");
+        char line[256];
+        int rows = 0;
+
+        assert(fgets(line, sizeof(line), csv) != NULL);
+
+        while (fgets(line, sizeof(line), csv))
+        {
+            unsigned long long seed;
+            unsigned long long frames;
+            unsigned long long instructions;
+            char reason[32];
+
+            assert(sscanf(strchr(line, ',') + 4, "%llu,%llu,%llu,%31[a-z_]", &seed, &frames, &instructions, reason) == 4);
+            assert(frames == (rows < 12 ? 2000 : 1));
+            assert(strcmp(reason, "completed") == 0);
+
+            rows += 1;
+        }
+
+        fclose(csv);
+
+        assert(rows == 96);
+    }
+}
+
+int main()
+{
+#if defined(TEST_JIT)
+    jit = jit_create(JIT_MAX_BLOCK_LENGTH);
+    single_jit = jit_create(1);
+
+    assert(jit != NULL && single_jit != NULL);
+#endif
+
+    // Run each test
+    initialise_chip8_test();
+    load_rom_success_test();
+    load_rom_failure_test();
+    fetch_test();
+    decode_00EE_test();
+    decode_1NNN_test();
+    decode_2NNN_test();
     decode_3XNN_skip_test();
+    decode_3XNN_no_skip_test();
     decode_4XNN_skip_test();
     decode_4XNN_no_skip_test();
     decode_5XY0_skip_test();
@@ -1156,6 +3061,44 @@ int main()
     decode_FX33_test();
     decode_FX55_test();
     decode_FX65_test();
+    decode_00E0_test();
+    decode_DXYN_wrap_test();
+    display_hash_test();
+    run_frame_test();
+    next_frame_deadline_test();
+    self_modifying_code_test();
+    superinstruction_test();
+    idle_loop_test();
+    lockstep_matches_interpreter_test();
+    batch_job_test();
+    run_batch_test();
+    snapshot_restore_test();
+    save_state_file_test();
+    rewind_test();
+    rewind_budget_test();
+    movie_test();
+    seed_random_test();
+    quirks_test();
+    profile_test();
+    call_graph_test();
+    load_rom_too_large_test();
+    pack_test();
+    keypad_test();
+    frame_exchange_test();
+    input_queue_test();
+    sound_timer_audio_test();
+    audio_ring_test();
+    align_schedule_test();
+    latency_test();
+    key_wait_idle_test();
+    batch_stealing_test();
+
+#if defined(TEST_JIT)
+    jit_matches_interpreter_test();
+
+    jit_destroy(single_jit);
+    jit_destroy(jit);
+#endif
 
     printf("All tests passed.\n");
 
@@ -0,0 +1,138 @@
+#include "exchange.h"
+
+#include <string.h>
+
+#define EXCHANGE_FRESH 4
+#define EXCHANGE_INDEX 3
+
+void frame_exchange_init(FRAME_EXCHANGE *exchange)
+{
+    memset(exchange->frames, 0, sizeof(exchange->frames));
+
+    exchange->back = 0;
+    atomic_init(&exchange->middle, 1);
+    exchange->front = 2;
+}
+
+FRAME *frame_exchange_back(FRAME_EXCHANGE *exchange)
+{
+    return &exchange->frames[exchange->back];
+}
+
+void frame_exchange_publish(FRAME_EXCHANGE *exchange)
+{
+    // Release makes the frame's contents visible before its index
+    unsigned int previous = atomic_exchange_explicit(&exchange->middle, exchange->back | EXCHANGE_FRESH,
+            memory_order_acq_rel);
+
+    exchange->back = previous & EXCHANGE_INDEX;
+}
+
+const FRAME *frame_exchange_latest(FRAME_EXCHANGE *exchange)
+{
+    // Checked first so that an idle reader never writes to the shared line
+    if (!(atomic_load_explicit(&exchange->middle, memory_order_relaxed) & EXCHANGE_FRESH))
+    {
+        return NULL;
+    }
+
+    unsigned int previous = atomic_exchange_explicit(&exchange->middle, exchange->front, memory_order_acq_rel);
+
+    exchange->front = previous & EXCHANGE_INDEX;
+
+    return &exchange->frames[exchange->front];
+}
+
+
+void input_queue_init(INPUT_QUEUE *queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+int input_queue_push(INPUT_QUEUE *queue, const INPUT_EVENT *event)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == INPUT_QUEUE_SIZE)
+    {
+        return -1;
+    }
+
+    queue->events[tail % INPUT_QUEUE_SIZE] = *event;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+int input_queue_pop(INPUT_QUEUE *queue, INPUT_EVENT *event)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire))
+    {
+        return -1;
+    }
+
+    *event = queue->events[head % INPUT_QUEUE_SIZE];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+
+void audio_ring_init(AUDIO_RING *ring)
+{
+    memset(ring->samples, 0, sizeof(ring->samples));
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->underruns, 0);
+}
+
+unsigned int audio_ring_fill(AUDIO_RING *ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) -
+        atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+unsigned int audio_ring_write(AUDIO_RING *ring, const int16_t *samples, unsigned int count)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int space = AUDIO_RING_SIZE - (tail - atomic_load_explicit(&ring->head, memory_order_acquire));
+
+    if (count > space)
+    {
+        count = space;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        ring->samples[(tail + i) % AUDIO_RING_SIZE] = samples[i];
+    }
+
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+
+    return count;
+}
+
+void audio_ring_read(AUDIO_RING *ring, int16_t *samples, unsigned int count)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int available = atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+    unsigned int taken = count < available ? count : available;
+
+    for (unsigned int i = 0; i < taken; i++)
+    {
+        samples[i] = ring->samples[(head + i) % AUDIO_RING_SIZE];
+    }
+
+    memset(samples + taken, 0, (count - taken) * sizeof(int16_t));
+
+    atomic_store_explicit(&ring->head, head + taken, memory_order_release);
+
+    if (taken < count)
+    {
+        atomic_fetch_add_explicit(&ring->underruns, count - taken, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef EXCHANGE_HEADER
+#define EXCHANGE_HEADER
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Hand-offs between the thread running the machine and the threads that
+// present its frames, handle window events and play its sound. Each has
+// exactly one writer and one reader, and neither side ever waits for the
+// other.
+
+#define INPUT_QUEUE_SIZE 256
+
+// Samples the audio ring holds, a power of two
+#define AUDIO_RING_SIZE 8192
+
+// Keeps the indices each side writes on their own cache lines
+#define CACHE_LINE_SIZE 64
+
+typedef struct
+{
+    uint64_t display[DISPLAY_HEIGHT];
+
+    // Emulated frame the display was taken after
+    uint64_t frame;
+
+    // Key presses the machine had been given by then
+    uint64_t presses;
+} FRAME;
+
+// Triple buffer: the writer fills one frame while the reader shows another,
+// and the third holds the latest finished frame until one of them swaps it
+typedef struct
+{
+    FRAME frames[3];
+
+    // Index of the latest finished frame, with EXCHANGE_FRESH set until the
+    // reader has taken it
+    _Alignas(CACHE_LINE_SIZE) atomic_uint middle;
+
+    // Owned by the writer and the reader respectively
+    _Alignas(CACHE_LINE_SIZE) unsigned int back;
+    _Alignas(CACHE_LINE_SIZE) unsigned int front;
+} FRAME_EXCHANGE;
+
+enum
+{
+    INPUT_KEY_DOWN,
+    INPUT_KEY_UP,
+    INPUT_SAVE_STATE,
+    INPUT_LOAD_STATE,
+    INPUT_WRITE_PROFILE,
+    INPUT_REWIND_START,
+    INPUT_REWIND_STOP
+};
+
+typedef struct
+{
+    unsigned char type;
+
+    // Keypad key, for INPUT_KEY_DOWN and INPUT_KEY_UP
+    unsigned char key;
+} INPUT_EVENT;
+
+// Ring of events from the window to the machine, in the order they happened
+typedef struct
+{
+    INPUT_EVENT events[INPUT_QUEUE_SIZE];
+
+    // Count of events taken by the reader and added by the writer, which
+    // wrap around freely
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;
+} INPUT_QUEUE;
+
+// Ring of samples from the machine to the audio device's callback
+typedef struct
+{
+    int16_t samples[AUDIO_RING_SIZE];
+
+    // Count of samples played by the reader and added by the writer, which
+    // wrap around freely
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;
+
+    // Silent samples the reader had to play because the ring ran dry
+    _Alignas(CACHE_LINE_SIZE) atomic_ullong underruns;
+} AUDIO_RING;
+
+void frame_exchange_init(FRAME_EXCHANGE *exchange);
+
+// Frame for the writer to fill in, which it owns until it publishes it
+FRAME *frame_exchange_back(FRAME_EXCHANGE *exchange);
+
+// Makes the back frame the latest, replacing one the reader never took
+void frame_exchange_publish(FRAME_EXCHANGE *exchange);
+
+// Returns the latest frame, which the reader owns until its next call, or
+// NULL when nothing has been published since the last call
+const FRAME *frame_exchange_latest(FRAME_EXCHANGE *exchange);
+
+void input_queue_init(INPUT_QUEUE *queue);
+
+// Returns -1 when the queue is full, dropping the event
+int input_queue_push(INPUT_QUEUE *queue, const INPUT_EVENT *event);
+
+// Returns -1 when the queue is empty
+int input_queue_pop(INPUT_QUEUE *queue, INPUT_EVENT *event);
+
+void audio_ring_init(AUDIO_RING *ring);
+
+// Samples written and not yet played, which either side may ask for
+unsigned int audio_ring_fill(AUDIO_RING *ring);
+
+// Adds as many of the samples as fit, returning how many that was
+unsigned int audio_ring_write(AUDIO_RING *ring, const int16_t *samples, unsigned int count);
+
+// Takes count samples, padding with silence when the ring runs dry. Never
+// allocates, locks or blocks, so it is safe in an audio callback.
+void audio_ring_read(AUDIO_RING *ring, int16_t *samples, unsigned int count);
+
+#endif
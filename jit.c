@@ -0,0 +1,808 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+// Most code emit_instruction() writes for one instruction. The largest is
+// FX65 loading all sixteen registers inline, at 472 bytes.
+#define JIT_MAX_INSTRUCTION_SIZE 512
+
+// Most code a block adds around its instructions: the budget check at the
+// start and the exit after the last instruction
+#define JIT_BLOCK_OVERHEAD 64
+
+// Room left free in the code cache before translating a block, enough for
+// the longest block made entirely of the largest instruction
+#define JIT_BLOCK_RESERVE (JIT_BLOCK_OVERHEAD + JIT_MAX_BLOCK_LENGTH * JIT_MAX_INSTRUCTION_SIZE)
+
+// Host registers, numbered as in x86-64 instruction encodings
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// While translated code runs, RBX holds the CHP pointer, R15 the remaining
+// instruction budget, RAX/RCX/RDX are scratch and V0-V9 live in the host
+// registers below. VA-VF are accessed in memory.
+#define HOST_V_COUNT 10
+
+static const unsigned char host_v[HOST_V_COUNT] =
+{
+    RSI, RDI, RBP, R8, R9, R10, R11, R12, R13, R14
+};
+
+#define OFFSET_V(x) ((uint32_t)(offsetof(CHP, V) + (x)))
+#define OFFSET_PC ((uint32_t)offsetof(CHP, PC))
+#define OFFSET_SP ((uint32_t)offsetof(CHP, SP))
+#define OFFSET_I ((uint32_t)offsetof(CHP, I))
+#define OFFSET_DT ((uint32_t)offsetof(CHP, DT))
+#define OFFSET_ST ((uint32_t)offsetof(CHP, ST))
+#define OFFSET_STACK ((uint32_t)offsetof(CHP, stack))
+#define OFFSET_MEMORY ((uint32_t)offsetof(CHP, memory))
+
+_Static_assert(sizeof(INSTRUCTION) <= sizeof(uint64_t), "INSTRUCTION must fit in a register");
+
+struct JIT
+{
+    unsigned char *code;
+    size_t used;
+    size_t blocks_start;
+
+    // Shared entry trampoline and exit stubs at the start of the code cache
+    void (*enter)(CHP *chip8, void *block, int64_t budget);
+    unsigned char *exit_spill;
+    unsigned char *exit_nospill;
+
+    // Translated block for each start address and how many instructions it
+    // holds, plus which memory bytes have been translated at all
+    unsigned char *blocks[MEMORY_SIZE];
+    unsigned char block_length[MEMORY_SIZE];
+    unsigned char translated[MEMORY_SIZE];
+
+    // Addresses found to hold idle loops, which are never chained to so that
+    // every pass through them goes back to the dispatcher to be skipped
+    unsigned char idle[MEMORY_SIZE];
+
+    unsigned int max_block_length;
+    int flush_pending;
+
+    // Quirks of the machine the blocks were translated for
+    unsigned int quirks;
+
+    // Written by the exit stub: the patchable jump that left the block, if
+    // any, and the instruction budget that was left
+    unsigned char *exit_site;
+    int64_t budget;
+
+    uint64_t blocks_translated;
+    uint64_t flushes;
+};
+
+// --- Code emission ---
+
+static void emit_bytes(JIT *jit, const unsigned char *bytes, size_t count)
+{
+    memcpy(jit->code + jit->used, bytes, count);
+    jit->used += count;
+}
+
+#define EMIT(jit, ...) \
+    emit_bytes(jit, (const unsigned char[]){ __VA_ARGS__ }, sizeof((const unsigned char[]){ __VA_ARGS__ }))
+
+static void emit32(JIT *jit, uint32_t value)
+{
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static void emit16(JIT *jit, uint16_t value)
+{
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static void emit64(JIT *jit, uint64_t value)
+{
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static void patch_rel32(unsigned char *site, const unsigned char *target)
+{
+    // site points at the 4 byte displacement, relative to the next instruction
+    int32_t rel = (int32_t)(target - (site + 4));
+
+    memcpy(site, &rel, sizeof(rel));
+}
+
+static void emit_jump(JIT *jit, const unsigned char *target)
+{
+    EMIT(jit, 0xE9);                                        // jmp rel32
+    emit32(jit, 0);
+    patch_rel32(jit->code + jit->used - 4, target);
+}
+
+// movzx scratch32, V[x]
+static void emit_load_v(JIT *jit, unsigned int scratch, unsigned int x)
+{
+    if (x < HOST_V_COUNT)
+    {
+        unsigned int reg = host_v[x];
+
+        EMIT(jit, 0x40 | (reg >> 3), 0x0F, 0xB6, 0xC0 | (scratch << 3) | (reg & 7));
+    } else
+    {
+        EMIT(jit, 0x0F, 0xB6, 0x83 | (scratch << 3));
+        emit32(jit, OFFSET_V(x));
+    }
+}
+
+// mov V[x], scratch8
+static void emit_store_v(JIT *jit, unsigned int x, unsigned int scratch)
+{
+    if (x < HOST_V_COUNT)
+    {
+        unsigned int reg = host_v[x];
+
+        EMIT(jit, 0x40 | (reg >> 3), 0x88, 0xC0 | (scratch << 3) | (reg & 7));
+    } else
+    {
+        EMIT(jit, 0x40, 0x88, 0x83 | (scratch << 3));
+        emit32(jit, OFFSET_V(x));
+    }
+}
+
+// mov V[x], imm8
+static void emit_store_v_imm(JIT *jit, unsigned int x, unsigned char value)
+{
+    if (x < HOST_V_COUNT)
+    {
+        unsigned int reg = host_v[x];
+
+        EMIT(jit, 0x40 | (reg >> 3), 0xB0 | (reg & 7), value);
+    } else
+    {
+        EMIT(jit, 0xC6, 0x83);
+        emit32(jit, OFFSET_V(x));
+        EMIT(jit, value);
+    }
+}
+
+// Write the host-allocated V registers back to the CHP
+static void emit_spill(JIT *jit)
+{
+    for (unsigned int i = 0; i < HOST_V_COUNT; i++)
+    {
+        unsigned int reg = host_v[i];
+
+        EMIT(jit, 0x40 | ((reg >> 3) << 2), 0x88, 0x83 | ((reg & 7) << 3));
+        emit32(jit, OFFSET_V(i));
+    }
+}
+
+// Load the host-allocated V registers from the CHP
+static void emit_reload(JIT *jit)
+{
+    for (unsigned int i = 0; i < HOST_V_COUNT; i++)
+    {
+        unsigned int reg = host_v[i];
+
+        EMIT(jit, 0x40 | ((reg >> 3) << 2), 0x0F, 0xB6, 0x83 | ((reg & 7) << 3));
+        emit32(jit, OFFSET_V(i));
+    }
+}
+
+// sub r15, executed
+static void emit_consume(JIT *jit, unsigned int executed)
+{
+    EMIT(jit, 0x49, 0x81, 0xEF);
+    emit32(jit, executed);
+}
+
+// Leave the block for a known address. The jump at the start can later be
+// patched to go straight to the target's block instead of the exit stub.
+static void emit_exit_to(JIT *jit, unsigned int target)
+{
+    unsigned char *site = jit->code + jit->used + 1;
+
+    EMIT(jit, 0xE9);                                        // jmp rel32 (to the next instruction for now)
+    emit32(jit, 0);
+    EMIT(jit, 0xB8);                                        // mov eax, target
+    emit32(jit, target);
+    EMIT(jit, 0x48, 0xBA);                                  // mov rdx, site
+    emit64(jit, (uintptr_t)site);
+    emit_jump(jit, jit->exit_spill);
+}
+
+// Leave the block for the address in AX
+static void emit_exit_dynamic(JIT *jit)
+{
+    EMIT(jit, 0x31, 0xD2);                                  // xor edx, edx
+    emit_jump(jit, jit->exit_spill);
+}
+
+// Leave the block after a helper call, with the CHP already up to date
+static void emit_exit_nospill(JIT *jit)
+{
+    EMIT(jit, 0x31, 0xD2);                                  // xor edx, edx
+    emit_jump(jit, jit->exit_nospill);
+}
+
+static void emit_stubs(JIT *jit)
+{
+    unsigned char *enter = jit->code + jit->used;
+
+    // enter(chip8, block, budget): save callee-saved registers, keeping
+    // the stack 16 byte aligned for helper calls, then jump into the block
+    EMIT(jit, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    EMIT(jit, 0x48, 0x83, 0xEC, 0x08);                      // sub rsp, 8
+    EMIT(jit, 0x48, 0x89, 0xFB);                            // mov rbx, rdi
+    EMIT(jit, 0x49, 0x89, 0xD7);                            // mov r15, rdx
+    EMIT(jit, 0x48, 0x89, 0xF0);                            // mov rax, rsi
+    emit_reload(jit);
+    EMIT(jit, 0xFF, 0xE0);                                  // jmp rax
+
+    memcpy(&jit->enter, &enter, sizeof(jit->enter));
+
+    // Exit with the new PC in AX
+    jit->exit_spill = jit->code + jit->used;
+    emit_spill(jit);
+    EMIT(jit, 0x66, 0x89, 0x83);                            // mov [rbx + PC], ax
+    emit32(jit, OFFSET_PC);
+
+    // Exit with the CHP already up to date
+    jit->exit_nospill = jit->code + jit->used;
+    EMIT(jit, 0x48, 0xB9);                                  // mov rcx, &jit->exit_site
+    emit64(jit, (uintptr_t)&jit->exit_site);
+    EMIT(jit, 0x48, 0x89, 0x11);                            // mov [rcx], rdx
+    EMIT(jit, 0x48, 0xB9);                                  // mov rcx, &jit->budget
+    emit64(jit, (uintptr_t)&jit->budget);
+    EMIT(jit, 0x4C, 0x89, 0x39);                            // mov [rcx], r15
+    EMIT(jit, 0x48, 0x83, 0xC4, 0x08);                      // add rsp, 8
+    EMIT(jit, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3);
+
+    jit->blocks_start = jit->used;
+}
+
+// --- Interpreter fallback ---
+
+// Flag the code cache for flushing if an instruction wrote to memory that
+// has been translated
+static void note_write(JIT *jit, const CHP *chip8, const INSTRUCTION *ins)
+{
+    unsigned int start = chip8->I;
+    unsigned int length;
+
+    if (ins->op == OP_FX33)
+    {
+        length = 3;
+    } else if (ins->op == OP_FX55)
+    {
+        length = ins->x + 1;
+    } else if (ins->op == OP_FX55_I)
+    {
+        // I has already been moved past the registers written
+        length = ins->x + 1;
+        start -= length;
+    } else
+    {
+        return;
+    }
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+        if (jit->translated[(start + i) & (MEMORY_SIZE - 1)])
+        {
+            jit->flush_pending = 1;
+        }
+    }
+}
+
+// Called from translated code for instructions it does not implement
+// natively. Returns non-zero when the block must be left afterwards.
+static int jit_helper(CHP *chip8, uint64_t packed, JIT *jit)
+{
+    INSTRUCTION ins;
+    unsigned short next = chip8->PC;
+
+    memcpy(&ins, &packed, sizeof(ins));
+
+    execute(chip8, &ins);
+    note_write(jit, chip8, &ins);
+
+    return jit->flush_pending || chip8->PC != next;
+}
+
+static void interpret_one(JIT *jit, CHP *chip8)
+{
+    INSTRUCTION ins;
+
+    decode_instruction(fetch(chip8), &ins);
+    apply_quirks(chip8->quirks, &ins);
+
+    update(chip8);
+    note_write(jit, chip8, &ins);
+}
+
+// --- Translation ---
+
+// Conditional skip: branch over the "taken" exit when the condition fails.
+// jcc is the second byte of the 0F 8x rel32 form.
+static void emit_skip(JIT *jit, unsigned char jcc, unsigned int next)
+{
+    EMIT(jit, 0x0F, jcc);
+    emit32(jit, 0);
+
+    unsigned char *not_taken = jit->code + jit->used - 4;
+
+    emit_exit_to(jit, next + 2);
+    patch_rel32(not_taken, jit->code + jit->used);
+    emit_exit_to(jit, next);
+}
+
+// Emits one instruction. next is the address of the following instruction
+// and executed the number of instructions in the block so far, including
+// this one. Returns zero when the instruction ends the block.
+static int emit_instruction(JIT *jit, const INSTRUCTION *ins, unsigned int next, unsigned int executed)
+{
+    switch (ins->op)
+    {
+        case OP_NOP:
+            return 1;
+        case OP_6XNN:
+            emit_store_v_imm(jit, ins->x, ins->nn);
+            return 1;
+        case OP_7XNN:
+            emit_load_v(jit, RAX, ins->x);
+            EMIT(jit, 0x05);                                // add eax, nn
+            emit32(jit, ins->nn);
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_8XY0:
+            emit_load_v(jit, RAX, ins->y);
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, ins->op == OP_8XY1 ? 0x09 : ins->op == OP_8XY2 ? 0x21 : 0x31, 0xC8);  // or/and/xor eax, ecx
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        // The flag is written before the result and the operands are
+        // reloaded afterwards, matching the interpreter when X or Y is F.
+        // The subtractions clear VF before comparing, as the interpreter does.
+        case OP_8XY4:
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, 0x01, 0xC8);                          // add eax, ecx
+            EMIT(jit, 0xC1, 0xE8, 0x08);                    // shr eax, 8
+            emit_store_v(jit, 0xF, RAX);
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, 0x01, 0xC8);                          // add eax, ecx
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_8XY5:
+            emit_store_v_imm(jit, 0xF, 0);
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, 0x39, 0xC8);                          // cmp eax, ecx
+            EMIT(jit, 0x0F, 0x97, 0xC0);                    // seta al
+            emit_store_v(jit, 0xF, RAX);
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, 0x29, 0xC8);                          // sub eax, ecx
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_8XY6:
+            emit_load_v(jit, RAX, ins->y);
+            EMIT(jit, 0x83, 0xE0, 0x01);                    // and eax, 1
+            emit_store_v(jit, 0xF, RAX);
+            emit_load_v(jit, RAX, ins->y);
+            EMIT(jit, 0xD1, 0xE8);                          // shr eax, 1
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_8XY7:
+            emit_store_v_imm(jit, 0xF, 0);
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, 0x39, 0xC8);                          // cmp eax, ecx
+            EMIT(jit, 0x0F, 0x92, 0xC0);                    // setb al
+            emit_store_v(jit, 0xF, RAX);
+            emit_load_v(jit, RAX, ins->y);
+            emit_load_v(jit, RCX, ins->x);
+            EMIT(jit, 0x29, 0xC8);                          // sub eax, ecx
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_8XYE:
+            emit_load_v(jit, RAX, ins->y);
+            EMIT(jit, 0xC1, 0xE8, 0x07);                    // shr eax, 7
+            emit_store_v(jit, 0xF, RAX);
+            emit_load_v(jit, RAX, ins->y);
+            EMIT(jit, 0x01, 0xC0);                          // add eax, eax
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_ANNN:
+            EMIT(jit, 0x66, 0xC7, 0x83);                    // mov word [rbx + I], nnn
+            emit32(jit, OFFSET_I);
+            emit16(jit, ins->nnn);
+            return 1;
+        case OP_FX07:
+            EMIT(jit, 0x0F, 0xB6, 0x83);                    // movzx eax, byte [rbx + DT]
+            emit32(jit, OFFSET_DT);
+            emit_store_v(jit, ins->x, RAX);
+            return 1;
+        case OP_FX15:
+        case OP_FX18:
+            emit_load_v(jit, RAX, ins->x);
+            EMIT(jit, 0x88, 0x83);                          // mov [rbx + DT/ST], al
+            emit32(jit, ins->op == OP_FX15 ? OFFSET_DT : OFFSET_ST);
+            return 1;
+        case OP_FX1E:
+            emit_load_v(jit, RAX, ins->x);
+            EMIT(jit, 0x66, 0x01, 0x83);                    // add [rbx + I], ax
+            emit32(jit, OFFSET_I);
+            return 1;
+        case OP_FX29:
+            emit_load_v(jit, RAX, ins->x);
+            EMIT(jit, 0x8D, 0x04, 0x80);                    // lea eax, [rax + rax * 4]
+            EMIT(jit, 0x66, 0x89, 0x83);                    // mov [rbx + I], ax
+            emit32(jit, OFFSET_I);
+            return 1;
+        case OP_FX65:
+            for (unsigned int i = 0; i <= ins->x; i++)
+            {
+                EMIT(jit, 0x0F, 0xB7, 0x83);                // movzx eax, word [rbx + I]
+                emit32(jit, OFFSET_I);
+                EMIT(jit, 0x05);                            // add eax, i
+                emit32(jit, i);
+                EMIT(jit, 0x25);                            // and eax, MEMORY_SIZE - 1
+                emit32(jit, MEMORY_SIZE - 1);
+                EMIT(jit, 0x0F, 0xB6, 0x84, 0x03);          // movzx eax, byte [rbx + rax + memory]
+                emit32(jit, OFFSET_MEMORY);
+                emit_store_v(jit, i, RAX);
+            }
+            return 1;
+        case OP_1NNN:
+            emit_consume(jit, executed);
+            emit_exit_to(jit, ins->nnn);
+            return 0;
+        case OP_2NNN:
+            EMIT(jit, 0x0F, 0xB7, 0x83);                    // movzx eax, word [rbx + SP]
+            emit32(jit, OFFSET_SP);
+            EMIT(jit, 0x83, 0xE0, STACK_SIZE - 1);          // and eax, STACK_SIZE - 1
+            EMIT(jit, 0x66, 0xC7, 0x84, 0x43);              // mov word [rbx + rax * 2 + stack], next
+            emit32(jit, OFFSET_STACK);
+            emit16(jit, next);
+            EMIT(jit, 0x66, 0xFF, 0x83);                    // inc word [rbx + SP]
+            emit32(jit, OFFSET_SP);
+            emit_consume(jit, executed);
+            emit_exit_to(jit, ins->nnn);
+            return 0;
+        case OP_00EE:
+            EMIT(jit, 0x66, 0xFF, 0x8B);                    // dec word [rbx + SP]
+            emit32(jit, OFFSET_SP);
+            EMIT(jit, 0x0F, 0xB7, 0x83);                    // movzx eax, word [rbx + SP]
+            emit32(jit, OFFSET_SP);
+            EMIT(jit, 0x83, 0xE0, STACK_SIZE - 1);          // and eax, STACK_SIZE - 1
+            EMIT(jit, 0x0F, 0xB7, 0x84, 0x43);              // movzx eax, word [rbx + rax * 2 + stack]
+            emit32(jit, OFFSET_STACK);
+            emit_consume(jit, executed);
+            emit_exit_dynamic(jit);
+            return 0;
+        case OP_BNNN:
+            emit_load_v(jit, RAX, 0);
+            EMIT(jit, 0x05);                                // add eax, nnn
+            emit32(jit, ins->nnn);
+            emit_consume(jit, executed);
+            emit_exit_dynamic(jit);
+            return 0;
+        case OP_3XNN:
+        case OP_4XNN:
+            emit_consume(jit, executed);
+            emit_load_v(jit, RAX, ins->x);
+            EMIT(jit, 0x3D);                                // cmp eax, nn
+            emit32(jit, ins->nn);
+            emit_skip(jit, ins->op == OP_3XNN ? 0x85 : 0x84, next);
+            return 0;
+        case OP_5XY0:
+        case OP_9XY0:
+            emit_consume(jit, executed);
+            emit_load_v(jit, RAX, ins->x);
+            emit_load_v(jit, RCX, ins->y);
+            EMIT(jit, 0x39, 0xC8);                          // cmp eax, ecx
+            emit_skip(jit, ins->op == OP_5XY0 ? 0x85 : 0x84, next);
+            return 0;
+        default:
+            break;
+    }
+
+    // Everything else runs through the interpreter's handler
+    uint64_t packed = 0;
+
+    memcpy(&packed, ins, sizeof(*ins));
+
+    emit_spill(jit);
+    EMIT(jit, 0x66, 0xC7, 0x83);                            // mov word [rbx + PC], next
+    emit32(jit, OFFSET_PC);
+    emit16(jit, next);
+    EMIT(jit, 0x48, 0x89, 0xDF);                            // mov rdi, rbx
+    EMIT(jit, 0x48, 0xBE);                                  // mov rsi, packed
+    emit64(jit, packed);
+    EMIT(jit, 0x48, 0xBA);                                  // mov rdx, jit
+    emit64(jit, (uintptr_t)jit);
+    EMIT(jit, 0x48, 0xB8);                                  // mov rax, jit_helper
+    emit64(jit, (uintptr_t)jit_helper);
+    EMIT(jit, 0xFF, 0xD0);                                  // call rax
+
+    // Key instructions may skip or wait, so they always end the block
+    if (ins->op == OP_EX9E || ins->op == OP_EXA1 || ins->op == OP_FX0A)
+    {
+        emit_consume(jit, executed);
+        emit_exit_nospill(jit);
+        return 0;
+    }
+
+    EMIT(jit, 0x85, 0xC0);                                  // test eax, eax
+    EMIT(jit, 0x74, 0x00);                                  // jz continue
+
+    unsigned char *skip = jit->code + jit->used - 1;
+
+    emit_consume(jit, executed);
+    emit_exit_nospill(jit);
+    *skip = (unsigned char)(jit->code + jit->used - (skip + 1));
+
+    emit_reload(jit);
+
+    return 1;
+}
+
+static unsigned char *translate(JIT *jit, const CHP *chip8, unsigned int start)
+{
+    unsigned char *block = jit->code + jit->used;
+    unsigned int pc = start;
+    unsigned int length = 0;
+    int open = 1;
+
+    // Leave straight away if the budget cannot cover the whole block. The
+    // length is filled in once the block is complete.
+    EMIT(jit, 0x49, 0x81, 0xFF);                            // cmp r15, length
+    emit32(jit, 0);
+
+    unsigned char *length_site = jit->code + jit->used - 4;
+
+    EMIT(jit, 0x7D, 0x0C);                                  // jge body
+    EMIT(jit, 0xB8);                                        // mov eax, start
+    emit32(jit, start);
+    emit_exit_dynamic(jit);
+
+    while (open)
+    {
+        unsigned int address = pc & (MEMORY_SIZE - 1);
+        unsigned short opcode = (chip8->memory[address] << 8) | chip8->memory[(address + 1) & (MEMORY_SIZE - 1)];
+        INSTRUCTION ins;
+
+        decode_instruction(opcode, &ins);
+        apply_quirks(chip8->quirks, &ins);
+
+        jit->translated[address] = 1;
+        jit->translated[(address + 1) & (MEMORY_SIZE - 1)] = 1;
+
+        length += 1;
+        pc += 2;
+
+        open = emit_instruction(jit, &ins, pc, length);
+
+        if (open && (length >= jit->max_block_length || pc >= MEMORY_SIZE - 1))
+        {
+            emit_consume(jit, length);
+            emit_exit_to(jit, pc);
+            open = 0;
+        }
+    }
+
+    uint32_t length32 = length;
+
+    memcpy(length_site, &length32, sizeof(length32));
+
+    jit->blocks[start] = block;
+    jit->block_length[start] = length;
+    jit->blocks_translated += 1;
+
+    return block;
+}
+
+// --- Public interface ---
+
+JIT *jit_create(unsigned int max_block_length)
+{
+    JIT *jit = calloc(1, sizeof(JIT));
+
+    if (jit == NULL)
+    {
+        return NULL;
+    }
+
+    jit->code = mmap(NULL, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jit->code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    if (max_block_length == 0 || max_block_length > JIT_MAX_BLOCK_LENGTH)
+    {
+        max_block_length = JIT_MAX_BLOCK_LENGTH;
+    }
+
+    jit->max_block_length = max_block_length;
+
+    emit_stubs(jit);
+
+    return jit;
+}
+
+
+void jit_destroy(JIT *jit)
+{
+    if (jit != NULL)
+    {
+        munmap(jit->code, JIT_CODE_CACHE_SIZE);
+        free(jit);
+    }
+}
+
+
+void jit_flush(JIT *jit)
+{
+    jit->used = jit->blocks_start;
+
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->block_length, 0, sizeof(jit->block_length));
+    memset(jit->translated, 0, sizeof(jit->translated));
+    memset(jit->idle, 0, sizeof(jit->idle));
+
+    jit->flush_pending = 0;
+    jit->flushes += 1;
+}
+
+
+void jit_run(JIT *jit, CHP *chip8, unsigned int count)
+{
+    int64_t budget = count;
+    unsigned char *link_site = NULL;
+
+    if (chip8->quirks != jit->quirks)
+    {
+        jit_flush(jit);
+        jit->quirks = chip8->quirks;
+    }
+
+    while (budget > 0)
+    {
+        if (jit->flush_pending || jit->used + JIT_BLOCK_RESERVE > JIT_CODE_CACHE_SIZE)
+        {
+            jit_flush(jit);
+            link_site = NULL;
+        }
+
+        // BNNN can jump past the end of memory. Blocks only know addresses
+        // inside it, so let the interpreter run until PC wraps back.
+        if (chip8->PC >= MEMORY_SIZE - 1)
+        {
+            interpret_one(jit, chip8);
+            budget -= 1;
+            link_site = NULL;
+            continue;
+        }
+
+        unsigned int address = chip8->PC;
+        unsigned int skipped = skip_idle_loop(chip8, budget);
+
+        // Spinning in an idle loop, which the interpreter fast-forwards
+        if (skipped > 0)
+        {
+            jit->idle[address] = 1;
+            budget -= skipped;
+            link_site = NULL;
+            continue;
+        }
+
+        unsigned char *block = jit->blocks[address];
+
+        if (block == NULL)
+        {
+            block = translate(jit, chip8, address);
+        }
+
+        // Not enough budget left for the whole block, so finish off one
+        // instruction at a time
+        if (budget < jit->block_length[address])
+        {
+            while (budget-- > 0)
+            {
+                interpret_one(jit, chip8);
+            }
+
+            return;
+        }
+
+        // Chain the block we just left straight to this one
+        if (link_site != NULL && !jit->idle[address])
+        {
+            patch_rel32(link_site, block);
+        }
+
+        jit->enter(chip8, block, budget);
+
+        budget = jit->budget;
+        link_site = jit->exit_site;
+    }
+}
+
+
+uint64_t jit_blocks_translated(const JIT *jit)
+{
+    return jit->blocks_translated;
+}
+
+
+uint64_t jit_flushes(const JIT *jit)
+{
+    return jit->flushes;
+}
+
+#else
+
+JIT *jit_create(unsigned int max_block_length)
+{
+    return NULL;
+}
+
+
+void jit_destroy(JIT *jit)
+{
+}
+
+
+void jit_flush(JIT *jit)
+{
+}
+
+
+void jit_run(JIT *jit, CHP *chip8, unsigned int count)
+{
+    run_instructions(chip8, count);
+}
+
+
+uint64_t jit_blocks_translated(const JIT *jit)
+{
+    return 0;
+}
+
+
+uint64_t jit_flushes(const JIT *jit)
+{
+    return 0;
+}
+
+#endif
+
+
+void jit_run_frame(JIT *jit, CHP *chip8, unsigned int instructions)
+{
+    jit_run(jit, chip8, instructions);
+
+    // The timers tick once per 60 Hz frame regardless of the instruction rate
+    tick_timers(chip8);
+}
@@ -0,0 +1,35 @@
+#ifndef JIT_HEADER
+#define JIT_HEADER
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Longest run of instructions translated into a single native block
+#define JIT_MAX_BLOCK_LENGTH 64
+
+// Size of the executable code cache, flushed and refilled when it runs out
+#define JIT_CODE_CACHE_SIZE (1024 * 1024)
+
+typedef struct JIT JIT;
+
+// Returns NULL when the host is not x86-64 or executable memory is not
+// available, in which case callers should keep using the interpreter
+JIT *jit_create(unsigned int max_block_length);
+
+void jit_destroy(JIT *jit);
+
+// Throws away every translated block. Call this after writing to the
+// machine's memory from outside the emulated program, e.g. loading a ROM.
+void jit_flush(JIT *jit);
+
+// Executes exactly count instructions, the same as run_instructions()
+void jit_run(JIT *jit, CHP *chip8, unsigned int count);
+
+void jit_run_frame(JIT *jit, CHP *chip8, unsigned int instructions);
+
+uint64_t jit_blocks_translated(const JIT *jit);
+
+uint64_t jit_flushes(const JIT *jit);
+
+#endif
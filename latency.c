@@ -0,0 +1,113 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+#define HISTOGRAM_BUCKETS 10
+#define HISTOGRAM_WIDTH 50
+
+void latency_reset(LATENCY *latency)
+{
+    latency->presses = 0;
+    latency->resolved = 0;
+    latency->lost = 0;
+    latency->sample_count = 0;
+}
+
+void latency_key_pressed(LATENCY *latency, uint64_t time_ns)
+{
+    if (latency->presses - latency->resolved == LATENCY_PENDING)
+    {
+        latency->resolved++;
+        latency->lost++;
+    }
+
+    latency->pressed_ns[latency->presses++ % LATENCY_PENDING] = time_ns;
+}
+
+void latency_frame_presented(LATENCY *latency, uint64_t presses, uint64_t time_ns)
+{
+    while (latency->resolved < presses && latency->resolved < latency->presses)
+    {
+        uint64_t pressed = latency->pressed_ns[latency->resolved++ % LATENCY_PENDING];
+
+        if (latency->sample_count == LATENCY_MAX_SAMPLES)
+        {
+            latency->lost++;
+            continue;
+        }
+
+        latency->samples[latency->sample_count++] = time_ns > pressed ? time_ns - pressed : 0;
+    }
+}
+
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+uint64_t latency_percentile(LATENCY *latency, unsigned int percent)
+{
+    if (latency->sample_count == 0)
+    {
+        return 0;
+    }
+
+    qsort(latency->samples, latency->sample_count, sizeof(uint64_t), compare_samples);
+
+    // Nearest rank, so the 100th is the largest sample
+    unsigned int rank = (latency->sample_count * percent + 99) / 100;
+
+    return latency->samples[rank ? rank - 1 : 0];
+}
+
+void print_latency(LATENCY *latency)
+{
+    unsigned int counts[HISTOGRAM_BUCKETS] = { 0 };
+    unsigned int most = 0;
+    double total = 0;
+
+    if (latency->sample_count == 0)
+    {
+        printf("Latency: no key presses reached the screen\n");
+        return;
+    }
+
+    for (unsigned int i = 0; i < latency->sample_count; i++)
+    {
+        total += latency->samples[i];
+    }
+
+    printf("Latency: %u presses, %llu lost, mean %.2f ms, min %.2f, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+            latency->sample_count, (unsigned long long)latency->lost, total / latency->sample_count / 1e6,
+            latency_percentile(latency, 0) / 1e6, latency_percentile(latency, 50) / 1e6,
+            latency_percentile(latency, 90) / 1e6, latency_percentile(latency, 99) / 1e6,
+            latency_percentile(latency, 100) / 1e6);
+
+    // Buckets as wide as a frame, with the last one taking the rest
+    for (unsigned int i = 0; i < latency->sample_count; i++)
+    {
+        uint64_t bucket = latency->samples[i] / FRAME_NS;
+
+        counts[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        most = counts[i] > most ? counts[i] : most;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        int width = (int)((uint64_t)counts[i] * HISTOGRAM_WIDTH / most);
+
+        printf("  %5.1f ms%s %6u %.*s\n", i * 1000.0 / TIMER_RATE, i == HISTOGRAM_BUCKETS - 1 ? "+" : " ", counts[i],
+                width, "##################################################");
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef LATENCY_HEADER
+#define LATENCY_HEADER
+
+#include <stdint.h>
+
+// Key presses in flight at once, older ones are given up on
+#define LATENCY_PENDING 64
+
+#define LATENCY_MAX_SAMPLES 65536
+
+// Time from each key press to the first frame on screen that the machine
+// drew after seeing it. Presses are numbered in the order they are sent, and
+// every frame carries how many presses the machine had seen when it drew it,
+// so a frame the display skipped never loses a measurement.
+typedef struct
+{
+    // When each unresolved press happened, by number
+    uint64_t pressed_ns[LATENCY_PENDING];
+    uint64_t presses;
+    uint64_t resolved;
+
+    // Presses dropped because too many were in flight or samples were full
+    uint64_t lost;
+
+    uint64_t samples[LATENCY_MAX_SAMPLES];
+    unsigned int sample_count;
+} LATENCY;
+
+void latency_reset(LATENCY *latency);
+
+void latency_key_pressed(LATENCY *latency, uint64_t time_ns);
+
+// Records a frame reaching the screen, drawn once presses had been seen
+void latency_frame_presented(LATENCY *latency, uint64_t presses, uint64_t time_ns);
+
+// Gives the nth hundredth of the samples, sorting them first
+uint64_t latency_percentile(LATENCY *latency, unsigned int percent);
+
+// Prints the number of samples, their percentiles and a histogram in
+// milliseconds to standard output
+void print_latency(LATENCY *latency);
+
+#endif
@@ -0,0 +1,621 @@
+#include "lockstep.h"
+
+#include <limits.h>
+#include <string.h>
+
+// --- Moving single instances in and out of the group ---
+
+static void load_lane(LOCKSTEP *group, unsigned int lane)
+{
+    CHP *chip8 = &group->lanes[lane];
+
+    for (int i = 0; i < V_SIZE; i++)
+    {
+        chip8->V[i] = group->V[i][lane];
+    }
+
+    chip8->PC = group->PC[lane];
+    chip8->SP = group->SP[lane];
+    chip8->I = group->I[lane];
+    chip8->DT = group->DT[lane];
+    chip8->ST = group->ST[lane];
+}
+
+static void store_lane(LOCKSTEP *group, unsigned int lane)
+{
+    const CHP *chip8 = &group->lanes[lane];
+
+    for (int i = 0; i < V_SIZE; i++)
+    {
+        group->V[i][lane] = chip8->V[i];
+    }
+
+    group->PC[lane] = chip8->PC;
+    group->SP[lane] = chip8->SP;
+    group->I[lane] = chip8->I;
+    group->DT[lane] = chip8->DT;
+    group->ST[lane] = chip8->ST;
+}
+
+// Runs an instruction for one instance through the interpreter's handlers.
+// PC has already been advanced past it.
+static void execute_lane(LOCKSTEP *group, unsigned int lane, const INSTRUCTION *ins)
+{
+    CHP *chip8 = &group->lanes[lane];
+    unsigned int start = group->I[lane];
+    unsigned int length = 0;
+
+    // The most common of these only need a few registers moved across
+    switch (ins->op)
+    {
+        case OP_00EE:
+            chip8->PC = group->PC[lane];
+            chip8->SP = group->SP[lane];
+            execute(chip8, ins);
+            group->PC[lane] = chip8->PC;
+            group->SP[lane] = chip8->SP;
+            return;
+        case OP_DXYN:
+            chip8->V[ins->x] = group->V[ins->x][lane];
+            chip8->V[ins->y] = group->V[ins->y][lane];
+            chip8->I = group->I[lane];
+            execute(chip8, ins);
+            group->V[0xF][lane] = chip8->V[0xF];
+            return;
+        default:
+            break;
+    }
+
+    load_lane(group, lane);
+    execute(chip8, ins);
+    store_lane(group, lane);
+
+    if (ins->op == OP_FX33)
+    {
+        length = 3;
+    } else if (ins->op == OP_FX55 || ins->op == OP_FX55_I)
+    {
+        length = ins->x + 1;
+    }
+
+    // Other instances may not write the same values, or at all
+    for (unsigned int i = 0; i < length; i++)
+    {
+        group->written[(start + i) & (MEMORY_SIZE - 1)] = 1;
+    }
+}
+
+// Whether an instruction can send instances in the group different ways
+static int may_branch(unsigned char op)
+{
+    switch (op)
+    {
+        case OP_00EE:
+        case OP_3XNN:
+        case OP_4XNN:
+        case OP_5XY0:
+        case OP_9XY0:
+        case OP_BNNN:
+        case OP_BXNN:
+        case OP_EX9E:
+        case OP_EXA1:
+        case OP_FX0A:
+            return 1;
+    }
+
+    return 0;
+}
+
+// Runs an instruction for each of the given lanes one at a time. Returns
+// zero when they are no longer all at the same address.
+static int execute_each(LOCKSTEP *group, const INSTRUCTION *ins, const unsigned char *lanes)
+{
+    unsigned int target = UINT_MAX;
+    int together = 1;
+
+    for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        if (lanes[lane])
+        {
+            execute_lane(group, lane, ins);
+
+            if (may_branch(ins->op))
+            {
+                together &= target == UINT_MAX || target == group->PC[lane];
+                target = group->PC[lane];
+            }
+        }
+    }
+
+    return together;
+}
+
+// --- Executing an instruction for every instance at once ---
+
+#if defined(__GNUC__)
+
+// The byte registers are loaded a column at a time into GNU C vectors as
+// wide as the host's vector registers: 16 lanes with SSE2, or 32 when built
+// with -mavx2. The compiler splits anything wider into single bytes, so the
+// group is worked through one chunk of that many lanes at a time.
+#if defined(__AVX2__)
+#define CHUNK_LANES 32
+#else
+#define CHUNK_LANES 16
+#endif
+
+typedef unsigned char LANE_BYTES __attribute__((vector_size(CHUNK_LANES)));
+
+// SSE2 has neither unsigned byte comparisons nor byte shifts. Flipping the
+// top bit turns an unsigned comparison into a signed one, and shifts are
+// done on pairs of bytes with the bits that would cross over cleared first.
+typedef signed char LANE_SIGNED __attribute__((vector_size(CHUNK_LANES)));
+typedef unsigned short LANE_PAIRS __attribute__((vector_size(CHUNK_LANES)));
+
+#define BELOW(a, b) ((LANE_BYTES)((LANE_SIGNED)((a) ^ 0x80) < (LANE_SIGNED)((b) ^ 0x80)))
+#define HALVE(value) ((LANE_BYTES)((LANE_PAIRS)((value) & 0xFE) >> 1))
+
+// Stores only write the lanes in mask
+#define LOAD(value, column) memcpy(&(value), (column) + base, sizeof(value))
+
+#define STORE_BYTES(column, value)                                  \
+    do                                                              \
+    {                                                               \
+        LANE_BYTES merged;                                          \
+        LOAD(merged, column);                                       \
+        merged = (merged & ~mask) | ((value) & mask);               \
+        memcpy((column) + base, &merged, sizeof(merged));           \
+    } while (0)
+
+#define WENT_ON 1
+#define WENT_PAST 2
+
+// Executes an instruction that only works on byte registers for the lanes
+// from base onwards. Returns which ways the lanes went for skips, and zero
+// for everything else.
+static int execute_chunk(LOCKSTEP *group, const INSTRUCTION *ins, const unsigned char *lanes, unsigned int base)
+{
+    const LANE_BYTES zero = { 0 };
+
+    LANE_BYTES mask;
+    LANE_BYTES vx;
+    LANE_BYTES vy;
+    LANE_BYTES taken;
+
+    LOAD(mask, lanes);
+    LOAD(vx, group->V[ins->x]);
+    LOAD(vy, group->V[ins->y]);
+
+    // Comparisons give all bits set where true, so flags are masked down to
+    // 0 or 1. The flag is written before the result and the operands are
+    // reloaded afterwards, matching the interpreter when X or Y is F.
+    switch (ins->op)
+    {
+        case OP_3XNN:
+            taken = (LANE_BYTES)(vx == ins->nn);
+            break;
+        case OP_4XNN:
+            taken = (LANE_BYTES)(vx != ins->nn);
+            break;
+        case OP_5XY0:
+            taken = (LANE_BYTES)(vx == vy);
+            break;
+        case OP_9XY0:
+            taken = (LANE_BYTES)(vx != vy);
+            break;
+        case OP_6XNN:
+            STORE_BYTES(group->V[ins->x], zero + ins->nn);
+            return 0;
+        case OP_7XNN:
+            STORE_BYTES(group->V[ins->x], vx + ins->nn);
+            return 0;
+        case OP_8XY0:
+            STORE_BYTES(group->V[ins->x], vy);
+            return 0;
+        case OP_8XY1:
+            STORE_BYTES(group->V[ins->x], vx | vy);
+            return 0;
+        case OP_8XY2:
+            STORE_BYTES(group->V[ins->x], vx & vy);
+            return 0;
+        case OP_8XY3:
+            STORE_BYTES(group->V[ins->x], vx ^ vy);
+            return 0;
+        case OP_8XY4:
+            STORE_BYTES(group->V[0xF], BELOW(vx + vy, vx) & 1);
+            LOAD(vx, group->V[ins->x]);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[ins->x], vx + vy);
+            return 0;
+        case OP_8XY5:
+            STORE_BYTES(group->V[0xF], zero);
+            LOAD(vx, group->V[ins->x]);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[0xF], BELOW(vy, vx) & 1);
+            LOAD(vx, group->V[ins->x]);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[ins->x], vx - vy);
+            return 0;
+        case OP_8XY6:
+            STORE_BYTES(group->V[0xF], vy & 1);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[ins->x], HALVE(vy));
+            return 0;
+        case OP_8XY7:
+            STORE_BYTES(group->V[0xF], zero);
+            LOAD(vx, group->V[ins->x]);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[0xF], BELOW(vx, vy) & 1);
+            LOAD(vx, group->V[ins->x]);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[ins->x], vy - vx);
+            return 0;
+        case OP_8XYE:
+            STORE_BYTES(group->V[0xF], (LANE_BYTES)((LANE_SIGNED)vy < 0) & 1);
+            LOAD(vy, group->V[ins->y]);
+            STORE_BYTES(group->V[ins->x], vy + vy);
+            return 0;
+        case OP_FX07:
+            LOAD(vy, group->DT);
+            STORE_BYTES(group->V[ins->x], vy);
+            return 0;
+        case OP_FX15:
+            STORE_BYTES(group->DT, vx);
+            return 0;
+        case OP_FX18:
+            STORE_BYTES(group->ST, vx);
+            return 0;
+        default:
+            return 0;
+    }
+
+    // Only skips get this far
+    unsigned char skipped[CHUNK_LANES];
+
+    taken &= mask;
+    memcpy(skipped, &taken, sizeof(skipped));
+
+    for (unsigned int lane = 0; lane < CHUNK_LANES; lane++)
+    {
+        group->PC[base + lane] += skipped[lane] & 2;
+    }
+
+    int ways = 0;
+
+    if (memcmp(skipped, lanes + base, sizeof(skipped)) != 0)
+    {
+        ways |= WENT_ON;
+    }
+
+    if (memcmp(skipped, &zero, sizeof(skipped)) != 0)
+    {
+        ways |= WENT_PAST;
+    }
+
+    return ways;
+}
+
+#undef STORE_BYTES
+#undef LOAD
+#undef HALVE
+#undef BELOW
+
+#endif
+
+// The 16 bit registers are updated with plain loops over the whole group,
+// which the compiler vectorises without needing to widen the byte columns
+#define STORE_WORDS(column, value)                                  \
+    for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)      \
+    {                                                               \
+        (column)[lane] = lanes[lane] ? (value) : (column)[lane];    \
+    }
+
+// Executes an instruction for every lane with all bits set in lanes, all
+// of which are at the same address. Returns zero when they might not be
+// any more.
+static int execute_together(LOCKSTEP *group, const INSTRUCTION *ins, const unsigned char *lanes)
+{
+    switch (ins->op)
+    {
+        case OP_NOP:
+            return 1;
+        case OP_1NNN:
+            STORE_WORDS(group->PC, ins->nnn);
+            return 1;
+        case OP_ANNN:
+            STORE_WORDS(group->I, ins->nnn);
+            return 1;
+        case OP_BNNN:
+            STORE_WORDS(group->PC, group->V[0][lane] + ins->nnn);
+            return 0;
+        case OP_FX1E:
+            STORE_WORDS(group->I, group->I[lane] + group->V[ins->x][lane]);
+            return 1;
+        case OP_FX29:
+            STORE_WORDS(group->I, group->V[ins->x][lane] * 5);
+            return 1;
+        case OP_2NNN:
+            // Each instance has its own stack
+            for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+            {
+                if (lanes[lane])
+                {
+                    group->lanes[lane].stack[group->SP[lane] & (STACK_SIZE - 1)] = group->PC[lane];
+                    group->SP[lane] += 1;
+                    group->PC[lane] = ins->nnn;
+                }
+            }
+
+            return 1;
+#if defined(__GNUC__)
+        case OP_3XNN:
+        case OP_4XNN:
+        case OP_5XY0:
+        case OP_9XY0:
+        case OP_6XNN:
+        case OP_7XNN:
+        case OP_8XY0:
+        case OP_8XY1:
+        case OP_8XY2:
+        case OP_8XY3:
+        case OP_8XY4:
+        case OP_8XY5:
+        case OP_8XY6:
+        case OP_8XY7:
+        case OP_8XYE:
+        case OP_FX07:
+        case OP_FX15:
+        case OP_FX18:
+        {
+            int ways = 0;
+
+            for (unsigned int base = 0; base < LOCKSTEP_LANES; base += CHUNK_LANES)
+            {
+                ways |= execute_chunk(group, ins, lanes, base);
+            }
+
+            // Together unless a skip went both ways
+            return ways != (WENT_ON | WENT_PAST);
+        }
+#endif
+        default:
+            break;
+    }
+
+    // Everything else runs through the interpreter one instance at a time
+    return execute_each(group, ins, lanes);
+}
+
+#undef STORE_WORDS
+#undef WENT_PAST
+#undef WENT_ON
+
+
+// --- Scheduling ---
+
+#define STEP_DIVERGED 0
+#define STEP_TOGETHER 1
+#define STEP_IDLE 2
+
+// Executes one instruction for the given lanes, which are all at the same
+// address. Returns STEP_DIVERGED when they might not be any more, and
+// STEP_IDLE when they are stuck jumping to that address.
+static int step_together(LOCKSTEP *group, const unsigned char *lanes, unsigned int first)
+{
+    unsigned int address = group->PC[first] & (MEMORY_SIZE - 1);
+    unsigned int next = (address + 1) & (MEMORY_SIZE - 1);
+
+    for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        group->PC[lane] += lanes[lane] & 2;
+    }
+
+    // Code that has been written to may differ between instances, so each
+    // one decodes its own
+    if (group->written[address] || group->written[next])
+    {
+        for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            if (lanes[lane])
+            {
+                const unsigned char *memory = group->lanes[lane].memory;
+                INSTRUCTION ins;
+
+                decode_instruction((memory[address] << 8) | memory[next], &ins);
+                apply_quirks(group->lanes[lane].quirks, &ins);
+                execute_lane(group, lane, &ins);
+            }
+        }
+
+        return STEP_DIVERGED;
+    }
+
+    INSTRUCTION *ins = &group->decoded[address];
+
+    if (ins->op == OP_DECODE)
+    {
+        const unsigned char *memory = group->lanes[first].memory;
+
+        decode_instruction((memory[address] << 8) | memory[next], ins);
+        apply_quirks(group->lanes[first].quirks, ins);
+    }
+
+    if (!execute_together(group, ins, lanes))
+    {
+        return STEP_DIVERGED;
+    }
+
+    return ins->op == OP_1NNN && ins->nnn == address ? STEP_IDLE : STEP_TOGETHER;
+}
+
+void lockstep_run(LOCKSTEP *group, unsigned int count)
+{
+    unsigned int remaining[LOCKSTEP_LANES];
+    unsigned char lanes[LOCKSTEP_LANES];
+
+    for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        remaining[lane] = lane < group->count ? count : 0;
+    }
+
+    for (;;)
+    {
+        // Run the instances at the lowest address first. Instances that
+        // went different ways usually meet again there, at a loop's start
+        // or where the two sides of a skip join up.
+        unsigned int target = UINT_MAX;
+
+        for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            if (remaining[lane] > 0 && group->PC[lane] < target)
+            {
+                target = group->PC[lane];
+            }
+        }
+
+        if (target == UINT_MAX)
+        {
+            return;
+        }
+
+        unsigned int first = LOCKSTEP_LANES;
+        unsigned int together = 0;
+        unsigned int budget = UINT_MAX;
+
+        for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            lanes[lane] = remaining[lane] > 0 && group->PC[lane] == target ? 0xFF : 0;
+
+            if (lanes[lane])
+            {
+                first = lane < first ? lane : first;
+                together += 1;
+                budget = remaining[lane] < budget ? remaining[lane] : budget;
+            }
+        }
+
+        // Keep going while every instance here takes the same path
+        unsigned int executed = 0;
+
+        unsigned int idle = 0;
+
+        while (executed < budget)
+        {
+            executed += 1;
+
+            int state = step_together(group, lanes, first);
+
+            // A jump to itself never leads anywhere else, so the rest of the
+            // budget is used up without running it
+            if (state == STEP_IDLE)
+            {
+                idle = budget - executed;
+                executed = budget;
+            }
+
+            if (state != STEP_TOGETHER)
+            {
+                break;
+            }
+        }
+
+        for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            if (lanes[lane])
+            {
+                remaining[lane] -= executed;
+                group->lanes[lane].idle_instructions += idle;
+            }
+        }
+
+        group->dispatches += executed;
+        group->instructions += (uint64_t)executed * together;
+    }
+}
+
+
+// --- Public interface ---
+
+void initialise_lockstep(LOCKSTEP *group, const CHP *chip8, unsigned int count)
+{
+    group->count = count < LOCKSTEP_LANES ? count : LOCKSTEP_LANES;
+
+    for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        memcpy(&group->lanes[lane], chip8, sizeof(CHP));
+        store_lane(group, lane);
+    }
+
+    memset(group->written, 0, sizeof(group->written));
+
+    for (int i = 0; i < MEMORY_SIZE; i++)
+    {
+        group->decoded[i].op = OP_DECODE;
+    }
+
+    group->dispatches = 0;
+    group->instructions = 0;
+}
+
+
+void lockstep_set_lane(LOCKSTEP *group, unsigned int lane, const CHP *chip8)
+{
+    // Wherever this instance's memory differs from another's, code has to
+    // be decoded per instance
+    for (unsigned int other = 0; other < group->count; other++)
+    {
+        if (other == lane)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < MEMORY_SIZE; i++)
+        {
+            if (group->lanes[other].memory[i] != chip8->memory[i])
+            {
+                group->written[i] = 1;
+            }
+        }
+    }
+
+    memcpy(&group->lanes[lane], chip8, sizeof(CHP));
+    store_lane(group, lane);
+}
+
+
+void lockstep_get_lane(const LOCKSTEP *group, unsigned int lane, CHP *chip8)
+{
+    memcpy(chip8, &group->lanes[lane], sizeof(CHP));
+
+    for (int i = 0; i < V_SIZE; i++)
+    {
+        chip8->V[i] = group->V[i][lane];
+    }
+
+    chip8->PC = group->PC[lane];
+    chip8->SP = group->SP[lane];
+    chip8->I = group->I[lane];
+    chip8->DT = group->DT[lane];
+    chip8->ST = group->ST[lane];
+}
+
+
+void lockstep_tick_timers(LOCKSTEP *group)
+{
+    for (unsigned int lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        group->lanes[lane].sound_flag = group->ST[lane] > 0;
+
+        group->DT[lane] -= group->DT[lane] > 0;
+        group->ST[lane] -= group->ST[lane] > 0;
+    }
+}
+
+
+void lockstep_run_frame(LOCKSTEP *group, unsigned int instructions)
+{
+    lockstep_run(group, instructions);
+
+    // The timers tick once per 60 Hz frame regardless of the instruction rate
+    lockstep_tick_timers(group);
+}
@@ -0,0 +1,61 @@
+#ifndef LOCKSTEP_HEADER
+#define LOCKSTEP_HEADER
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Number of instances run together in one group
+#define LOCKSTEP_LANES 32
+
+typedef struct
+{
+    // Registers stored one column per instance, so that an instruction can
+    // be applied to every instance in the group at once
+    unsigned char V[V_SIZE][LOCKSTEP_LANES];
+    unsigned short PC[LOCKSTEP_LANES];
+    unsigned short SP[LOCKSTEP_LANES];
+    unsigned short I[LOCKSTEP_LANES];
+    unsigned char DT[LOCKSTEP_LANES];
+    unsigned char ST[LOCKSTEP_LANES];
+
+    // The rest of each instance: memory, stack, framebuffer and keypad. The
+    // registers in here are only up to date while an instruction is being
+    // executed for that instance alone. Frontends write the keypads directly.
+    CHP lanes[LOCKSTEP_LANES];
+
+    // Number of lanes in use, starting from the first
+    unsigned int count;
+
+    // Bytes that may differ between instances, because one of them wrote
+    // there or was given different memory. Code there runs one at a time.
+    unsigned char written[MEMORY_SIZE];
+
+    // Instructions decoded once for the whole group
+    INSTRUCTION decoded[MEMORY_SIZE];
+
+    // Instructions dispatched for the group, and instructions executed
+    // summed over every instance. Their ratio is how many instances were
+    // running together on average.
+    uint64_t dispatches;
+    uint64_t instructions;
+} LOCKSTEP;
+
+// Starts count instances as copies of chip8. Every instance in a group
+// runs with chip8's quirks.
+void initialise_lockstep(LOCKSTEP *group, const CHP *chip8, unsigned int count);
+
+// chip8 must have the same quirks as the rest of the group
+void lockstep_set_lane(LOCKSTEP *group, unsigned int lane, const CHP *chip8);
+
+void lockstep_get_lane(const LOCKSTEP *group, unsigned int lane, CHP *chip8);
+
+// Every instance executes exactly count instructions, leaving each one in
+// the same state as run_instructions() would
+void lockstep_run(LOCKSTEP *group, unsigned int count);
+
+void lockstep_tick_timers(LOCKSTEP *group);
+
+void lockstep_run_frame(LOCKSTEP *group, unsigned int instructions);
+
+#endif
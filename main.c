@@ -1,29 +1,720 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include <SDL2/SDL.h>
 
+#include "audio.h"
+#include "batch.h"
+#include "bench.h"
 #include "chip8.h"
+#include "exchange.h"
+#include "jit.h"
+#include "latency.h"
+#include "lockstep.h"
+#include "movie.h"
+#include "pack.h"
+#include "profile.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "snapshot.h"
 
-#define SCREEN_WIDTH 64 * 8
-#define SCREEN_HEIGHT 32 * 8
+#define PIXEL_SCALE 8
+#define PIXEL_ON 0xFFFFFFFF
+#define PIXEL_OFF 0xFF000000
+#define SCREEN_WIDTH DISPLAY_WIDTH * PIXEL_SCALE
+#define SCREEN_HEIGHT DISPLAY_HEIGHT * PIXEL_SCALE
 #define REFRESH_RATE 700
+#define INSTRUCTIONS_PER_FRAME (REFRESH_RATE / TIMER_RATE)
+
+// How long before a frame goes on screen input is read for it, leaving time
+// to run the machine and upload the display
+#define DEFAULT_FRAME_LEAD_MS 4
+
+typedef struct
+{
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+
+    // Native resolution copy of the display, scaled up by SDL when presented
+    SDL_Texture *texture;
+} SDLapp;
+
+// Everything the emulation thread uses, set up by main() before starting it
+// and only read again once it has been joined
+typedef struct
+{
+    JIT *jit;
+    REWIND *history;
+    PROFILE *profile;
+
+    MOVIE movie;
+    const char *record_path;
+    const char *play_path;
+    int movie_active;
+    uint64_t frame;
+
+    unsigned int instructions_per_frame;
+
+    const char *profile_path;
+    int profile_format;
+    char quick_state_path[1024];
+    char disassembly_path[1024];
+    char folded_path[1024];
+
+    // Finished frames one way and window events the other
+    FRAME_EXCHANGE frames;
+    INPUT_QUEUE input;
+
+    // The buzzer, played through the audio device's callback. Zero when
+    // there is no sound, otherwise the most samples ever kept queued.
+    AUDIO_RING audio;
+    AUDIO_TONE tone;
+    unsigned int audio_latency;
+
+    // Whether frames are run as the device plays them rather than by the clock
+    int audio_sync;
+
+    // When the main thread last read input, which the machine's schedule
+    // locks on to when align is set so that every frame runs just after it
+    atomic_ullong poll_ns;
+    int align;
+    uint64_t frame_lead_ns;
+
+    // Keypad presses received, stamped on each published frame
+    uint64_t presses;
+
+    atomic_int quit;
+} EMULATION;
+
+static CHP chip8;
+static SDLapp app;
+static EMULATION emulation;
+
+// Written only by the main thread, when --latency is given
+static LATENCY latency;
+static int measure_latency;
+
+static int keymap[KEYPAD_SIZE] = 
+{
+    SDL_SCANCODE_0,
+    SDL_SCANCODE_1,
+    SDL_SCANCODE_2,
+    SDL_SCANCODE_3,
+    SDL_SCANCODE_4,
+    SDL_SCANCODE_5,
+    SDL_SCANCODE_6,
+    SDL_SCANCODE_7,
+    SDL_SCANCODE_8,
+    SDL_SCANCODE_9,
+    SDL_SCANCODE_A,
+    SDL_SCANCODE_B,
+    SDL_SCANCODE_C,
+    SDL_SCANCODE_D,
+    SDL_SCANCODE_E,
+    SDL_SCANCODE_F
+};
+
+// Works out when a key event happened on the monotonic clock, from SDL's
+// millisecond timestamp, so time spent queued before polling is counted
+static uint64_t event_time_ns(const SDL_Event *e)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t age = (uint64_t)(Uint32)(SDL_GetTicks() - e->key.timestamp) * 1000000;
+
+    return age < now ? now - age : now;
+}
+
+// Passes a window event the machine cares about on to the emulation thread
+static void send_event(const SDL_Event *e)
+{
+    INPUT_EVENT event = { 0, 0 };
+    int down = e->type == SDL_KEYDOWN;
+
+    if ((e->type != SDL_KEYDOWN && e->type != SDL_KEYUP) || e->key.repeat)
+    {
+        return;
+    }
+
+    switch (e->key.keysym.scancode)
+    {
+        case SDL_SCANCODE_F5:
+            event.type = INPUT_SAVE_STATE;
+            break;
+        case SDL_SCANCODE_F7:
+            event.type = INPUT_WRITE_PROFILE;
+            break;
+        case SDL_SCANCODE_F9:
+            event.type = INPUT_LOAD_STATE;
+            break;
+        case SDL_SCANCODE_BACKSPACE:
+            event.type = down ? INPUT_REWIND_START : INPUT_REWIND_STOP;
+            input_queue_push(&emulation.input, &event);
+            return;
+        default:
+            for (int i = 0; i < KEYPAD_SIZE; i++)
+            {
+                if (e->key.keysym.scancode == keymap[i])
+                {
+                    event.type = down ? INPUT_KEY_DOWN : INPUT_KEY_UP;
+                    event.key = i;
+
+                    if (input_queue_push(&emulation.input, &event) == 0 && down && measure_latency)
+                    {
+                        latency_key_pressed(&latency, event_time_ns(e));
+                    }
+                }
+            }
+            return;
+    }
+
+    if (down)
+    {
+        input_queue_push(&emulation.input, &event);
+    }
+}
+
+static void upload_framebuffer(const uint64_t *display)
+{
+    void *pixels;
+    int pitch;
+
+    if (SDL_LockTexture(app.texture, NULL, &pixels, &pitch) != 0)
+    {
+        return;
+    }
+
+    // Expand each row word into one ARGB value per pixel
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        Uint32 *line = (Uint32 *)((Uint8 *)pixels + y * pitch);
+        uint64_t row = display[y];
+
+        for (int x = 0; x < DISPLAY_WIDTH; x++)
+        {
+            line[x] = (row >> (63 - x)) & 1 ? PIXEL_ON : PIXEL_OFF;
+        }
+    }
+
+    SDL_UnlockTexture(app.texture);
+}
+
+static void present_framebuffer(void)
+{
+    SDL_RenderClear(app.renderer);
+    SDL_RenderCopy(app.renderer, app.texture, NULL, NULL);
+    SDL_RenderPresent(app.renderer);
+}
+
+// Runs on SDL's audio thread, so it only ever takes samples from the ring
+static void audio_callback(void *userdata, Uint8 *stream, int length)
+{
+    audio_ring_read(userdata, (int16_t *)stream, length / sizeof(int16_t));
+}
+
+// Queues the buzzer for the frame just run, dropping what would take the
+// queue past its latency when the device plays slower than the schedule
+static void queue_sound(int sounding)
+{
+    int16_t samples[AUDIO_MAX_FRAME_SAMPLES];
+    unsigned int count = audio_tone_frame(&emulation.tone, sounding, samples);
+    unsigned int fill = audio_ring_fill(&emulation.audio);
+
+    if (fill + count > emulation.audio_latency)
+    {
+        count = fill < emulation.audio_latency ? emulation.audio_latency - fill : 0;
+    }
+
+    audio_ring_write(&emulation.audio, samples, count);
+}
+
+// Sleeps until the device has played enough that the next frame's samples
+// fit in the queue, so the audio clock sets the speed of the machine
+static void wait_for_audio(void)
+{
+    unsigned int frame_samples = emulation.tone.sample_rate / TIMER_RATE + 1;
+
+    while (audio_ring_fill(&emulation.audio) + frame_samples > emulation.audio_latency &&
+            !atomic_load_explicit(&emulation.quit, memory_order_relaxed))
+    {
+        SDL_Delay(1);
+    }
+}
+
+static void write_profile_files(void)
+{
+    write_profile(emulation.profile_path, emulation.profile, emulation.profile_format);
+    write_annotated_disassembly(emulation.disassembly_path, emulation.profile);
+    write_folded_stacks(emulation.folded_path, emulation.profile);
+}
+
+// Applies the events sent since the last frame. Keys pressed and released
+// within one frame are held for that frame, so quick taps are never lost.
+static void receive_events(uint16_t *keys, int *rewinding)
+{
+    INPUT_EVENT event;
+    uint16_t tapped = 0;
+
+    while (input_queue_pop(&emulation.input, &event) == 0)
+    {
+        switch (event.type)
+        {
+            case INPUT_KEY_DOWN:
+                *keys |= 1 << event.key;
+                tapped |= 1 << event.key;
+                emulation.presses++;
+                break;
+            case INPUT_KEY_UP:
+                *keys &= ~(1 << event.key);
+                break;
+            case INPUT_SAVE_STATE:
+                save_state(emulation.quick_state_path, &chip8);
+                break;
+            case INPUT_LOAD_STATE:
+                if (!emulation.movie_active && load_state(emulation.quick_state_path, &chip8) == 0 && emulation.jit)
+                {
+                    jit_flush(emulation.jit);
+                }
+                break;
+            case INPUT_WRITE_PROFILE:
+                if (emulation.profile_path)
+                {
+                    write_profile_files();
+                }
+                break;
+            case INPUT_REWIND_START:
+                *rewinding = 1;
+                break;
+            case INPUT_REWIND_STOP:
+                *rewinding = 0;
+                break;
+        }
+    }
+
+    // Once a movie has played to the end the keyboard takes over
+    if (emulation.play_path && emulation.frame < emulation.movie.frames)
+    {
+        movie_apply_input(&emulation.movie, emulation.frame, &chip8);
+    } else
+    {
+        chip8.keypad = *keys | tapped;
+    }
+}
+
+// Runs the machine at 60 Hz until told to quit, publishing each frame that
+// changes the display. Presenting happens on the main thread, so a slow
+// present or a compositor stall never holds up the emulated timing.
+static void *emulation_main(void *unused)
+{
+    SCHEDULER scheduler;
+    uint16_t keys = 0;
+    int rewinding = 0;
+
+    (void)unused;
+
+    initialise_scheduler(&scheduler, emulation.instructions_per_frame);
+
+    while (!atomic_load_explicit(&emulation.quit, memory_order_relaxed))
+    {
+        receive_events(&keys, &rewinding);
+
+        if (emulation.record_path && movie_record_frame(&emulation.movie, &chip8) != 0)
+        {
+            printf("Out of memory for the movie, stopping the recording.\n");
+            save_movie(emulation.record_path, &emulation.movie);
+            movie_free(&emulation.movie);
+            emulation.record_path = NULL;
+        }
+
+        // Holding Backspace plays the history backwards, a frame at a time
+        if (emulation.history && rewinding)
+        {
+            if (rewind_step_back(emulation.history, &chip8) == 0 && emulation.jit)
+            {
+                jit_flush(emulation.jit);
+            }
+
+            chip8.sound_flag = 0;
+        } else
+        {
+            // Run a frame's worth of instructions and tick the timers once
+            if (emulation.profile_path)
+            {
+                profile_run_frame(emulation.profile, &chip8, scheduler.instructions_per_frame);
+            } else if (emulation.jit)
+            {
+                jit_run_frame(emulation.jit, &chip8, scheduler.instructions_per_frame);
+            } else
+            {
+                run_frame(&chip8, scheduler.instructions_per_frame);
+            }
+
+            if (emulation.history)
+            {
+                rewind_capture(emulation.history, &chip8);
+            }
+
+            emulation.frame++;
+        }
+
+        // Only publish the display when the core has changed it
+        if (chip8.draw_flag)
+        {
+            FRAME *frame = frame_exchange_back(&emulation.frames);
+
+            memcpy(frame->display, chip8.display, sizeof(frame->display));
+            frame->frame = emulation.frame;
+            frame->presses = emulation.presses;
+            frame_exchange_publish(&emulation.frames);
+
+            chip8.draw_flag = 0;
+        }
+
+        if (emulation.audio_latency)
+        {
+            queue_sound(chip8.sound_flag);
+        }
+
+        // Sleep until the next 60 Hz deadline, or until the device wants more
+        if (emulation.audio_sync)
+        {
+            wait_for_audio();
+        } else
+        {
+            uint64_t poll_ns = atomic_load_explicit(&emulation.poll_ns, memory_order_relaxed);
+
+            // Wake a quarter of the lead after the main thread reads input
+            if (emulation.align && poll_ns)
+            {
+                align_schedule(&scheduler, poll_ns + emulation.frame_lead_ns / 4);
+            }
+
+            wait_for_next_frame(&scheduler);
+        }
+    }
+
+    return NULL;
+}
+
+static void print_usage(const char *program)
+{
+    printf("Usage: %s [options] <rom-path>\n", program);
+    printf("Options:\n");
+    printf("  --ipf <n>             Instructions executed per 60 Hz frame (default %d)\n", INSTRUCTIONS_PER_FRAME);
+    printf("  --quirks <list>       Comma separated quirks: shift, load-store, jump, clip, vf-reset,\n");
+    printf("                        or the presets vip, schip or none (default none)\n");
+    printf("  --jit                 Translate the ROM to native code (x86-64 only)\n");
+    printf("  --bench               Run headless and uncapped, then report throughput\n");
+    printf("  --frames <n>          Frames per benchmark run (default %d)\n", BENCH_DEFAULT_FRAMES);
+    printf("  --instructions <n>    Instructions per benchmark run instead of frames\n");
+    printf("  --repeat <n>          Number of benchmark runs (default %d)\n", BENCH_DEFAULT_REPEATS);
+    printf("  --lockstep            Benchmark %d copies of the ROM run together\n", LOCKSTEP_LANES);
+    printf("  --seed <n>            Seed for CXNN's random numbers (default the time, or 0 for batches)\n");
+    printf("  --load-state <path>   Start from a save state instead of the ROM's first instruction\n");
+    printf("  --rewind-memory <MiB> Memory kept for rewinding with Backspace, 0 to turn it off (default %d)\n", REWIND_DEFAULT_BUDGET >> 20);
+    printf("  --keyframes <n>       Frames between full snapshots in the rewind history (default %d)\n", REWIND_DEFAULT_KEYFRAME_INTERVAL);
+    printf("  --record <path>       Record the keypad and random seed to a movie\n");
+    printf("  --play <path>         Play a movie back, the ROM path can be left out\n");
+    printf("  --seek <frame>        Start playing the movie from this frame\n");
+    printf("  --verify              Play the movie headless and check it against its keyframes\n");
+    printf("  --batch <path>        Run a directory or list of ROMs headless instead of <rom-path>\n");
+    printf("  --threads <n>         Batch worker threads (default one per core)\n");
+    printf("  --pin                 Pin each batch worker to its own core\n");
+    printf("  --format <csv|json>   Format of batch results (default csv)\n");
+    printf("  --output <path>       Write batch results to a file instead of standard output\n");
+    printf("  --build-pack <pack> <path> Pack a directory or list of ROMs into one file for --batch\n");
+    printf("  --profile <path>      Count what the ROM executes, written on exit or with F7,\n");
+    printf("                        plus <path>.asm and flame graph stacks in <path>.folded\n");
+    printf("  --profile-format <text|json> Format of the profile (default text)\n");
+    printf("  --audio-buffer <n>    Samples per audio callback, 0 for no sound (default %d)\n", AUDIO_DEFAULT_BUFFER_SAMPLES);
+    printf("  --audio-sync          Run the machine at the speed the sound plays instead of by the clock\n");
+    printf("  --frame-lead <ms>     Read input this long before each frame is shown (default %d)\n", DEFAULT_FRAME_LEAD_MS);
+    printf("  --latency             Report the time from key presses to the screen on exit\n");
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc == 1)
+    const char *rom_path = NULL;
+    const char *state_path = NULL;
+    size_t rewind_budget = REWIND_DEFAULT_BUDGET;
+    unsigned int keyframe_interval = REWIND_DEFAULT_KEYFRAME_INTERVAL;
+    REWIND *history = NULL;
+
+    const char *record_path = NULL;
+    const char *play_path = NULL;
+    uint64_t seek_frame = 0;
+    int verify = 0;
+    MOVIE movie = { 0 };
+    unsigned int instructions_per_frame = INSTRUCTIONS_PER_FRAME;
+    uint64_t seed = time(NULL);
+    unsigned int quirks = 0;
+
+    int use_jit = 0;
+    JIT *jit = NULL;
+
+    int bench = 0;
+    BENCH_CONFIG bench_config = { 0, BENCH_DEFAULT_FRAMES, 0, BENCH_DEFAULT_REPEATS, 0, 0 };
+
+    const char *profile_path = NULL;
+    int profile_format = PROFILE_TEXT;
+    static PROFILE profile;
+
+    const char *pack_path = NULL;
+    const char *pack_roms_path = NULL;
+
+    unsigned int audio_buffer = AUDIO_DEFAULT_BUFFER_SAMPLES;
+    int audio_sync = 0;
+
+    unsigned int frame_lead_ms = DEFAULT_FRAME_LEAD_MS;
+    SDL_AudioDeviceID audio_device = 0;
+
+    BATCH_CONFIG batch_config = { NULL, NULL, BATCH_CSV, 0, 0, 0, 0, BATCH_DEFAULT_FRAMES };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+        {
+            instructions_per_frame = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+        {
+            if (parse_quirks(argv[++i], &quirks) != 0)
+            {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--jit") == 0)
+        {
+            use_jit = 1;
+        } else if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = 1;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            bench_config.frames = strtoull(argv[++i], NULL, 10);
+            bench_config.instructions = 0;
+            batch_config.frames = bench_config.frames;
+        } else if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc)
+        {
+            bench_config.instructions = strtoull(argv[++i], NULL, 10);
+            bench_config.frames = 0;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            bench_config.repeats = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--lockstep") == 0)
+        {
+            bench_config.lockstep = 1;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], NULL, 10);
+            batch_config.seed = seed;
+        } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+        {
+            state_path = argv[++i];
+        } else if (strcmp(argv[i], "--rewind-memory") == 0 && i + 1 < argc)
+        {
+            rewind_budget = (size_t)strtoul(argv[++i], NULL, 10) << 20;
+        } else if (strcmp(argv[i], "--keyframes") == 0 && i + 1 < argc)
+        {
+            keyframe_interval = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+        {
+            play_path = argv[++i];
+        } else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc)
+        {
+            seek_frame = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--verify") == 0)
+        {
+            verify = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+        {
+            batch_config.jobs_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            batch_config.threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--pin") == 0)
+        {
+            batch_config.pin = 1;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "csv") == 0)
+        {
+            batch_config.format = BATCH_CSV;
+            i++;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0)
+        {
+            batch_config.format = BATCH_JSON;
+            i++;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+        {
+            batch_config.output_path = argv[++i];
+        } else if (strcmp(argv[i], "--build-pack") == 0 && i + 2 < argc)
+        {
+            pack_path = argv[++i];
+            pack_roms_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile-format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "text") == 0)
+        {
+            profile_format = PROFILE_TEXT;
+            i++;
+        } else if (strcmp(argv[i], "--profile-format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0)
+        {
+            profile_format = PROFILE_JSON;
+            i++;
+        } else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc)
+        {
+            audio_buffer = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--audio-sync") == 0)
+        {
+            audio_sync = 1;
+        } else if (strcmp(argv[i], "--frame-lead") == 0 && i + 1 < argc)
+        {
+            frame_lead_ms = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--latency") == 0)
+        {
+            measure_latency = 1;
+        } else if (argv[i][0] != '-' && rom_path == NULL)
+        {
+            rom_path = argv[i];
+        } else
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (pack_path)
     {
-        printf("Usage: %s <rom-path>\n", argv[0]);
+        return build_pack(pack_path, pack_roms_path) == 0 ? 0 : -1;
+    }
+
+    if (batch_config.jobs_path && instructions_per_frame > 0)
+    {
+        batch_config.instructions_per_frame = instructions_per_frame;
+        batch_config.jit = use_jit;
+        batch_config.quirks = quirks;
+
+        return run_batch(&batch_config) == 0 ? 0 : -1;
+    }
+
+    if ((rom_path == NULL && play_path == NULL) || instructions_per_frame == 0 ||
+        (record_path && play_path) || (bench && rom_path == NULL))
+    {
+        print_usage(argv[0]);
         return -1;
     }
 
+    if (bench)
+    {
+        bench_config.instructions_per_frame = instructions_per_frame;
+        bench_config.jit = use_jit;
+        bench_config.quirks = quirks;
+
+        return run_benchmark(rom_path, &bench_config);
+    }
+
     initialise_chip8(&chip8);
-    load_rom(argv[1], &chip8);
+    seed_random(&chip8, seed);
+    set_quirks(&chip8, quirks);
+
+    if (play_path)
+    {
+        // The movie holds the ROM, the speed and the random state it was recorded with
+        if (load_movie(play_path, &movie) != 0)
+        {
+            return -1;
+        }
 
-    // Seed random values
-    srand(time(NULL));
+        instructions_per_frame = movie.instructions_per_frame;
+
+        if (verify)
+        {
+            uint64_t desync_frame;
+            int result = movie_verify(&movie, &chip8, &desync_frame);
+
+            if (result == 0)
+            {
+                printf("%llu frames match all %llu keyframes, display hash %016llx\n",
+                        (unsigned long long)movie.frames, (unsigned long long)movie.keyframe_count,
+                        (unsigned long long)display_hash(&chip8));
+            } else
+            {
+                printf("Desynced from the movie at frame %llu\n", (unsigned long long)desync_frame);
+            }
+
+            movie_free(&movie);
+            return result;
+        }
+
+        if (movie_seek(&movie, seek_frame, &chip8) != 0)
+        {
+            printf("The movie is only %llu frames long.\n", (unsigned long long)movie.frames);
+            movie_free(&movie);
+            return -1;
+        }
+    } else
+    {
+        if (load_rom(rom_path, &chip8) != 0)
+        {
+            return -1;
+        }
+
+        if (state_path && load_state(state_path, &chip8) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (record_path)
+    {
+        movie_start(&movie, seed, instructions_per_frame, MOVIE_DEFAULT_KEYFRAME_INTERVAL);
+    }
+
+    // Jumping around in time would break a movie being recorded or played
+    int movie_active = record_path || play_path;
+
+    // F5 saves the machine next to the ROM and F9 goes back to it
+    snprintf(emulation.quick_state_path, sizeof(emulation.quick_state_path), "%s.state",
+            rom_path ? rom_path : play_path);
+
+    if (profile_path)
+    {
+        snprintf(emulation.disassembly_path, sizeof(emulation.disassembly_path), "%s.asm", profile_path);
+        snprintf(emulation.folded_path, sizeof(emulation.folded_path), "%s.folded", profile_path);
+        profile_reset(&profile);
+
+        // Profiling swaps in its own interpreter loop, counting every instruction
+        if (use_jit)
+        {
+            printf("Profiling runs the interpreter, ignoring --jit.\n");
+            use_jit = 0;
+        }
+    }
+
+    if (use_jit)
+    {
+        jit = jit_create(JIT_MAX_BLOCK_LENGTH);
+
+        if (!jit)
+        {
+            printf("JIT unavailable on this host, using the interpreter instead.\n");
+        }
+    }
+
+    if (rewind_budget > 0 && !movie_active)
+    {
+        history = rewind_create(rewind_budget, keyframe_interval);
+
+        if (!history)
+        {
+            printf("Not enough memory for rewinding, carrying on without it.\n");
+        }
+    }
 
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0)
     {
@@ -46,7 +737,13 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    app.renderer = SDL_CreateRenderer(app.window, -1, SDL_RENDERER_SOFTWARE);
+    // Present on the display's refresh where we can, otherwise sleep to our own schedule
+    app.renderer = SDL_CreateRenderer(app.window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+
+    if (!app.renderer)
+    {
+        app.renderer = SDL_CreateRenderer(app.window, -1, SDL_RENDERER_SOFTWARE);
+    }
 
     if (!app.renderer)
     {
@@ -54,33 +751,218 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    // Set initial render draw color
+    SDL_RendererInfo renderer_info;
+    SDL_DisplayMode display_mode;
+    int vsync = SDL_GetRendererInfo(app.renderer, &renderer_info) == 0 &&
+        (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC);
+    uint64_t present_period = FRAME_NS;
+
+    if (vsync && SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(app.window), &display_mode) == 0 &&
+        display_mode.refresh_rate > 0)
+    {
+        present_period = 1000000000ULL / display_mode.refresh_rate;
+    }
+
+    uint64_t frame_lead = (uint64_t)frame_lead_ms * 1000000;
+
+    if (frame_lead > present_period / 2)
+    {
+        frame_lead = present_period / 2;
+    }
+
+    app.texture = SDL_CreateTexture(
+            app.renderer,
+            SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING,
+            DISPLAY_WIDTH,
+            DISPLAY_HEIGHT
+    );
+
+    if (!app.texture)
+    {
+        printf("There has been an error creating the display texture.\n%s\n", SDL_GetError());
+        return -1;
+    }
+
     SDL_SetRenderDrawColor(app.renderer, 0, 0, 0, 255);
 
+    // The emulation thread takes over the machine and everything around it
+    emulation.jit = jit;
+    emulation.history = history;
+    emulation.profile = &profile;
+    emulation.movie = movie;
+    emulation.record_path = record_path;
+    emulation.play_path = play_path;
+    emulation.movie_active = movie_active;
+    emulation.frame = seek_frame;
+    emulation.instructions_per_frame = instructions_per_frame;
+    emulation.profile_path = profile_path;
+    emulation.profile_format = profile_format;
+    emulation.frame_lead_ns = frame_lead;
+
+    // The machine can only follow the display when it refreshes at the timers' rate
+    emulation.align = frame_lead > 0 && present_period > FRAME_NS * 59 / 60 && present_period < FRAME_NS * 61 / 60;
+
+    frame_exchange_init(&emulation.frames);
+    input_queue_init(&emulation.input);
+    audio_ring_init(&emulation.audio);
+    atomic_init(&emulation.poll_ns, 0);
+    atomic_init(&emulation.quit, 0);
+
+    if (audio_buffer > 0)
+    {
+        SDL_AudioSpec wanted, obtained;
+
+        memset(&wanted, 0, sizeof(wanted));
+        wanted.freq = AUDIO_DEFAULT_SAMPLE_RATE;
+        wanted.format = AUDIO_S16SYS;
+        wanted.channels = 1;
+        wanted.samples = audio_buffer;
+        wanted.callback = audio_callback;
+        wanted.userdata = &emulation.audio;
+
+        // SDL converts to the device's own format behind the callback
+        audio_device = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, 0);
+
+        if (audio_device == 0)
+        {
+            printf("There has been an error opening the audio device, carrying on without sound.\n%s\n",
+                    SDL_GetError());
+        } else
+        {
+            audio_tone_init(&emulation.tone, obtained.freq, AUDIO_TONE_FREQUENCY, AUDIO_TONE_VOLUME);
+
+            // Two callbacks' worth plus a frame keeps the device fed without adding delay
+            emulation.audio_latency = obtained.samples * 2 + obtained.freq / TIMER_RATE + 1;
+
+            if (emulation.audio_latency > AUDIO_RING_SIZE)
+            {
+                emulation.audio_latency = AUDIO_RING_SIZE;
+            }
+
+            emulation.audio_sync = audio_sync;
+            SDL_PauseAudioDevice(audio_device, 0);
+        }
+    }
+
+    pthread_t emulation_thread;
+
+    if (pthread_create(&emulation_thread, NULL, emulation_main, NULL) != 0)
+    {
+        printf("There has been an error starting the emulation thread.\n");
+        return -1;
+    }
+
     SDL_Event e;
+    SCHEDULER present_scheduler;
+
+    initialise_scheduler(&present_scheduler, instructions_per_frame);
+    latency_reset(&latency);
+
+    uint64_t presented_ns = monotonic_ns();
 
     int quit = 0;
     while (!quit)
     {
+        // Read input as late as possible, a lead before the next frame is shown
+        if (!vsync)
+        {
+            wait_for_next_frame(&present_scheduler);
+        } else if (frame_lead > 0)
+        {
+            precise_sleep_until(presented_ns + present_period - frame_lead);
+        }
+
         while (SDL_PollEvent(&e) != 0)
         {
             if (e.type == SDL_QUIT)
             {
                 quit = 1;
+            } else
+            {
+                send_event(&e);
             }
         }
-            
-        update(&chip8);
 
-        SDL_RenderPresent(app.renderer);
+        uint64_t poll_ns = monotonic_ns();
+
+        atomic_store_explicit(&emulation.poll_ns, poll_ns, memory_order_relaxed);
+
+        // Leave the machine time to run the frame that input is for
+        precise_sleep_until(poll_ns + frame_lead / 2);
+
+        // Only upload the display when the machine has published a new one
+        const FRAME *latest = frame_exchange_latest(&emulation.frames);
+
+        if (latest)
+        {
+            upload_framebuffer(latest->display);
+        }
+
+        // Blocks until the display refreshes when presenting with vsync
+        present_framebuffer();
+        presented_ns = monotonic_ns();
+
+        if (latest && measure_latency)
+        {
+            latency_frame_presented(&latency, latest->presses, presented_ns);
+        }
+    }
+
+    atomic_store(&emulation.quit, 1);
+    pthread_join(emulation_thread, NULL);
+
+    if (audio_device)
+    {
+        SDL_CloseAudioDevice(audio_device);
 
-        // Enforce FPS
-        SDL_Delay(1000/REFRESH_RATE);
+        printf("Audio: %llu samples of silence played while waiting for the machine\n",
+                (unsigned long long)atomic_load(&emulation.audio.underruns));
     }
 
+    if (emulation.jit)
+    {
+        jit_destroy(emulation.jit);
+    }
+
+    if (profile_path)
+    {
+        write_profile_files();
+    }
+
+    // The recording is dropped by the emulation thread when it runs out of memory
+    if (emulation.record_path)
+    {
+        save_movie(emulation.record_path, &emulation.movie);
+    }
+
+    if (movie_active)
+    {
+        movie_free(&emulation.movie);
+    }
+
+    if (measure_latency)
+    {
+        print_latency(&latency);
+    }
+
+    if (history)
+    {
+        REWIND_STATS stats;
+        rewind_get_stats(history, &stats);
+
+        printf("Rewind: %llu frames (%.1f s) in %.2f of %.2f MiB, %llu keyframes, %.2f us per capture\n",
+                (unsigned long long)stats.frames, (double)stats.frames / TIMER_RATE,
+                stats.bytes / 1048576.0, stats.budget / 1048576.0, (unsigned long long)stats.keyframes,
+                stats.captures ? stats.capture_ns / 1e3 / stats.captures : 0.0);
+
+        rewind_destroy(history);
+    }
+
+    SDL_DestroyTexture(app.texture);
+    SDL_DestroyRenderer(app.renderer);
     SDL_DestroyWindow(app.window);
     SDL_Quit();
 
     return 0;
 }
-
@@ -0,0 +1,608 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "scheduler.h"
+
+#define DEFAULT_INSTRUCTIONS 2000000
+#define DEFAULT_WARMUP 2
+#define DEFAULT_REPEATS 10
+#define MAX_REPEATS 1000
+#define MAX_ROMS 64
+
+// The same rate main runs ROMs at
+#define INSTRUCTIONS_PER_FRAME (700 / TIMER_RATE)
+
+// Each opcode benchmark repeats its body from the start of the program space
+// up to CODE_END, where a jump takes it back round. I points at DATA and
+// calls go to a return at SUBROUTINE, both far enough past CODE_END that
+// writing to them never throws away decoded code.
+#define CODE_START 0x200
+#define CODE_END 0xE00
+#define DATA 0xE80
+#define SUBROUTINE 0xF00
+
+#define BODY_MAX_LENGTH 2
+
+enum
+{
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+};
+
+typedef struct
+{
+    const char *name;
+
+    // Opcodes repeated to fill the code area
+    unsigned short body[BODY_MAX_LENGTH];
+    unsigned int body_length;
+
+    // Registers the body reads, on top of the defaults every case starts with
+    void (*setup)(CHP *chip8);
+} CASE;
+
+typedef struct
+{
+    char name[1024];
+
+    double min;
+    double median;
+    double mean;
+    double stddev;
+    double max;
+
+    // Median of the same benchmark in the baseline, zero when it has none
+    double baseline;
+} SUMMARY;
+
+typedef struct
+{
+    uint64_t instructions;
+    unsigned int warmup;
+    unsigned int repeats;
+    unsigned int instructions_per_frame;
+
+    // Only cases whose names start with this run
+    const char *filter;
+
+    int format;
+    const char *output_path;
+    const char *baseline_path;
+} CONFIG;
+
+
+// --- Cases ---
+
+static void setup_equal(CHP *chip8)
+{
+    chip8->V[1] = chip8->V[0];
+    chip8->V[2] = chip8->V[0];
+}
+
+static void setup_aligned(CHP *chip8)
+{
+    chip8->V[1] = 8;
+    chip8->V[2] = 4;
+}
+
+static void setup_unaligned(CHP *chip8)
+{
+    chip8->V[1] = 13;
+    chip8->V[2] = 4;
+}
+
+static void setup_wrap_x(CHP *chip8)
+{
+    chip8->V[1] = 60;
+    chip8->V[2] = 4;
+}
+
+static void setup_wrap_y(CHP *chip8)
+{
+    chip8->V[1] = 8;
+    chip8->V[2] = 28;
+}
+
+static void setup_clip(CHP *chip8)
+{
+    setup_wrap_x(chip8);
+    set_quirks(chip8, QUIRK_CLIP_SPRITES);
+}
+
+// Skips that are taken jump over a filler instruction that never runs, so
+// every instruction executed is the skip itself
+static const CASE cases[] =
+{
+    { "alu/8xy0", { 0x8120 }, 1 },
+    { "alu/8xy1", { 0x8121 }, 1 },
+    { "alu/8xy2", { 0x8122 }, 1 },
+    { "alu/8xy3", { 0x8123 }, 1 },
+    { "alu/8xy4", { 0x8124 }, 1 },
+    { "alu/8xy5", { 0x8125 }, 1 },
+    { "alu/8xy6", { 0x8126 }, 1 },
+    { "alu/8xy7", { 0x8127 }, 1 },
+    { "alu/8xye", { 0x812E }, 1 },
+    { "skip/3xnn-taken", { 0x3011, 0x0000 }, 2 },
+    { "skip/3xnn-not-taken", { 0x30FF }, 1 },
+    { "skip/4xnn-taken", { 0x40FF, 0x0000 }, 2 },
+    { "skip/4xnn-not-taken", { 0x4011 }, 1 },
+    { "skip/5xy0-taken", { 0x5120, 0x0000 }, 2, setup_equal },
+    { "skip/5xy0-not-taken", { 0x5120 }, 1 },
+    { "skip/9xy0-taken", { 0x9120, 0x0000 }, 2 },
+    { "skip/9xy0-not-taken", { 0x9120 }, 1, setup_equal },
+    { "call/2nnn-00ee", { 0x2000 | SUBROUTINE }, 1 },
+    { "draw/dxy1", { 0xD121 }, 1, setup_aligned },
+    { "draw/dxy8", { 0xD128 }, 1, setup_aligned },
+    { "draw/dxyf", { 0xD12F }, 1, setup_aligned },
+    { "draw/dxy8-unaligned", { 0xD128 }, 1, setup_unaligned },
+    { "draw/dxy8-wrap-x", { 0xD128 }, 1, setup_wrap_x },
+    { "draw/dxyf-wrap-y", { 0xD12F }, 1, setup_wrap_y },
+    { "draw/dxy8-clip", { 0xD128 }, 1, setup_clip },
+    { "memory/f055", { 0xF055 }, 1 },
+    { "memory/f755", { 0xF755 }, 1 },
+    { "memory/ff55", { 0xFF55 }, 1 },
+    { "memory/f065", { 0xF065 }, 1 },
+    { "memory/f765", { 0xF765 }, 1 },
+    { "memory/ff65", { 0xFF65 }, 1 },
+    { "bcd/fx33", { 0xF333 }, 1 }
+};
+
+static void write_opcode(CHP *chip8, unsigned int address, unsigned short opcode)
+{
+    chip8->memory[address] = opcode >> 8;
+    chip8->memory[address + 1] = opcode & 0xFF;
+}
+
+static void prepare_case(const CASE *test, CHP *chip8)
+{
+    unsigned int address = CODE_START;
+
+    initialise_chip8(chip8);
+
+    // Distinct register values, none of them zero
+    for (int i = 0; i < V_SIZE; i++)
+    {
+        chip8->V[i] = 0x11 * (i + 1);
+    }
+
+    chip8->I = DATA;
+
+    for (int i = 0; i < 16; i++)
+    {
+        chip8->memory[DATA + i] = 0xA5 ^ (i * 0x1F);
+    }
+
+    if (test->setup)
+    {
+        test->setup(chip8);
+    }
+
+    while (address + test->body_length * 2 <= CODE_END - 2)
+    {
+        for (unsigned int i = 0; i < test->body_length; i++)
+        {
+            write_opcode(chip8, address + i * 2, test->body[i]);
+        }
+
+        address += test->body_length * 2;
+    }
+
+    write_opcode(chip8, address, 0x1000 | CODE_START);
+    write_opcode(chip8, SUBROUTINE, 0x00EE);
+
+    invalidate_instructions(chip8, 0, MEMORY_SIZE);
+}
+
+
+// --- Measuring ---
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void summarise(double *values, unsigned int count, SUMMARY *summary)
+{
+    double sum = 0;
+    double squares = 0;
+
+    qsort(values, count, sizeof(double), compare_doubles);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        sum += values[i];
+    }
+
+    summary->mean = sum / count;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        squares += (values[i] - summary->mean) * (values[i] - summary->mean);
+    }
+
+    // Sample standard deviation, zero for a single run
+    summary->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+
+    summary->min = values[0];
+    summary->max = values[count - 1];
+    summary->median = values[count / 2];
+
+    if (count % 2 == 0)
+    {
+        summary->median = (values[count / 2 - 1] + values[count / 2]) / 2;
+    }
+}
+
+// Times the runs of a prepared machine, each starting from a fresh copy of
+// it, and summarises the nanoseconds each instruction took. frames is zero for the opcode
+// cases, which run their instructions without ticking the timers.
+static void measure(const CHP *prepared, const CONFIG *config, uint64_t frames, SUMMARY *summary)
+{
+    static CHP chip8;
+    double ns_per_instruction[MAX_REPEATS];
+
+    for (unsigned int i = 0; i < config->warmup + config->repeats; i++)
+    {
+        memcpy(&chip8, prepared, sizeof(chip8));
+
+        uint64_t start = monotonic_ns();
+
+        if (frames > 0)
+        {
+            for (uint64_t frame = 0; frame < frames; frame++)
+            {
+                run_frame(&chip8, config->instructions_per_frame);
+            }
+        } else
+        {
+            run_instructions(&chip8, config->instructions);
+        }
+
+        uint64_t elapsed = monotonic_ns() - start;
+
+        // Warmup runs only fill the caches
+        if (i >= config->warmup)
+        {
+            uint64_t instructions = frames > 0 ? frames * config->instructions_per_frame : config->instructions;
+
+            ns_per_instruction[i - config->warmup] = (double)elapsed / instructions;
+        }
+    }
+
+    summarise(ns_per_instruction, config->repeats, summary);
+}
+
+
+// --- Baselines ---
+
+// Reads a quoted CSV field, leaving line just past it
+static int read_csv_string(const char **line, char *text, size_t size)
+{
+    const char *p = *line;
+    size_t length = 0;
+
+    if (*p++ != '"')
+    {
+        return -1;
+    }
+
+    while (*p && !(*p == '"' && p[1] != '"'))
+    {
+        // Doubled quotes stand for one
+        if (*p == '"')
+        {
+            p++;
+        }
+
+        if (length + 1 < size)
+        {
+            text[length++] = *p;
+        }
+
+        p++;
+    }
+
+    text[length] = '\0';
+    *line = *p ? p + 1 : p;
+
+    return 0;
+}
+
+// Fills in each summary's baseline from the median of the benchmark with the
+// same name in a CSV report written by an earlier run
+static int read_baseline(const char *path, SUMMARY *summaries, unsigned int count)
+{
+    FILE *fptr = fopen(path, "r");
+    char line[2048];
+    char name[1024];
+
+    if (fptr == NULL)
+    {
+        fprintf(stderr, "Invalid baseline: '%s'\n", path);
+        return -1;
+    }
+
+    // Skip the header
+    if (!fgets(line, sizeof(line), fptr))
+    {
+        fclose(fptr);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fptr))
+    {
+        const char *p = line;
+        double min;
+        double median;
+
+        if (read_csv_string(&p, name, sizeof(name)) != 0 || sscanf(p, ",%lf,%lf", &min, &median) != 2)
+        {
+            continue;
+        }
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (strcmp(summaries[i].name, name) == 0)
+            {
+                summaries[i].baseline = median;
+            }
+        }
+    }
+
+    fclose(fptr);
+
+    return 0;
+}
+
+
+// --- Writing results ---
+
+static void write_csv_string(FILE *output, const char *text)
+{
+    fputc('"', output);
+
+    for (; *text; text++)
+    {
+        // Quotes are escaped by doubling them
+        if (*text == '"')
+        {
+            fputc('"', output);
+        }
+
+        fputc(*text, output);
+    }
+
+    fputc('"', output);
+}
+
+static void write_json_string(FILE *output, const char *text)
+{
+    fputc('"', output);
+
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+        {
+            fprintf(output, "\\%c", *text);
+        } else if ((unsigned char)*text < 0x20)
+        {
+            fprintf(output, "\\u%04x", *text);
+        } else
+        {
+            fputc(*text, output);
+        }
+    }
+
+    fputc('"', output);
+}
+
+static void write_results(const CONFIG *config, const SUMMARY *summaries, unsigned int count, FILE *output)
+{
+    if (config->format == FORMAT_JSON)
+    {
+        fprintf(output, "[\n");
+    } else if (config->format == FORMAT_CSV)
+    {
+        fprintf(output, "benchmark,min_ns,median_ns,mean_ns,stddev_ns,max_ns,repeats\n");
+    } else
+    {
+        fprintf(output, "%-32s %10s %10s %10s %10s %10s %10s\n", "ns per instruction", "min", "median",
+                "mean", "stddev", "max", "change");
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const SUMMARY *summary = &summaries[i];
+
+        if (config->format == FORMAT_JSON)
+        {
+            fprintf(output, "  { \"benchmark\": ");
+            write_json_string(output, summary->name);
+            fprintf(output, ", \"min_ns\": %.4f, \"median_ns\": %.4f, \"mean_ns\": %.4f, \"stddev_ns\": %.4f, "
+                    "\"max_ns\": %.4f, \"repeats\": %u }%s\n", summary->min, summary->median, summary->mean,
+                    summary->stddev, summary->max, config->repeats, i + 1 < count ? "," : "");
+        } else if (config->format == FORMAT_CSV)
+        {
+            write_csv_string(output, summary->name);
+            fprintf(output, ",%.4f,%.4f,%.4f,%.4f,%.4f,%u\n", summary->min, summary->median, summary->mean,
+                    summary->stddev, summary->max, config->repeats);
+        } else
+        {
+            fprintf(output, "%-32s %10.3f %10.3f %10.3f %10.3f %10.3f", summary->name, summary->min,
+                    summary->median, summary->mean, summary->stddev, summary->max);
+
+            // Change in the median since the baseline
+            if (summary->baseline > 0)
+            {
+                fprintf(output, " %+9.1f%%", 100.0 * (summary->median - summary->baseline) / summary->baseline);
+            }
+
+            fprintf(output, "\n");
+        }
+    }
+
+    if (config->format == FORMAT_JSON)
+    {
+        fprintf(output, "]\n");
+    }
+}
+
+
+static void print_usage(const char *program)
+{
+    printf("Usage: %s [options] [rom-path...]\n", program);
+    printf("Runs every opcode benchmark, then each ROM (roms/test-rom.ch8 when none are given).\n");
+    printf("Options:\n");
+    printf("  --instructions <n>     Instructions per run (default %d)\n", DEFAULT_INSTRUCTIONS);
+    printf("  --warmup <n>           Runs thrown away before measuring (default %d)\n", DEFAULT_WARMUP);
+    printf("  --repeat <n>           Measured runs (default %d)\n", DEFAULT_REPEATS);
+    printf("  --ipf <n>              Instructions per 60 Hz frame for ROMs (default %d)\n", INSTRUCTIONS_PER_FRAME);
+    printf("  --filter <prefix>      Only run benchmarks whose names start with the prefix\n");
+    printf("  --format <text|csv|json> Format of the results (default text)\n");
+    printf("  --output <path>        Write the results to a file instead of standard output\n");
+    printf("  --baseline <path>      Compare medians against a CSV written by an earlier run\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static CHP prepared;
+    static SUMMARY summaries[sizeof(cases) / sizeof(cases[0]) + MAX_ROMS];
+
+    CONFIG config = { DEFAULT_INSTRUCTIONS, DEFAULT_WARMUP, DEFAULT_REPEATS, INSTRUCTIONS_PER_FRAME, "", FORMAT_TEXT, NULL, NULL };
+    const char *roms[MAX_ROMS];
+    unsigned int rom_count = 0;
+    unsigned int count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--instructions") == 0 && i + 1 < argc)
+        {
+            config.instructions = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+        {
+            config.warmup = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            config.repeats = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)
+        {
+            config.instructions_per_frame = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            config.filter = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "text") == 0)
+        {
+            config.format = FORMAT_TEXT;
+            i++;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "csv") == 0)
+        {
+            config.format = FORMAT_CSV;
+            i++;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0)
+        {
+            config.format = FORMAT_JSON;
+            i++;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+        {
+            config.output_path = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            config.baseline_path = argv[++i];
+        } else if (argv[i][0] != '-' && rom_count < MAX_ROMS)
+        {
+            roms[rom_count++] = argv[i];
+        } else
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // ROM runs are whole frames, so they need at least one
+    if (config.repeats == 0 || config.repeats > MAX_REPEATS || config.instructions_per_frame == 0 ||
+        config.instructions < config.instructions_per_frame || config.instructions > 0xFFFFFFFF)
+    {
+        printf("Invalid benchmark configuration.\n");
+        return -1;
+    }
+
+    if (rom_count == 0)
+    {
+        roms[rom_count++] = "roms/test-rom.ch8";
+    }
+
+    for (unsigned int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (strncmp(cases[i].name, config.filter, strlen(config.filter)) != 0)
+        {
+            continue;
+        }
+
+        fprintf(stderr, "Running %s\n", cases[i].name);
+
+        prepare_case(&cases[i], &prepared);
+        snprintf(summaries[count].name, sizeof(summaries[count].name), "%s", cases[i].name);
+        measure(&prepared, &config, 0, &summaries[count]);
+        count++;
+    }
+
+    for (unsigned int i = 0; i < rom_count; i++)
+    {
+        char name[sizeof(summaries[0].name)];
+
+        snprintf(name, sizeof(name), "rom/%s", roms[i]);
+
+        if (strncmp(name, config.filter, strlen(config.filter)) != 0)
+        {
+            continue;
+        }
+
+        fprintf(stderr, "Running %s\n", name);
+
+        // Fixed seed, so every run of the ROM does the same work
+        initialise_chip8(&prepared);
+
+        if (load_rom(roms[i], &prepared) != 0)
+        {
+            return -1;
+        }
+
+        snprintf(summaries[count].name, sizeof(summaries[count].name), "%s", name);
+        measure(&prepared, &config, config.instructions / config.instructions_per_frame, &summaries[count]);
+        count++;
+    }
+
+    if (config.baseline_path && read_baseline(config.baseline_path, summaries, count) != 0)
+    {
+        return -1;
+    }
+
+    FILE *output = stdout;
+
+    if (config.output_path)
+    {
+        output = fopen(config.output_path, "w");
+
+        if (output == NULL)
+        {
+            fprintf(stderr, "Could not open '%s' for writing.\n", config.output_path);
+            return -1;
+        }
+    }
+
+    write_results(&config, summaries, count, output);
+
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+
+    return 0;
+}
@@ -0,0 +1,326 @@
+#include "movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void movie_start(MOVIE *movie, uint64_t seed, unsigned int instructions_per_frame, unsigned int keyframe_interval)
+{
+    memset(movie, 0, sizeof(MOVIE));
+
+    movie->seed = seed;
+    movie->instructions_per_frame = instructions_per_frame;
+    movie->keyframe_interval = keyframe_interval ? keyframe_interval : MOVIE_DEFAULT_KEYFRAME_INTERVAL;
+}
+
+
+void movie_free(MOVIE *movie)
+{
+    free(movie->inputs);
+    free(movie->keyframes);
+
+    memset(movie, 0, sizeof(MOVIE));
+}
+
+
+int movie_record_frame(MOVIE *movie, const CHP *chip8)
+{
+    if (movie->frames % movie->keyframe_interval == 0)
+    {
+        if (movie->keyframe_count == movie->keyframe_capacity)
+        {
+            uint64_t capacity = movie->keyframe_capacity ? movie->keyframe_capacity * 2 : 16;
+            MOVIE_KEYFRAME *keyframes = realloc(movie->keyframes, capacity * sizeof(MOVIE_KEYFRAME));
+
+            if (keyframes == NULL)
+            {
+                return -1;
+            }
+
+            movie->keyframes = keyframes;
+            movie->keyframe_capacity = capacity;
+        }
+
+        MOVIE_KEYFRAME *keyframe = &movie->keyframes[movie->keyframe_count++];
+
+        keyframe->frame = movie->frames;
+        take_snapshot(chip8, &keyframe->state);
+    }
+
+    if (movie->frames == movie->input_capacity)
+    {
+        uint64_t capacity = movie->input_capacity ? movie->input_capacity * 2 : 4096;
+        uint16_t *inputs = realloc(movie->inputs, capacity * sizeof(uint16_t));
+
+        if (inputs == NULL)
+        {
+            return -1;
+        }
+
+        movie->inputs = inputs;
+        movie->input_capacity = capacity;
+    }
+
+    movie->inputs[movie->frames++] = chip8->keypad;
+
+    return 0;
+}
+
+
+void movie_apply_input(const MOVIE *movie, uint64_t frame, CHP *chip8)
+{
+    chip8->keypad = movie->inputs[frame];
+}
+
+
+int movie_seek(const MOVIE *movie, uint64_t frame, CHP *chip8)
+{
+    if (frame > movie->frames || movie->keyframe_count == 0)
+    {
+        return -1;
+    }
+
+    uint64_t index = frame / movie->keyframe_interval;
+
+    // The end of a movie can be a keyframe that was never recorded
+    if (index >= movie->keyframe_count)
+    {
+        index = movie->keyframe_count - 1;
+    }
+
+    const MOVIE_KEYFRAME *keyframe = &movie->keyframes[index];
+
+    restore_snapshot(chip8, &keyframe->state);
+
+    for (uint64_t i = keyframe->frame; i < frame; i++)
+    {
+        movie_apply_input(movie, i, chip8);
+        run_frame(chip8, movie->instructions_per_frame);
+    }
+
+    return 0;
+}
+
+
+static int matches_keyframe(const CHP *chip8, const MOVIE_KEYFRAME *keyframe)
+{
+    const SNAPSHOT *state = &keyframe->state;
+
+    return chip8->PC == state->PC && chip8->SP == state->SP && chip8->I == state->I &&
+        chip8->DT == state->DT && chip8->ST == state->ST &&
+        chip8->key_wait == state->key_wait && chip8->random_state == state->random_state &&
+        memcmp(chip8->V, state->V, sizeof(state->V)) == 0 &&
+        memcmp(chip8->stack, state->stack, sizeof(state->stack)) == 0 &&
+        memcmp(chip8->memory, state->memory, sizeof(state->memory)) == 0 &&
+        memcmp(chip8->display, state->display, sizeof(state->display)) == 0;
+}
+
+int movie_verify(const MOVIE *movie, CHP *chip8, uint64_t *desync_frame)
+{
+    if (movie_seek(movie, 0, chip8) != 0)
+    {
+        *desync_frame = 0;
+        return -1;
+    }
+
+    for (uint64_t frame = 0; frame < movie->frames; frame++)
+    {
+        // The keypad is left out, since it is set from the recorded input
+        if (frame % movie->keyframe_interval == 0 &&
+            !matches_keyframe(chip8, &movie->keyframes[frame / movie->keyframe_interval]))
+        {
+            *desync_frame = frame;
+            return -1;
+        }
+
+        movie_apply_input(movie, frame, chip8);
+        run_frame(chip8, movie->instructions_per_frame);
+    }
+
+    return 0;
+}
+
+
+// --- Movie files ---
+// The header, the input of every frame, then each keyframe as its frame
+// and a save state. Everything is little endian.
+
+static void write_value(FILE *fptr, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        fputc((value >> (i * 8)) & 0xFF, fptr);
+    }
+}
+
+static uint64_t read_value(FILE *fptr, int size, int *error)
+{
+    uint64_t value = 0;
+
+    for (int i = 0; i < size; i++)
+    {
+        int byte = fgetc(fptr);
+
+        if (byte == EOF)
+        {
+            *error = 1;
+            return 0;
+        }
+
+        value |= (uint64_t)byte << (i * 8);
+    }
+
+    return value;
+}
+
+int save_movie(const char *path, const MOVIE *movie)
+{
+    unsigned char state[SAVE_STATE_SIZE];
+
+    FILE *fptr = fopen(path, "wb");
+
+    if (fptr == NULL)
+    {
+        printf("Could not write movie: '%s'\n", path);
+        return -1;
+    }
+
+    fwrite(MOVIE_MAGIC, 1, 4, fptr);
+    write_value(fptr, MOVIE_VERSION, 4);
+    write_value(fptr, movie->seed, 8);
+    write_value(fptr, movie->instructions_per_frame, 4);
+    write_value(fptr, movie->keyframe_interval, 4);
+    write_value(fptr, movie->frames, 8);
+    write_value(fptr, movie->keyframe_count, 8);
+
+    for (uint64_t i = 0; i < movie->frames; i++)
+    {
+        write_value(fptr, movie->inputs[i], 2);
+    }
+
+    for (uint64_t i = 0; i < movie->keyframe_count; i++)
+    {
+        write_value(fptr, movie->keyframes[i].frame, 8);
+
+        encode_state(&movie->keyframes[i].state, state);
+        fwrite(state, 1, sizeof(state), fptr);
+    }
+
+    int failed = ferror(fptr);
+
+    if (fclose(fptr) != 0 || failed)
+    {
+        printf("Could not write movie: '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int read_movie(FILE *fptr, MOVIE *movie)
+{
+    unsigned char state[SAVE_STATE_SIZE];
+    char magic[4];
+    int error = 0;
+
+    if (fread(magic, 1, 4, fptr) != 4 || memcmp(magic, MOVIE_MAGIC, 4) != 0 ||
+        read_value(fptr, 4, &error) != MOVIE_VERSION)
+    {
+        return -1;
+    }
+
+    movie->seed = read_value(fptr, 8, &error);
+    movie->instructions_per_frame = read_value(fptr, 4, &error);
+    movie->keyframe_interval = read_value(fptr, 4, &error);
+
+    uint64_t frames = read_value(fptr, 8, &error);
+    uint64_t keyframe_count = read_value(fptr, 8, &error);
+
+    // The counts come from the file, so they are checked against what is
+    // left of it before anything is allocated for them
+    long start = ftell(fptr);
+
+    if (error || start < 0 || fseek(fptr, 0, SEEK_END) != 0)
+    {
+        return -1;
+    }
+
+    long end = ftell(fptr);
+
+    if (end < start || fseek(fptr, start, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+
+    uint64_t remaining = end - start;
+
+    if (frames > remaining / sizeof(uint16_t) || keyframe_count > remaining / (8 + SAVE_STATE_SIZE) ||
+        frames * sizeof(uint16_t) + keyframe_count * (8 + SAVE_STATE_SIZE) != remaining)
+    {
+        return -1;
+    }
+
+    // Every movie starts with a keyframe and has one every interval after
+    if (movie->instructions_per_frame == 0 || movie->keyframe_interval == 0 ||
+        keyframe_count != (frames + movie->keyframe_interval - 1) / movie->keyframe_interval)
+    {
+        return -1;
+    }
+
+    movie->inputs = malloc((frames ? frames : 1) * sizeof(uint16_t));
+    movie->keyframes = malloc((keyframe_count ? keyframe_count : 1) * sizeof(MOVIE_KEYFRAME));
+
+    if (movie->inputs == NULL || movie->keyframes == NULL)
+    {
+        return -1;
+    }
+
+    movie->input_capacity = frames;
+    movie->keyframe_capacity = keyframe_count;
+
+    for (; movie->frames < frames && !error; movie->frames++)
+    {
+        movie->inputs[movie->frames] = read_value(fptr, 2, &error);
+    }
+
+    for (; movie->keyframe_count < keyframe_count && !error; movie->keyframe_count++)
+    {
+        MOVIE_KEYFRAME *keyframe = &movie->keyframes[movie->keyframe_count];
+
+        keyframe->frame = read_value(fptr, 8, &error);
+
+        if (error || keyframe->frame != movie->keyframe_count * movie->keyframe_interval ||
+            fread(state, 1, sizeof(state), fptr) != sizeof(state) ||
+            decode_state(state, sizeof(state), &keyframe->state) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return error || fgetc(fptr) != EOF ? -1 : 0;
+}
+
+int load_movie(const char *path, MOVIE *movie)
+{
+    FILE *fptr = fopen(path, "rb");
+
+    memset(movie, 0, sizeof(MOVIE));
+
+    if (fptr == NULL)
+    {
+        printf("Invalid movie path: '%s'\n", path);
+        return -1;
+    }
+
+    int result = read_movie(fptr, movie);
+
+    fclose(fptr);
+
+    if (result != 0)
+    {
+        printf("Not a version %d movie: '%s'\n", MOVIE_VERSION, path);
+        movie_free(movie);
+    }
+
+    return result;
+}
@@ -0,0 +1,70 @@
+#ifndef MOVIE_HEADER
+#define MOVIE_HEADER
+
+#include <stdint.h>
+
+#include "chip8.h"
+#include "snapshot.h"
+
+#define MOVIE_MAGIC "C8MV"
+#define MOVIE_VERSION 2
+
+// Ten seconds between keyframes, so seeking replays at most that much
+#define MOVIE_DEFAULT_KEYFRAME_INTERVAL 600
+
+// State at the start of a frame, as recorded
+typedef struct
+{
+    uint64_t frame;
+    SNAPSHOT state;
+} MOVIE_KEYFRAME;
+
+// A run of the emulator that can be played back exactly: the random seed,
+// the keypad at the start of each frame, and a keyframe of the whole
+// machine every keyframe_interval frames. The first keyframe holds the
+// loaded ROM, so a movie plays back without it.
+typedef struct
+{
+    uint64_t seed;
+    unsigned int instructions_per_frame;
+    unsigned int keyframe_interval;
+
+    // One bit per key for every frame
+    uint16_t *inputs;
+    uint64_t frames;
+    uint64_t input_capacity;
+
+    MOVIE_KEYFRAME *keyframes;
+    uint64_t keyframe_count;
+    uint64_t keyframe_capacity;
+} MOVIE;
+
+// Starts an empty recording of a machine seeded with seed_random(seed)
+void movie_start(MOVIE *movie, uint64_t seed, unsigned int instructions_per_frame, unsigned int keyframe_interval);
+
+void movie_free(MOVIE *movie);
+
+// Records the keypad, and a keyframe when one is due, before the frame
+// runs. Returns -1 when out of memory.
+int movie_record_frame(MOVIE *movie, const CHP *chip8);
+
+// Sets the keypad to what it was at the start of a recorded frame
+void movie_apply_input(const MOVIE *movie, uint64_t frame, CHP *chip8);
+
+// Puts the machine in the state it was in at the start of frame, by
+// restoring the nearest keyframe before it and playing the frames in
+// between. Returns -1 when the movie is not that long. Callers using a JIT
+// must flush it afterwards.
+int movie_seek(const MOVIE *movie, uint64_t frame, CHP *chip8);
+
+// Plays the whole movie from the start, checking the machine against every
+// keyframe on the way. Returns 0 when they all match, otherwise -1 with
+// the first frame that did not in desync_frame.
+int movie_verify(const MOVIE *movie, CHP *chip8, uint64_t *desync_frame);
+
+int save_movie(const char *path, const MOVIE *movie);
+
+// Replaces the contents of movie, which must be freed with movie_free()
+int load_movie(const char *path, MOVIE *movie);
+
+#endif
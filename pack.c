@@ -0,0 +1,523 @@
+#include "pack.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HEADER_SIZE 32
+#define ENTRY_SIZE 48
+#define BUCKET_SIZE 4
+
+#define PATH_SIZE 1024
+
+struct PACK
+{
+    const unsigned char *data;
+    size_t size;
+
+    unsigned int count;
+    const unsigned char *entries;
+
+    // Always a power of two
+    unsigned int bucket_count;
+    const unsigned char *buckets;
+};
+
+// A ROM read in by build_pack()
+typedef struct
+{
+    char name[PATH_SIZE];
+    unsigned char data[MAX_PROGRAM_SIZE];
+    uint32_t size;
+    unsigned int instructions_per_frame;
+    unsigned int quirks;
+} PACK_SOURCE;
+
+
+// --- Encoding ---
+
+static void put32(unsigned char *buffer, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        buffer[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+static void put64(unsigned char *buffer, uint64_t value)
+{
+    put32(buffer, value & 0xFFFFFFFF);
+    put32(buffer + 4, value >> 32);
+}
+
+static uint32_t get32(const unsigned char *buffer)
+{
+    return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static uint64_t get64(const unsigned char *buffer)
+{
+    return get32(buffer) | ((uint64_t)get32(buffer + 4) << 32);
+}
+
+static uint64_t hash_bytes(const void *data, size_t size)
+{
+    // FNV-1a, the same as the save state checksum
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+
+// --- Reading ---
+
+PACK *pack_open(const char *path)
+{
+    struct stat info;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        printf("Invalid pack path: '%s'\n", path);
+        return NULL;
+    }
+
+    if (fstat(fd, &info) != 0 || info.st_size < HEADER_SIZE)
+    {
+        printf("Not a version %d pack: '%s'\n", PACK_VERSION, path);
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping stays valid once the file is closed
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        printf("Could not map pack: '%s'\n", path);
+        return NULL;
+    }
+
+    PACK *pack = malloc(sizeof(PACK));
+    const unsigned char *header = data;
+
+    if (pack == NULL)
+    {
+        munmap(data, info.st_size);
+        return NULL;
+    }
+
+    pack->data = data;
+    pack->size = info.st_size;
+    pack->count = get32(header + 8);
+    pack->bucket_count = get32(header + 12);
+
+    uint64_t entries_offset = get64(header + 16);
+    uint64_t buckets_offset = get64(header + 24);
+
+    // Only the tables are checked here, each ROM is checked when it is used
+    if (memcmp(header, PACK_MAGIC, 4) != 0 || get32(header + 4) != PACK_VERSION ||
+        pack->bucket_count == 0 || (pack->bucket_count & (pack->bucket_count - 1)) != 0 ||
+        pack->bucket_count < pack->count ||
+        entries_offset > pack->size || (pack->size - entries_offset) / ENTRY_SIZE < pack->count ||
+        buckets_offset > pack->size || (pack->size - buckets_offset) / BUCKET_SIZE < pack->bucket_count)
+    {
+        printf("Not a version %d pack: '%s'\n", PACK_VERSION, path);
+        pack_close(pack);
+        return NULL;
+    }
+
+    pack->entries = pack->data + entries_offset;
+    pack->buckets = pack->data + buckets_offset;
+
+    return pack;
+}
+
+void pack_close(PACK *pack)
+{
+    munmap((void *)pack->data, pack->size);
+    free(pack);
+}
+
+unsigned int pack_count(const PACK *pack)
+{
+    return pack->count;
+}
+
+
+// Returns the entry's name, or NULL when it does not end inside the file
+static const char *entry_name(const PACK *pack, const unsigned char *entry)
+{
+    uint64_t offset = get64(entry + 24);
+
+    if (offset >= pack->size || memchr(pack->data + offset, '\0', pack->size - offset) == NULL)
+    {
+        return NULL;
+    }
+
+    return (const char *)pack->data + offset;
+}
+
+int pack_find(const PACK *pack, const char *name)
+{
+    uint64_t hash = hash_bytes(name, strlen(name));
+
+    for (unsigned int i = 0; i < pack->bucket_count; i++)
+    {
+        unsigned int bucket = (hash + i) & (pack->bucket_count - 1);
+        uint32_t index = get32(pack->buckets + bucket * BUCKET_SIZE);
+
+        if (index == 0)
+        {
+            return -1;
+        }
+
+        if (index > pack->count)
+        {
+            continue;
+        }
+
+        const unsigned char *entry = pack->entries + (index - 1) * ENTRY_SIZE;
+
+        if (get64(entry) == hash)
+        {
+            const char *entry_name_text = entry_name(pack, entry);
+
+            if (entry_name_text && strcmp(entry_name_text, name) == 0)
+            {
+                return index - 1;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int pack_get(const PACK *pack, unsigned int index, PACK_ROM *rom)
+{
+    const unsigned char *entry = pack->entries + index * ENTRY_SIZE;
+    uint64_t offset = get64(entry + 16);
+
+    rom->name = entry_name(pack, entry);
+    rom->content_hash = get64(entry + 8);
+    rom->size = get32(entry + 32);
+    rom->instructions_per_frame = get32(entry + 36);
+    rom->quirks = get32(entry + 40);
+    rom->data = NULL;
+
+    if (rom->name == NULL || offset > pack->size || pack->size - offset < rom->size)
+    {
+        return ROM_TRUNCATED;
+    }
+
+    rom->data = pack->data + offset;
+
+    return rom->size > MAX_PROGRAM_SIZE ? ROM_TOO_LARGE : ROM_LOADED;
+}
+
+int pack_load(const PACK *pack, unsigned int index, CHP *chip8)
+{
+    PACK_ROM rom;
+
+    if (index >= pack->count)
+    {
+        return ROM_MISSING;
+    }
+
+    int result = pack_get(pack, index, &rom);
+
+    if (result != ROM_LOADED)
+    {
+        return result;
+    }
+
+    if (hash_bytes(rom.data, rom.size) != rom.content_hash)
+    {
+        return ROM_CORRUPT;
+    }
+
+    return load_program(chip8, rom.data, rom.size);
+}
+
+
+// --- Building ---
+
+// Reads a ROM into the next source, naming it after its file
+static int add_source(PACK_SOURCE **sources, unsigned int *count, unsigned int *capacity, const char *path,
+                      unsigned int instructions_per_frame, unsigned int quirks)
+{
+    if (*count == *capacity)
+    {
+        unsigned int grown = *capacity ? *capacity * 2 : 64;
+        PACK_SOURCE *resized = realloc(*sources, grown * sizeof(PACK_SOURCE));
+
+        if (resized == NULL)
+        {
+            printf("Out of memory building the pack.\n");
+            return -1;
+        }
+
+        *sources = resized;
+        *capacity = grown;
+    }
+
+    PACK_SOURCE *source = &(*sources)[*count];
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    FILE *fptr = fopen(path, "rb");
+
+    if (fptr == NULL)
+    {
+        printf("Invalid ROM path: '%s'\n", path);
+        return -1;
+    }
+
+    size_t size = fread(source->data, 1, sizeof(source->data), fptr);
+    int result = ferror(fptr) ? ROM_TRUNCATED
+        : size == sizeof(source->data) && fgetc(fptr) != EOF ? ROM_TOO_LARGE
+        : ROM_LOADED;
+
+    fclose(fptr);
+
+    if (result == ROM_TOO_LARGE)
+    {
+        printf("ROM is larger than the %d bytes of program space: '%s'\n", MAX_PROGRAM_SIZE, path);
+        return -1;
+    } else if (result != ROM_LOADED)
+    {
+        printf("Could not read ROM: '%s'\n", path);
+        return -1;
+    }
+
+    snprintf(source->name, sizeof(source->name), "%s", name);
+    source->size = size;
+    source->instructions_per_frame = instructions_per_frame;
+    source->quirks = quirks;
+
+    *count += 1;
+
+    return 0;
+}
+
+static int compare_sources(const void *a, const void *b)
+{
+    return strcmp(((const PACK_SOURCE *)a)->name, ((const PACK_SOURCE *)b)->name);
+}
+
+static int find_directory_sources(const char *path, PACK_SOURCE **sources, unsigned int *count)
+{
+    DIR *directory = opendir(path);
+    unsigned int capacity = 0;
+    struct dirent *entry;
+    char rom_path[PATH_SIZE];
+
+    if (directory == NULL)
+    {
+        printf("Invalid ROM directory: '%s'\n", path);
+        return -1;
+    }
+
+    while ((entry = readdir(directory)) != NULL)
+    {
+        struct stat info;
+
+        if (snprintf(rom_path, sizeof(rom_path), "%s/%s", path, entry->d_name) >= (int)sizeof(rom_path))
+        {
+            continue;
+        }
+
+        if (stat(rom_path, &info) == 0 && S_ISREG(info.st_mode) &&
+            add_source(sources, count, &capacity, rom_path, 0, 0) != 0)
+        {
+            closedir(directory);
+            return -1;
+        }
+    }
+
+    closedir(directory);
+
+    qsort(*sources, *count, sizeof(PACK_SOURCE), compare_sources);
+
+    return 0;
+}
+
+static int find_listed_sources(const char *path, PACK_SOURCE **sources, unsigned int *count)
+{
+    FILE *fptr = fopen(path, "r");
+    unsigned int capacity = 0;
+    char line[2 * PATH_SIZE];
+    unsigned int number = 0;
+
+    if (fptr == NULL)
+    {
+        printf("Invalid ROM list: '%s'\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fptr))
+    {
+        char rom_path[PATH_SIZE];
+        char quirk_list[256] = "none";
+        unsigned int instructions_per_frame = 0;
+        unsigned int quirks;
+
+        number += 1;
+
+        if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+
+        if (sscanf(line, "%1023s %u %255s", rom_path, &instructions_per_frame, quirk_list) < 1 ||
+            parse_quirks(quirk_list, &quirks) != 0)
+        {
+            printf("Invalid ROM on line %u of '%s'\n", number, path);
+            fclose(fptr);
+            return -1;
+        }
+
+        if (add_source(sources, count, &capacity, rom_path, instructions_per_frame, quirks) != 0)
+        {
+            fclose(fptr);
+            return -1;
+        }
+    }
+
+    fclose(fptr);
+
+    return 0;
+}
+
+// Lays the pack out in memory, returning -1 when two ROMs share a name
+static int encode_pack(const PACK_SOURCE *sources, unsigned int count, unsigned char *image, unsigned int bucket_count)
+{
+    size_t entries_offset = HEADER_SIZE;
+    size_t buckets_offset = entries_offset + (size_t)count * ENTRY_SIZE;
+    size_t offset = buckets_offset + (size_t)bucket_count * BUCKET_SIZE;
+
+    memcpy(image, PACK_MAGIC, 4);
+    put32(image + 4, PACK_VERSION);
+    put32(image + 8, count);
+    put32(image + 12, bucket_count);
+    put64(image + 16, entries_offset);
+    put64(image + 24, buckets_offset);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned char *entry = image + entries_offset + i * ENTRY_SIZE;
+        size_t name_length = strlen(sources[i].name) + 1;
+        uint64_t name_hash = hash_bytes(sources[i].name, name_length - 1);
+
+        put64(entry, name_hash);
+        put64(entry + 8, hash_bytes(sources[i].data, sources[i].size));
+        put64(entry + 24, offset);
+        put32(entry + 32, sources[i].size);
+        put32(entry + 36, sources[i].instructions_per_frame);
+        put32(entry + 40, sources[i].quirks);
+
+        memcpy(image + offset, sources[i].name, name_length);
+        offset += name_length;
+
+        put64(entry + 16, offset);
+        memcpy(image + offset, sources[i].data, sources[i].size);
+        offset += sources[i].size;
+
+        // Linear probing from the name's hash, which never fills up since
+        // there are at least twice as many buckets as ROMs
+        unsigned int bucket = name_hash & (bucket_count - 1);
+
+        while (get32(image + buckets_offset + bucket * BUCKET_SIZE) != 0)
+        {
+            uint32_t other = get32(image + buckets_offset + bucket * BUCKET_SIZE) - 1;
+
+            if (strcmp(sources[other].name, sources[i].name) == 0)
+            {
+                printf("Two ROMs are named '%s'\n", sources[i].name);
+                return -1;
+            }
+
+            bucket = (bucket + 1) & (bucket_count - 1);
+        }
+
+        put32(image + buckets_offset + bucket * BUCKET_SIZE, i + 1);
+    }
+
+    return 0;
+}
+
+int build_pack(const char *pack_path, const char *roms_path)
+{
+    PACK_SOURCE *sources = NULL;
+    unsigned int count = 0;
+    struct stat info;
+
+    int found = stat(roms_path, &info) == 0 && S_ISDIR(info.st_mode)
+        ? find_directory_sources(roms_path, &sources, &count)
+        : find_listed_sources(roms_path, &sources, &count);
+
+    if (found != 0)
+    {
+        free(sources);
+        return -1;
+    }
+
+    unsigned int bucket_count = 1;
+
+    while (bucket_count < count * 2)
+    {
+        bucket_count *= 2;
+    }
+
+    size_t size = HEADER_SIZE + (size_t)count * ENTRY_SIZE + (size_t)bucket_count * BUCKET_SIZE;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        size += strlen(sources[i].name) + 1 + sources[i].size;
+    }
+
+    unsigned char *image = calloc(size, 1);
+
+    if (image == NULL || encode_pack(sources, count, image, bucket_count) != 0)
+    {
+        free(image);
+        free(sources);
+        return -1;
+    }
+
+    free(sources);
+
+    FILE *fptr = fopen(pack_path, "wb");
+
+    if (fptr == NULL)
+    {
+        printf("Could not write pack: '%s'\n", pack_path);
+        free(image);
+        return -1;
+    }
+
+    size_t written = fwrite(image, 1, size, fptr);
+
+    free(image);
+
+    if (fclose(fptr) != 0 || written != size)
+    {
+        printf("Could not write pack: '%s'\n", pack_path);
+        return -1;
+    }
+
+    return 0;
+}
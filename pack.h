@@ -0,0 +1,67 @@
+#ifndef PACK_HEADER
+#define PACK_HEADER
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Pack files start with the magic and the format version
+#define PACK_MAGIC "C8PK"
+#define PACK_VERSION 1
+
+// Many ROMs stored in one file, which is memory mapped so that loading a ROM
+// is a copy out of the mapping rather than a file read. All numbers are
+// little endian whatever the host:
+//
+//   header   magic, version, ROM count, bucket count, offsets of the
+//            entries and buckets (32 bytes)
+//   entries  per ROM: hash of its name, hash of its contents, offsets of
+//            its contents and name, its size, suggested instructions per
+//            frame and QUIRK_ flags (48 bytes each)
+//   buckets  open addressed hash table of entry index + 1 by name hash,
+//            0 for empty (4 bytes each, a power of two of them)
+//   names    NUL terminated
+//   contents
+typedef struct PACK PACK;
+
+typedef struct
+{
+    // Both point into the mapping, and stay valid until the pack is closed
+    const char *name;
+    const unsigned char *data;
+    uint32_t size;
+
+    // FNV-1a of the contents, checked whenever the ROM is loaded
+    uint64_t content_hash;
+
+    // Instructions per frame the ROM was written for, 0 when unknown
+    unsigned int instructions_per_frame;
+    unsigned int quirks;
+} PACK_ROM;
+
+// Returns NULL, printing why, when the file is missing or not a pack of this
+// version. The ROMs themselves are only checked once they are used.
+PACK *pack_open(const char *path);
+
+void pack_close(PACK *pack);
+
+unsigned int pack_count(const PACK *pack);
+
+// Returns the index of the ROM with this name, or -1 when there is none
+int pack_find(const PACK *pack, const char *name);
+
+// Describes a ROM, returning ROM_TRUNCATED when its name or contents lie past
+// the end of the file and ROM_TOO_LARGE when it does not fit in memory
+int pack_get(const PACK *pack, unsigned int index, PACK_ROM *rom);
+
+// Loads a ROM into the machine's memory without making any system calls,
+// returning a ROM_ result. Never prints, so it is safe in worker threads.
+int pack_load(const PACK *pack, unsigned int index, CHP *chip8);
+
+// Writes a pack of every file in a directory, or of every ROM in a list with
+// one "<rom> [instructions per frame [quirks]]" per line, where the quirks
+// are as given to parse_quirks(). ROMs are named after their file names.
+// Returns -1, printing why, when any ROM cannot be packed.
+int build_pack(const char *pack_path, const char *roms_path);
+
+#endif
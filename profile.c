@@ -0,0 +1,612 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of addresses listed in the report, hottest first
+#define HOT_ADDRESSES 20
+
+// Names of the operations an instruction can decode to before fusing
+static const char *op_names[OP_COUNT] =
+{
+    [OP_NOP] = "0NNN",
+    [OP_00E0] = "00E0",
+    [OP_00EE] = "00EE",
+    [OP_1NNN] = "1NNN",
+    [OP_2NNN] = "2NNN",
+    [OP_3XNN] = "3XNN",
+    [OP_4XNN] = "4XNN",
+    [OP_5XY0] = "5XY0",
+    [OP_6XNN] = "6XNN",
+    [OP_7XNN] = "7XNN",
+    [OP_8XY0] = "8XY0",
+    [OP_8XY1] = "8XY1",
+    [OP_8XY2] = "8XY2",
+    [OP_8XY3] = "8XY3",
+    [OP_8XY4] = "8XY4",
+    [OP_8XY5] = "8XY5",
+    [OP_8XY6] = "8XY6",
+    [OP_8XY7] = "8XY7",
+    [OP_8XYE] = "8XYE",
+    [OP_9XY0] = "9XY0",
+    [OP_ANNN] = "ANNN",
+    [OP_BNNN] = "BNNN",
+    [OP_CXNN] = "CXNN",
+    [OP_DXYN] = "DXYN",
+    [OP_EX9E] = "EX9E",
+    [OP_EXA1] = "EXA1",
+    [OP_FX07] = "FX07",
+    [OP_FX0A] = "FX0A",
+    [OP_FX15] = "FX15",
+    [OP_FX18] = "FX18",
+    [OP_FX1E] = "FX1E",
+    [OP_FX29] = "FX29",
+    [OP_FX33] = "FX33",
+    [OP_FX55] = "FX55",
+    [OP_FX65] = "FX65",
+    [OP_8XY1_RESET] = "8XY1 vf-reset",
+    [OP_8XY2_RESET] = "8XY2 vf-reset",
+    [OP_8XY3_RESET] = "8XY3 vf-reset",
+    [OP_BXNN] = "BXNN",
+    [OP_DXYN_CLIP] = "DXYN clip",
+    [OP_FX55_I] = "FX55 load-store",
+    [OP_FX65_I] = "FX65 load-store"
+};
+
+static int is_skip(unsigned int op)
+{
+    return op == OP_3XNN || op == OP_4XNN || op == OP_5XY0 || op == OP_9XY0 || op == OP_EX9E || op == OP_EXA1;
+}
+
+void profile_reset(PROFILE *profile)
+{
+    memset(profile, 0, sizeof(PROFILE));
+
+    profile->calls[0].address = PROFILE_ROOT;
+    profile->calls[0].parent = -1;
+    profile->calls[0].first_child = -1;
+    profile->calls[0].next_sibling = -1;
+    profile->call_count = 1;
+    profile->current_call = 0;
+}
+
+
+static void enter_call(PROFILE *profile, unsigned short address)
+{
+    PROFILE_CALL *caller = &profile->calls[profile->current_call];
+    int child = caller->first_child;
+
+    // Past the limits the caller goes on standing in for its callees
+    if (profile->untracked_depth > 0 || caller->depth == PROFILE_MAX_CALL_DEPTH)
+    {
+        profile->untracked_depth += 1;
+        return;
+    }
+
+    while (child >= 0 && profile->calls[child].address != address)
+    {
+        child = profile->calls[child].next_sibling;
+    }
+
+    if (child < 0)
+    {
+        if (profile->call_count == PROFILE_MAX_CALL_NODES)
+        {
+            profile->untracked_depth += 1;
+            return;
+        }
+
+        child = profile->call_count++;
+
+        profile->calls[child].address = address;
+        profile->calls[child].depth = caller->depth + 1;
+        profile->calls[child].parent = profile->current_call;
+        profile->calls[child].first_child = -1;
+        profile->calls[child].next_sibling = caller->first_child;
+        caller->first_child = child;
+    }
+
+    profile->calls[child].calls += 1;
+    profile->current_call = child;
+}
+
+static void leave_call(PROFILE *profile)
+{
+    if (profile->untracked_depth > 0)
+    {
+        profile->untracked_depth -= 1;
+    } else if (profile->current_call != 0)
+    {
+        profile->current_call = profile->calls[profile->current_call].parent;
+    } else
+    {
+        // Returning from the root leaves the program where it was in the
+        // tree, whatever its stack pointer wrapped round to
+        profile->unmatched_returns += 1;
+    }
+}
+
+
+void profile_run_instructions(PROFILE *profile, CHP *chip8, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int address = chip8->PC & (MEMORY_SIZE - 1);
+        unsigned short opcode = fetch(chip8);
+        INSTRUCTION ins;
+
+        // Decoded afresh rather than taken from the cache, which may hold a
+        // superinstruction standing for several of them
+        decode_instruction(opcode, &ins);
+        apply_quirks(chip8->quirks, &ins);
+
+        chip8->PC += 2;
+        execute(chip8, &ins);
+
+        profile->instructions += 1;
+        profile->op_counts[ins.op] += 1;
+        profile->address_counts[address] += 1;
+        profile->opcodes[address] = opcode;
+
+        // Calls count towards their caller and returns towards the callee
+        profile->calls[profile->current_call].instructions += 1;
+
+        if (ins.op == OP_2NNN)
+        {
+            enter_call(profile, ins.nnn);
+        } else if (ins.op == OP_00EE)
+        {
+            leave_call(profile);
+        }
+
+        // A skip that was taken has moved PC past the next instruction
+        if (is_skip(ins.op) && chip8->PC == address + 4)
+        {
+            profile->skips_taken[ins.op] += 1;
+        }
+
+        if ((ins.op == OP_DXYN || ins.op == OP_DXYN_CLIP) && chip8->V[0xF])
+        {
+            profile->collisions += 1;
+        }
+    }
+}
+
+void profile_run_frame(PROFILE *profile, CHP *chip8, unsigned int instructions)
+{
+    profile_run_instructions(profile, chip8, instructions);
+    tick_timers(chip8);
+}
+
+
+void disassemble(unsigned short opcode, char *text, unsigned int size)
+{
+    INSTRUCTION ins;
+
+    decode_instruction(opcode, &ins);
+
+    switch (ins.op)
+    {
+        case OP_00E0: snprintf(text, size, "CLS"); break;
+        case OP_00EE: snprintf(text, size, "RET"); break;
+        case OP_1NNN: snprintf(text, size, "JP 0x%03X", ins.nnn); break;
+        case OP_2NNN: snprintf(text, size, "CALL 0x%03X", ins.nnn); break;
+        case OP_3XNN: snprintf(text, size, "SE V%X, 0x%02X", ins.x, ins.nn); break;
+        case OP_4XNN: snprintf(text, size, "SNE V%X, 0x%02X", ins.x, ins.nn); break;
+        case OP_5XY0: snprintf(text, size, "SE V%X, V%X", ins.x, ins.y); break;
+        case OP_6XNN: snprintf(text, size, "LD V%X, 0x%02X", ins.x, ins.nn); break;
+        case OP_7XNN: snprintf(text, size, "ADD V%X, 0x%02X", ins.x, ins.nn); break;
+        case OP_8XY0: snprintf(text, size, "LD V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY1: snprintf(text, size, "OR V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY2: snprintf(text, size, "AND V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY3: snprintf(text, size, "XOR V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY4: snprintf(text, size, "ADD V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY5: snprintf(text, size, "SUB V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY6: snprintf(text, size, "SHR V%X, V%X", ins.x, ins.y); break;
+        case OP_8XY7: snprintf(text, size, "SUBN V%X, V%X", ins.x, ins.y); break;
+        case OP_8XYE: snprintf(text, size, "SHL V%X, V%X", ins.x, ins.y); break;
+        case OP_9XY0: snprintf(text, size, "SNE V%X, V%X", ins.x, ins.y); break;
+        case OP_ANNN: snprintf(text, size, "LD I, 0x%03X", ins.nnn); break;
+        case OP_BNNN: snprintf(text, size, "JP V0, 0x%03X", ins.nnn); break;
+        case OP_CXNN: snprintf(text, size, "RND V%X, 0x%02X", ins.x, ins.nn); break;
+        case OP_DXYN: snprintf(text, size, "DRW V%X, V%X, %u", ins.x, ins.y, ins.n); break;
+        case OP_EX9E: snprintf(text, size, "SKP V%X", ins.x); break;
+        case OP_EXA1: snprintf(text, size, "SKNP V%X", ins.x); break;
+        case OP_FX07: snprintf(text, size, "LD V%X, DT", ins.x); break;
+        case OP_FX0A: snprintf(text, size, "LD V%X, K", ins.x); break;
+        case OP_FX15: snprintf(text, size, "LD DT, V%X", ins.x); break;
+        case OP_FX18: snprintf(text, size, "LD ST, V%X", ins.x); break;
+        case OP_FX1E: snprintf(text, size, "ADD I, V%X", ins.x); break;
+        case OP_FX29: snprintf(text, size, "LD F, V%X", ins.x); break;
+        case OP_FX33: snprintf(text, size, "LD B, V%X", ins.x); break;
+        case OP_FX55: snprintf(text, size, "LD [I], V%X", ins.x); break;
+        case OP_FX65: snprintf(text, size, "LD V%X, [I]", ins.x); break;
+        default:
+            // 0NNN machine code routines and anything unrecognised
+            if ((opcode & 0xF000) == 0)
+            {
+                snprintf(text, size, "SYS 0x%03X", ins.nnn);
+            } else
+            {
+                snprintf(text, size, "DW 0x%04X", opcode);
+            }
+            break;
+    }
+}
+
+
+// --- Reports ---
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+// Fills addresses with the ones that ran, hottest first, returning how many
+static unsigned int hottest_addresses(const PROFILE *profile, unsigned int *addresses, unsigned int count)
+{
+    unsigned int found = 0;
+
+    // A handful of entries out of 4096, so an insertion sort is plenty
+    for (unsigned int address = 0; address < MEMORY_SIZE; address++)
+    {
+        uint64_t hits = profile->address_counts[address];
+
+        if (hits == 0 || (found == count && hits <= profile->address_counts[addresses[found - 1]]))
+        {
+            continue;
+        }
+
+        unsigned int i = found < count ? found++ : count - 1;
+
+        while (i > 0 && profile->address_counts[addresses[i - 1]] < hits)
+        {
+            addresses[i] = addresses[i - 1];
+            i--;
+        }
+
+        addresses[i] = address;
+    }
+
+    return found;
+}
+
+// Names a node of the call tree after its subroutine
+static void call_name(const PROFILE_CALL *call, char *text, unsigned int size)
+{
+    if (call->address == PROFILE_ROOT)
+    {
+        snprintf(text, size, "main");
+    } else
+    {
+        snprintf(text, size, "0x%03X", call->address);
+    }
+}
+
+// Per subroutine address, plus one more entry for the root
+typedef struct
+{
+    uint64_t calls;
+    uint64_t exclusive;
+    uint64_t inclusive;
+} SUBROUTINE;
+
+#define ROOT_SUBROUTINE MEMORY_SIZE
+
+static unsigned int subroutine_index(unsigned short address)
+{
+    return address == PROFILE_ROOT ? ROOT_SUBROUTINE : address & (MEMORY_SIZE - 1);
+}
+
+// Adds up the call tree per subroutine. Recursive calls only count towards
+// a subroutine's inclusive instructions once. Returns NULL when out of memory.
+static SUBROUTINE *total_subroutines(const PROFILE *profile)
+{
+    SUBROUTINE *subroutines = calloc(MEMORY_SIZE + 1, sizeof(SUBROUTINE));
+    unsigned int *seen = calloc(MEMORY_SIZE + 1, sizeof(unsigned int));
+
+    if (subroutines == NULL || seen == NULL)
+    {
+        free(subroutines);
+        free(seen);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < profile->call_count; i++)
+    {
+        const PROFILE_CALL *call = &profile->calls[i];
+
+        subroutines[subroutine_index(call->address)].calls += call->calls;
+        subroutines[subroutine_index(call->address)].exclusive += call->instructions;
+
+        // Everything on the path is running while this node is on top
+        for (int node = i; node >= 0; node = profile->calls[node].parent)
+        {
+            unsigned int index = subroutine_index(profile->calls[node].address);
+
+            if (seen[index] != i + 1)
+            {
+                seen[index] = i + 1;
+                subroutines[index].inclusive += call->instructions;
+            }
+        }
+    }
+
+    free(seen);
+
+    return subroutines;
+}
+
+static void write_text_profile(FILE *output, const PROFILE *profile)
+{
+    unsigned int addresses[HOT_ADDRESSES];
+    unsigned int hot = hottest_addresses(profile, addresses, HOT_ADDRESSES);
+    uint64_t draws = profile->op_counts[OP_DXYN] + profile->op_counts[OP_DXYN_CLIP];
+
+    fprintf(output, "%llu instructions\n\n", (unsigned long long)profile->instructions);
+
+    fprintf(output, "%-16s %14s %8s\n", "operation", "count", "share");
+
+    for (unsigned int op = 0; op < OP_COUNT; op++)
+    {
+        if (profile->op_counts[op] > 0)
+        {
+            fprintf(output, "%-16s %14llu %7.2f%%\n", op_names[op], (unsigned long long)profile->op_counts[op],
+                    percent(profile->op_counts[op], profile->instructions));
+        }
+    }
+
+    fprintf(output, "\n%-16s %14s %14s %8s\n", "skip", "executed", "taken", "ratio");
+
+    for (unsigned int op = 0; op < OP_COUNT; op++)
+    {
+        if (is_skip(op) && profile->op_counts[op] > 0)
+        {
+            fprintf(output, "%-16s %14llu %14llu %7.2f%%\n", op_names[op], (unsigned long long)profile->op_counts[op],
+                    (unsigned long long)profile->skips_taken[op], percent(profile->skips_taken[op], profile->op_counts[op]));
+        }
+    }
+
+    fprintf(output, "\n%llu sprites drawn, %llu collided (%.2f%%)\n\n", (unsigned long long)draws,
+            (unsigned long long)profile->collisions, percent(profile->collisions, draws));
+
+    SUBROUTINE *subroutines = total_subroutines(profile);
+
+    if (subroutines)
+    {
+        fprintf(output, "%-16s %10s %14s %8s %14s %8s\n", "subroutine", "calls", "exclusive", "share",
+                "inclusive", "share");
+
+        for (unsigned int i = 0; i <= MEMORY_SIZE; i++)
+        {
+            char name[16];
+
+            if (subroutines[i].inclusive == 0)
+            {
+                continue;
+            }
+
+            if (i == ROOT_SUBROUTINE)
+            {
+                snprintf(name, sizeof(name), "main");
+            } else
+            {
+                snprintf(name, sizeof(name), "0x%03X", i);
+            }
+
+            fprintf(output, "%-16s %10llu %14llu %7.2f%% %14llu %7.2f%%\n", name,
+                    (unsigned long long)subroutines[i].calls, (unsigned long long)subroutines[i].exclusive,
+                    percent(subroutines[i].exclusive, profile->instructions),
+                    (unsigned long long)subroutines[i].inclusive,
+                    percent(subroutines[i].inclusive, profile->instructions));
+        }
+
+        free(subroutines);
+    }
+
+    fprintf(output, "\n%llu returns without a call\n\n", (unsigned long long)profile->unmatched_returns);
+
+    fprintf(output, "%-8s %-6s %-20s %14s %8s\n", "address", "opcode", "instruction", "count", "share");
+
+    for (unsigned int i = 0; i < hot; i++)
+    {
+        char text[32];
+
+        disassemble(profile->opcodes[addresses[i]], text, sizeof(text));
+
+        fprintf(output, "0x%03X    %04X   %-20s %14llu %7.2f%%\n", addresses[i], profile->opcodes[addresses[i]], text,
+                (unsigned long long)profile->address_counts[addresses[i]],
+                percent(profile->address_counts[addresses[i]], profile->instructions));
+    }
+}
+
+static void write_json_profile(FILE *output, const PROFILE *profile)
+{
+    const char *separator = "";
+
+    fprintf(output, "{\n  \"instructions\": %llu,\n  \"operations\": [", (unsigned long long)profile->instructions);
+
+    for (unsigned int op = 0; op < OP_COUNT; op++)
+    {
+        if (profile->op_counts[op] > 0)
+        {
+            fprintf(output, "%s\n    { \"operation\": \"%s\", \"count\": %llu }", separator, op_names[op],
+                    (unsigned long long)profile->op_counts[op]);
+            separator = ",";
+        }
+    }
+
+    fprintf(output, "\n  ],\n  \"skips\": [");
+    separator = "";
+
+    for (unsigned int op = 0; op < OP_COUNT; op++)
+    {
+        if (is_skip(op) && profile->op_counts[op] > 0)
+        {
+            fprintf(output, "%s\n    { \"operation\": \"%s\", \"executed\": %llu, \"taken\": %llu }", separator,
+                    op_names[op], (unsigned long long)profile->op_counts[op], (unsigned long long)profile->skips_taken[op]);
+            separator = ",";
+        }
+    }
+
+    fprintf(output, "\n  ],\n  \"draws\": %llu,\n  \"collisions\": %llu,\n  \"unmatched_returns\": %llu,\n"
+            "  \"subroutines\": [", (unsigned long long)(profile->op_counts[OP_DXYN] + profile->op_counts[OP_DXYN_CLIP]),
+            (unsigned long long)profile->collisions, (unsigned long long)profile->unmatched_returns);
+    separator = "";
+
+    SUBROUTINE *subroutines = total_subroutines(profile);
+
+    for (unsigned int i = 0; subroutines && i <= MEMORY_SIZE; i++)
+    {
+        if (subroutines[i].inclusive > 0)
+        {
+            if (i == ROOT_SUBROUTINE)
+            {
+                fprintf(output, "%s\n    { \"address\": \"main\"", separator);
+            } else
+            {
+                fprintf(output, "%s\n    { \"address\": %u", separator, i);
+            }
+
+            fprintf(output, ", \"calls\": %llu, \"exclusive\": %llu, \"inclusive\": %llu }",
+                    (unsigned long long)subroutines[i].calls, (unsigned long long)subroutines[i].exclusive,
+                    (unsigned long long)subroutines[i].inclusive);
+            separator = ",";
+        }
+    }
+
+    free(subroutines);
+
+    fprintf(output, "\n  ],\n  \"addresses\": [");
+    separator = "";
+
+    for (unsigned int address = 0; address < MEMORY_SIZE; address++)
+    {
+        if (profile->address_counts[address] > 0)
+        {
+            fprintf(output, "%s\n    { \"address\": %u, \"opcode\": \"%04X\", \"count\": %llu }", separator, address,
+                    profile->opcodes[address], (unsigned long long)profile->address_counts[address]);
+            separator = ",";
+        }
+    }
+
+    fprintf(output, "\n  ]\n}\n");
+}
+
+int write_profile(const char *path, const PROFILE *profile, int format)
+{
+    FILE *fptr = fopen(path, "w");
+
+    if (fptr == NULL)
+    {
+        printf("Could not write profile: '%s'\n", path);
+        return -1;
+    }
+
+    if (format == PROFILE_JSON)
+    {
+        write_json_profile(fptr, profile);
+    } else
+    {
+        write_text_profile(fptr, profile);
+    }
+
+    if (fclose(fptr) != 0)
+    {
+        printf("Could not write profile: '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int write_annotated_disassembly(const char *path, const PROFILE *profile)
+{
+    FILE *fptr = fopen(path, "w");
+
+    if (fptr == NULL)
+    {
+        printf("Could not write disassembly: '%s'\n", path);
+        return -1;
+    }
+
+    int previous = -1;
+
+    for (unsigned int address = 0; address < MEMORY_SIZE; address++)
+    {
+        char text[32];
+
+        if (profile->address_counts[address] == 0)
+        {
+            continue;
+        }
+
+        // A blank line wherever addresses that never ran were left out
+        if (previous >= 0 && address != previous + 2)
+        {
+            fprintf(fptr, "\n");
+        }
+
+        disassemble(profile->opcodes[address], text, sizeof(text));
+
+        fprintf(fptr, "0x%03X  %04X  %-20s ; %14llu %7.2f%%\n", address, profile->opcodes[address], text,
+                (unsigned long long)profile->address_counts[address],
+                percent(profile->address_counts[address], profile->instructions));
+
+        previous = address;
+    }
+
+    if (fclose(fptr) != 0)
+    {
+        printf("Could not write disassembly: '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int write_folded_stacks(const char *path, const PROFILE *profile)
+{
+    FILE *fptr = fopen(path, "w");
+
+    if (fptr == NULL)
+    {
+        printf("Could not write folded stacks: '%s'\n", path);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < profile->call_count; i++)
+    {
+        int path_nodes[PROFILE_MAX_CALL_DEPTH + 1];
+        unsigned int depth = 0;
+        char name[16];
+
+        if (profile->calls[i].instructions == 0)
+        {
+            continue;
+        }
+
+        for (int node = i; node >= 0; node = profile->calls[node].parent)
+        {
+            path_nodes[depth++] = node;
+        }
+
+        // Outermost first, separated by semicolons
+        while (depth > 0)
+        {
+            call_name(&profile->calls[path_nodes[--depth]], name, sizeof(name));
+            fprintf(fptr, "%s%s", name, depth > 0 ? ";" : "");
+        }
+
+        fprintf(fptr, " %llu\n", (unsigned long long)profile->calls[i].instructions);
+    }
+
+    if (fclose(fptr) != 0)
+    {
+        printf("Could not write folded stacks: '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
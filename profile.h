@@ -0,0 +1,92 @@
+#ifndef PROFILE_HEADER
+#define PROFILE_HEADER
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Calls deeper than this, or past the last node, are counted as part of the
+// deepest subroutine that fits
+#define PROFILE_MAX_CALL_DEPTH 64
+#define PROFILE_MAX_CALL_NODES 4096
+
+// Address of the call tree's root, standing for the code outside any call
+#define PROFILE_ROOT 0xFFFF
+
+enum
+{
+    PROFILE_TEXT,
+    PROFILE_JSON
+};
+
+// One path through the calls, found by following parents up to the root
+typedef struct
+{
+    unsigned short address;
+    unsigned short depth;
+    int parent;
+    int first_child;
+    int next_sibling;
+
+    uint64_t calls;
+
+    // Instructions run with this path on top of the stack
+    uint64_t instructions;
+} PROFILE_CALL;
+
+// Counts gathered while running a machine through profile_run_instructions()
+// instead of run_instructions(). The frontend picks one or the other, so the
+// usual interpreter pays nothing for profiling being available. Every
+// instruction is counted on its own, without fusing or skipping idle loops.
+typedef struct
+{
+    uint64_t instructions;
+
+    // Executions of each operation, after the quirks have been applied
+    uint64_t op_counts[OP_COUNT];
+
+    // Times each skip skipped, and each sprite draw turned a pixel off
+    uint64_t skips_taken[OP_COUNT];
+    uint64_t collisions;
+
+    // Executions of the instruction at each address, and the opcode last
+    // seen there, which only differs from memory in self-modifying code
+    uint64_t address_counts[MEMORY_SIZE];
+    unsigned short opcodes[MEMORY_SIZE];
+
+    // Tree of the calls made through 2NNN and 00EE, following the program
+    // rather than its stack, so returning without a call or jumping out of
+    // a subroutine only moves up or down the tree
+    PROFILE_CALL calls[PROFILE_MAX_CALL_NODES];
+    unsigned int call_count;
+    int current_call;
+
+    // Calls made past the depth or node limit, which still have to return
+    uint64_t untracked_depth;
+
+    // 00EE executed with nothing to return from
+    uint64_t unmatched_returns;
+} PROFILE;
+
+void profile_reset(PROFILE *profile);
+
+void profile_run_instructions(PROFILE *profile, CHP *chip8, unsigned int count);
+
+void profile_run_frame(PROFILE *profile, CHP *chip8, unsigned int instructions);
+
+// Writes the opcode in the usual assembler syntax, such as "DRW V1, V2, 5"
+void disassemble(unsigned short opcode, char *text, unsigned int size);
+
+// Writes the counts per operation, the skip and collision ratios, the
+// instructions run in and under each subroutine and the hottest addresses.
+// Returns -1 when the file cannot be written.
+int write_profile(const char *path, const PROFILE *profile, int format);
+
+// Writes a disassembly of every address that ran, with how often it did
+int write_annotated_disassembly(const char *path, const PROFILE *profile);
+
+// Writes one line per call path with the instructions run on it, as
+// "main;0x2A0;0x310 1234", the folded stack format flame graph tools read
+int write_folded_stacks(const char *path, const PROFILE *profile);
+
+#endif
@@ -0,0 +1,391 @@
+#include "rewind.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+#include "snapshot.h"
+
+// Equal bytes needed to end a run of changed ones. Shorter gaps are cheaper
+// to copy as part of the run than to start a new one.
+#define MIN_GAP 4
+
+// Each run is its offset from the end of the last one and its length, as
+// 16-bit values, followed by the changed bytes. A run always follows at
+// least MIN_GAP unchanged bytes that are not stored, so a frame never
+// takes much more than the snapshot itself.
+#define RUN_HEADER_SIZE 4
+#define MAX_RECORD_SIZE (sizeof(SNAPSHOT) + RUN_HEADER_SIZE)
+
+// Average stored frame size assumed when deciding how many frames the
+// budget can describe
+#define EXPECTED_FRAME_SIZE 64
+
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size;
+
+    // Frames since the keyframe this one is stored against, 0 for keyframes
+    uint32_t distance;
+} REWIND_FRAME;
+
+struct REWIND
+{
+    // Encoded frames, written one after the other and wrapping around
+    unsigned char *data;
+    size_t data_size;
+    size_t used;
+
+    // Ring of frames, oldest first
+    REWIND_FRAME *frames;
+    unsigned int capacity;
+    unsigned int first;
+    unsigned int count;
+
+    unsigned int keyframe_interval;
+    uint64_t keyframes;
+
+    // Keyframe the newest frames are stored against, and its frame's slot
+    SNAPSHOT base;
+    int base_slot;
+
+    SNAPSHOT current;
+    unsigned char record[MAX_RECORD_SIZE];
+
+    uint64_t captures;
+    uint64_t capture_ns;
+};
+
+// Keyframes are stored against an empty machine, so most of memory is skipped
+static const SNAPSHOT empty;
+
+
+// --- Encoding ---
+
+static size_t encode_frame(const SNAPSHOT *state, const SNAPSHOT *base, unsigned char *record)
+{
+    const unsigned char *now = (const unsigned char *)state;
+    const unsigned char *then = (const unsigned char *)base;
+    size_t size = 0;
+    size_t i = 0;
+
+    while (i < sizeof(SNAPSHOT))
+    {
+        size_t start = i;
+
+        // Skip unchanged bytes, eight at a time while there are that many
+        while (i + 8 <= sizeof(SNAPSHOT))
+        {
+            uint64_t a, b;
+
+            memcpy(&a, now + i, 8);
+            memcpy(&b, then + i, 8);
+
+            if (a != b)
+            {
+                break;
+            }
+
+            i += 8;
+        }
+
+        while (i < sizeof(SNAPSHOT) && now[i] == then[i])
+        {
+            i++;
+        }
+
+        if (i == sizeof(SNAPSHOT))
+        {
+            break;
+        }
+
+        size_t skip = i - start;
+        size_t run = i;
+        size_t gap = 0;
+
+        while (i < sizeof(SNAPSHOT) && gap < MIN_GAP)
+        {
+            gap = now[i] == then[i] ? gap + 1 : 0;
+            i++;
+        }
+
+        // Leave the trailing unchanged bytes to be skipped by the next run
+        i -= gap;
+
+        size_t length = i - run;
+
+        // A snapshot is well under 64 KiB, so both always fit
+        record[size++] = skip & 0xFF;
+        record[size++] = skip >> 8;
+        record[size++] = length & 0xFF;
+        record[size++] = length >> 8;
+
+        for (size_t j = 0; j < length; j++)
+        {
+            record[size++] = now[run + j] ^ then[run + j];
+        }
+    }
+
+    return size;
+}
+
+// XORs a stored frame's runs into state, which holds the frame's base
+static void apply_frame(SNAPSHOT *state, const unsigned char *record, size_t size)
+{
+    unsigned char *out = (unsigned char *)state;
+    size_t position = 0;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        size_t skip = record[i] | (record[i + 1] << 8);
+        size_t length = record[i + 2] | (record[i + 3] << 8);
+
+        i += RUN_HEADER_SIZE;
+        position += skip;
+
+        for (size_t j = 0; j < length; j++)
+        {
+            out[position + j] ^= record[i + j];
+        }
+
+        i += length;
+        position += length;
+    }
+}
+
+
+// --- Frame ring ---
+
+static unsigned int slot_of(const REWIND *rewind, unsigned int index)
+{
+    return (rewind->first + index) % rewind->capacity;
+}
+
+static void drop_frame(REWIND *rewind, unsigned int slot)
+{
+    REWIND_FRAME *frame = &rewind->frames[slot];
+
+    rewind->used -= frame->size;
+
+    if (frame->distance == 0)
+    {
+        rewind->keyframes -= 1;
+    }
+
+    if ((int)slot == rewind->base_slot)
+    {
+        rewind->base_slot = -1;
+    }
+}
+
+// Drops the oldest keyframe together with the frames stored against it
+static void drop_oldest_keyframe(REWIND *rewind)
+{
+    do
+    {
+        drop_frame(rewind, rewind->first);
+
+        rewind->first = (rewind->first + 1) % rewind->capacity;
+        rewind->count -= 1;
+    } while (rewind->count > 0 && rewind->frames[rewind->first].distance != 0);
+}
+
+// Finds where a frame of the given size can be written without overwriting
+// any kept frame. Frames are only ever written after the newest one or at
+// the start of the data, and a wrapped newest frame always stays strictly
+// before the oldest, so the two cases can be told apart.
+static int find_space(const REWIND *rewind, size_t size, size_t *offset)
+{
+    if (rewind->count == 0)
+    {
+        *offset = 0;
+        return size <= rewind->data_size;
+    }
+
+    const REWIND_FRAME *oldest = &rewind->frames[rewind->first];
+    const REWIND_FRAME *newest = &rewind->frames[slot_of(rewind, rewind->count - 1)];
+    size_t end = newest->offset + newest->size;
+
+    if (newest->offset >= oldest->offset)
+    {
+        if (rewind->data_size - end >= size)
+        {
+            *offset = end;
+            return 1;
+        }
+
+        if (oldest->offset > size)
+        {
+            *offset = 0;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (oldest->offset - end > size)
+    {
+        *offset = end;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Rebuilds the frame in slot into rewind->current
+static void decode_frame(REWIND *rewind, unsigned int slot)
+{
+    const REWIND_FRAME *frame = &rewind->frames[slot];
+    unsigned int key_slot = (slot + rewind->capacity - frame->distance) % rewind->capacity;
+
+    if (rewind->base_slot != (int)key_slot)
+    {
+        const REWIND_FRAME *key = &rewind->frames[key_slot];
+
+        memcpy(&rewind->base, &empty, sizeof(SNAPSHOT));
+        apply_frame(&rewind->base, rewind->data + key->offset, key->size);
+
+        rewind->base_slot = key_slot;
+    }
+
+    memcpy(&rewind->current, &rewind->base, sizeof(SNAPSHOT));
+
+    if (frame->distance != 0)
+    {
+        apply_frame(&rewind->current, rewind->data + frame->offset, frame->size);
+    }
+}
+
+
+// --- Public interface ---
+
+REWIND *rewind_create(size_t budget, unsigned int keyframe_interval)
+{
+    unsigned int capacity = budget / EXPECTED_FRAME_SIZE;
+
+    if (capacity < 2 || budget - capacity * sizeof(REWIND_FRAME) < MAX_RECORD_SIZE)
+    {
+        return NULL;
+    }
+
+    REWIND *rewind = calloc(1, sizeof(REWIND));
+
+    if (rewind == NULL)
+    {
+        return NULL;
+    }
+
+    // The budget covers the frame ring as well as the frames' data
+    rewind->capacity = capacity;
+    rewind->frames = calloc(capacity, sizeof(REWIND_FRAME));
+    rewind->data_size = budget - capacity * sizeof(REWIND_FRAME);
+    rewind->data = malloc(rewind->data_size);
+
+    if (rewind->frames == NULL || rewind->data == NULL)
+    {
+        rewind_destroy(rewind);
+        return NULL;
+    }
+
+    rewind->keyframe_interval = keyframe_interval ? keyframe_interval : 1;
+    rewind->base_slot = -1;
+
+    return rewind;
+}
+
+
+void rewind_destroy(REWIND *rewind)
+{
+    if (rewind != NULL)
+    {
+        free(rewind->frames);
+        free(rewind->data);
+        free(rewind);
+    }
+}
+
+
+void rewind_capture(REWIND *rewind, const CHP *chip8)
+{
+    uint64_t start = monotonic_ns();
+
+    take_snapshot(chip8, &rewind->current);
+
+    const REWIND_FRAME *newest = rewind->count ? &rewind->frames[slot_of(rewind, rewind->count - 1)] : NULL;
+    unsigned int distance = newest && newest->distance + 1 < rewind->keyframe_interval ? newest->distance + 1 : 0;
+
+    size_t size = encode_frame(&rewind->current, distance ? &rewind->base : &empty, rewind->record);
+    size_t offset;
+
+    for (;;)
+    {
+        // Making room dropped the keyframe this frame was stored against
+        if (rewind->count == 0 && distance != 0)
+        {
+            distance = 0;
+            size = encode_frame(&rewind->current, &empty, rewind->record);
+        }
+
+        if (rewind->count < rewind->capacity && find_space(rewind, size, &offset))
+        {
+            break;
+        }
+
+        drop_oldest_keyframe(rewind);
+    }
+
+    unsigned int slot = slot_of(rewind, rewind->count);
+    REWIND_FRAME *frame = &rewind->frames[slot];
+
+    frame->offset = offset;
+    frame->size = size;
+    frame->distance = distance;
+    memcpy(rewind->data + offset, rewind->record, size);
+
+    rewind->count += 1;
+    rewind->used += size;
+
+    if (distance == 0)
+    {
+        memcpy(&rewind->base, &rewind->current, sizeof(SNAPSHOT));
+        rewind->base_slot = slot;
+        rewind->keyframes += 1;
+    }
+
+    rewind->captures += 1;
+    rewind->capture_ns += monotonic_ns() - start;
+}
+
+
+int rewind_step_back(REWIND *rewind, CHP *chip8)
+{
+    if (rewind->count < 2)
+    {
+        return -1;
+    }
+
+    drop_frame(rewind, slot_of(rewind, rewind->count - 1));
+    rewind->count -= 1;
+
+    // The newest frame's keyframe becomes the base again, so capturing can
+    // carry on storing frames against it
+    decode_frame(rewind, slot_of(rewind, rewind->count - 1));
+    restore_snapshot(chip8, &rewind->current);
+
+    return 0;
+}
+
+
+void rewind_get_stats(const REWIND *rewind, REWIND_STATS *stats)
+{
+    stats->frames = rewind->count;
+    stats->keyframes = rewind->keyframes;
+
+    stats->bytes = rewind->used + rewind->capacity * sizeof(REWIND_FRAME);
+    stats->budget = rewind->data_size + rewind->capacity * sizeof(REWIND_FRAME);
+
+    stats->captures = rewind->captures;
+    stats->capture_ns = rewind->capture_ns;
+}
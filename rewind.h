@@ -0,0 +1,49 @@
+#ifndef REWIND_HEADER
+#define REWIND_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define REWIND_DEFAULT_BUDGET (4 * 1024 * 1024)
+#define REWIND_DEFAULT_KEYFRAME_INTERVAL 60
+
+// History of recent frames, kept in a fixed amount of memory. Every
+// keyframe_interval frames a keyframe is stored, and the frames in between
+// are stored as the run-length encoded XOR of their state and that
+// keyframe. The oldest keyframe and its frames are dropped to make room.
+typedef struct REWIND REWIND;
+
+typedef struct
+{
+    uint64_t frames;
+    uint64_t keyframes;
+
+    // Bytes of history in use, out of the budget given to rewind_create()
+    size_t bytes;
+    size_t budget;
+
+    // Time spent in rewind_capture(), over all captures
+    uint64_t captures;
+    uint64_t capture_ns;
+} REWIND_STATS;
+
+// Returns NULL when the budget is too small to hold a single keyframe or
+// the memory cannot be allocated
+REWIND *rewind_create(size_t budget, unsigned int keyframe_interval);
+
+void rewind_destroy(REWIND *rewind);
+
+// Adds the machine's current state as the newest frame
+void rewind_capture(REWIND *rewind, const CHP *chip8);
+
+// Drops the newest frame and restores the one before it, so calling this
+// once per frame plays the history backwards. Returns -1, leaving the
+// machine alone, when there is no earlier frame. Callers using a JIT must
+// flush it afterwards.
+int rewind_step_back(REWIND *rewind, CHP *chip8);
+
+void rewind_get_stats(const REWIND *rewind, REWIND_STATS *stats);
+
+#endif
@@ -0,0 +1,97 @@
+#include "scheduler.h"
+
+#include <errno.h>
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000ULL
+
+uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+
+void precise_sleep_until(uint64_t deadline_ns)
+{
+    struct timespec deadline;
+
+    if (deadline_ns > SPIN_NS)
+    {
+        deadline.tv_sec = (deadline_ns - SPIN_NS) / NS_PER_SECOND;
+        deadline.tv_nsec = (deadline_ns - SPIN_NS) % NS_PER_SECOND;
+
+        // Absolute sleeps are not affected by the time spent setting them
+        // up, and simply need restarting if a signal interrupts them
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        {
+        }
+    }
+
+    while (monotonic_ns() < deadline_ns)
+    {
+    }
+}
+
+
+void initialise_scheduler(SCHEDULER *scheduler, unsigned int instructions_per_frame)
+{
+    scheduler->instructions_per_frame = instructions_per_frame;
+
+    scheduler->start_ns = monotonic_ns();
+    scheduler->frame = 0;
+
+    scheduler->resyncs = 0;
+}
+
+
+uint64_t next_frame_deadline(const SCHEDULER *scheduler)
+{
+    // Multiply before dividing so the fractional part of the 16.67 ms period
+    // is carried between frames instead of being truncated every frame
+    return scheduler->start_ns + ((scheduler->frame + 1) * NS_PER_SECOND) / TIMER_RATE;
+}
+
+
+void wait_for_next_frame(SCHEDULER *scheduler)
+{
+    uint64_t deadline = next_frame_deadline(scheduler);
+    uint64_t now = monotonic_ns();
+
+    scheduler->frame += 1;
+
+    if (now < deadline)
+    {
+        precise_sleep_until(deadline);
+    } else if (now - deadline > (MAX_LAG_FRAMES * NS_PER_SECOND) / TIMER_RATE)
+    {
+        // We are too far behind to catch up without a burst of frames, so
+        // start the schedule again from now
+        scheduler->start_ns = now;
+        scheduler->frame = 0;
+        scheduler->resyncs += 1;
+    }
+}
+
+
+void align_schedule(SCHEDULER *scheduler, uint64_t target_ns)
+{
+    int64_t period = FRAME_NS;
+
+    // Distance from the next deadline to the nearest target, between half a
+    // frame early and half a frame late
+    int64_t error = (int64_t)(target_ns - next_frame_deadline(scheduler)) % period;
+
+    if (error >= period / 2)
+    {
+        error -= period;
+    } else if (error < -period / 2)
+    {
+        error += period;
+    }
+
+    scheduler->start_ns += error / (1 << ALIGN_SHIFT);
+}
@@ -0,0 +1,53 @@
+#ifndef SCHEDULER_HEADER
+#define SCHEDULER_HEADER
+
+#include <stdint.h>
+
+// CHIP-8 timers always count down at 60 Hz, so a frame is one timer tick
+#define TIMER_RATE 60
+
+// How far behind the schedule we allow ourselves to fall before giving up on
+// catching up and restarting the schedule from the current time
+#define MAX_LAG_FRAMES 4
+
+// Sleeps wake up late by the kernel's timer slack, so the end of each wait is
+// spent spinning on the clock instead
+#define SPIN_NS 200000
+
+// How much of the distance to another clock align_schedule() closes each
+// frame, as a shift, so locking on takes a few dozen frames without jumps
+#define ALIGN_SHIFT 3
+
+#define FRAME_NS (1000000000ULL / TIMER_RATE)
+
+typedef struct
+{
+    // Number of instructions executed between two timer ticks
+    unsigned int instructions_per_frame;
+
+    // Deadlines are computed from the start of the schedule rather than by
+    // adding a rounded period each frame, so they never drift
+    uint64_t start_ns;
+    uint64_t frame;
+
+    // Number of times the schedule was restarted after falling behind
+    uint64_t resyncs;
+} SCHEDULER;
+
+uint64_t monotonic_ns(void);
+
+// Returns within a few microseconds of the deadline, on the monotonic clock
+void precise_sleep_until(uint64_t deadline_ns);
+
+void initialise_scheduler(SCHEDULER *scheduler, unsigned int instructions_per_frame);
+
+uint64_t next_frame_deadline(const SCHEDULER *scheduler);
+
+void wait_for_next_frame(SCHEDULER *scheduler);
+
+// Moves the schedule a little towards having its deadlines at target_ns plus
+// whole frames, so that it locks on to a 60 Hz clock kept by something else,
+// such as the display, without ever skipping or doubling a frame
+void align_schedule(SCHEDULER *scheduler, uint64_t target_ns);
+
+#endif
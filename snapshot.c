@@ -0,0 +1,258 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Memory is compared and reloaded in blocks of this many bytes
+#define RESTORE_BLOCK_SIZE 64
+
+void take_snapshot(const CHP *chip8, SNAPSHOT *snapshot)
+{
+    snapshot->PC = chip8->PC;
+    snapshot->SP = chip8->SP;
+    snapshot->I = chip8->I;
+    snapshot->DT = chip8->DT;
+    snapshot->ST = chip8->ST;
+
+    memcpy(snapshot->V, chip8->V, sizeof(snapshot->V));
+    memcpy(snapshot->stack, chip8->stack, sizeof(snapshot->stack));
+    snapshot->keypad = chip8->keypad;
+    snapshot->key_wait = chip8->key_wait;
+    memcpy(snapshot->memory, chip8->memory, sizeof(snapshot->memory));
+    memcpy(snapshot->display, chip8->display, sizeof(snapshot->display));
+
+    snapshot->random_state = chip8->random_state;
+    snapshot->quirks = chip8->quirks;
+}
+
+void restore_snapshot(CHP *chip8, const SNAPSHOT *snapshot)
+{
+    chip8->PC = snapshot->PC;
+    chip8->SP = snapshot->SP;
+    chip8->I = snapshot->I;
+    chip8->DT = snapshot->DT;
+    chip8->ST = snapshot->ST;
+
+    memcpy(chip8->V, snapshot->V, sizeof(chip8->V));
+    memcpy(chip8->stack, snapshot->stack, sizeof(chip8->stack));
+    chip8->keypad = snapshot->keypad;
+    chip8->key_wait = snapshot->key_wait;
+    memcpy(chip8->display, snapshot->display, sizeof(chip8->display));
+
+    chip8->random_state = snapshot->random_state;
+
+    if (chip8->quirks != snapshot->quirks)
+    {
+        set_quirks(chip8, snapshot->quirks);
+    }
+
+    // Most of memory is usually code and data the program never changes
+    for (unsigned int address = 0; address < MEMORY_SIZE; address += RESTORE_BLOCK_SIZE)
+    {
+        if (memcmp(chip8->memory + address, snapshot->memory + address, RESTORE_BLOCK_SIZE) != 0)
+        {
+            memcpy(chip8->memory + address, snapshot->memory + address, RESTORE_BLOCK_SIZE);
+            invalidate_instructions(chip8, address, RESTORE_BLOCK_SIZE);
+        }
+    }
+
+    chip8->draw_flag = 1;
+}
+
+
+// --- Save-state files ---
+
+static unsigned char *put16(unsigned char *buffer, unsigned int value)
+{
+    buffer[0] = value & 0xFF;
+    buffer[1] = (value >> 8) & 0xFF;
+
+    return buffer + 2;
+}
+
+static unsigned char *put32(unsigned char *buffer, uint32_t value)
+{
+    buffer = put16(buffer, value & 0xFFFF);
+
+    return put16(buffer, value >> 16);
+}
+
+static unsigned char *put64(unsigned char *buffer, uint64_t value)
+{
+    buffer = put32(buffer, value & 0xFFFFFFFF);
+
+    return put32(buffer, value >> 32);
+}
+
+static unsigned int get16(const unsigned char *buffer)
+{
+    return buffer[0] | (buffer[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *buffer)
+{
+    return get16(buffer) | ((uint32_t)get16(buffer + 2) << 16);
+}
+
+static uint64_t get64(const unsigned char *buffer)
+{
+    return get32(buffer) | ((uint64_t)get32(buffer + 4) << 32);
+}
+
+static uint64_t checksum(const unsigned char *buffer, size_t size)
+{
+    // FNV-1a, the same as display_hash()
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= buffer[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+void encode_state(const SNAPSHOT *snapshot, unsigned char *buffer)
+{
+    unsigned char *payload = buffer + SAVE_STATE_HEADER_SIZE;
+    unsigned char *out = payload;
+
+    memcpy(buffer, SAVE_STATE_MAGIC, 4);
+    put32(buffer + 4, SAVE_STATE_VERSION);
+    put32(buffer + 8, SAVE_STATE_PAYLOAD_SIZE);
+
+    out = put16(out, snapshot->PC);
+    out = put16(out, snapshot->SP);
+    out = put16(out, snapshot->I);
+    *out++ = snapshot->DT;
+    *out++ = snapshot->ST;
+
+    memcpy(out, snapshot->V, V_SIZE);
+    out += V_SIZE;
+
+    for (int i = 0; i < STACK_SIZE; i++)
+    {
+        out = put16(out, snapshot->stack[i]);
+    }
+
+    out = put16(out, snapshot->keypad);
+    *out++ = snapshot->key_wait;
+
+    memcpy(out, snapshot->memory, MEMORY_SIZE);
+    out += MEMORY_SIZE;
+
+    for (int i = 0; i < DISPLAY_HEIGHT; i++)
+    {
+        out = put64(out, snapshot->display[i]);
+    }
+
+    out = put64(out, snapshot->random_state);
+    *out++ = snapshot->quirks;
+
+    put64(out, checksum(payload, SAVE_STATE_PAYLOAD_SIZE));
+}
+
+int decode_state(const unsigned char *buffer, size_t size, SNAPSHOT *snapshot)
+{
+    const unsigned char *payload = buffer + SAVE_STATE_HEADER_SIZE;
+    const unsigned char *in = payload;
+
+    if (size != SAVE_STATE_SIZE || memcmp(buffer, SAVE_STATE_MAGIC, 4) != 0 ||
+        get32(buffer + 4) != SAVE_STATE_VERSION || get32(buffer + 8) != SAVE_STATE_PAYLOAD_SIZE ||
+        get64(payload + SAVE_STATE_PAYLOAD_SIZE) != checksum(payload, SAVE_STATE_PAYLOAD_SIZE))
+    {
+        return -1;
+    }
+
+    snapshot->PC = get16(in);
+    snapshot->SP = get16(in + 2);
+    snapshot->I = get16(in + 4);
+    snapshot->DT = in[6];
+    snapshot->ST = in[7];
+    in += 8;
+
+    memcpy(snapshot->V, in, V_SIZE);
+    in += V_SIZE;
+
+    for (int i = 0; i < STACK_SIZE; i++)
+    {
+        snapshot->stack[i] = get16(in);
+        in += 2;
+    }
+
+    snapshot->keypad = get16(in);
+    snapshot->key_wait = in[2];
+    in += 3;
+
+    memcpy(snapshot->memory, in, MEMORY_SIZE);
+    in += MEMORY_SIZE;
+
+    for (int i = 0; i < DISPLAY_HEIGHT; i++)
+    {
+        snapshot->display[i] = get64(in);
+        in += 8;
+    }
+
+    snapshot->random_state = get64(in);
+    snapshot->quirks = in[8];
+
+    // The generator never reaches zero, so a state holding it is corrupt
+    return snapshot->random_state == 0 ? -1 : 0;
+}
+
+int save_state(const char *path, const CHP *chip8)
+{
+    SNAPSHOT snapshot;
+    unsigned char buffer[SAVE_STATE_SIZE];
+
+    take_snapshot(chip8, &snapshot);
+    encode_state(&snapshot, buffer);
+
+    FILE *fptr = fopen(path, "wb");
+
+    if (fptr == NULL)
+    {
+        printf("Could not write save state: '%s'\n", path);
+        return -1;
+    }
+
+    size_t written = fwrite(buffer, 1, sizeof(buffer), fptr);
+
+    if (fclose(fptr) != 0 || written != sizeof(buffer))
+    {
+        printf("Could not write save state: '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int load_state(const char *path, CHP *chip8)
+{
+    SNAPSHOT snapshot;
+    unsigned char buffer[SAVE_STATE_SIZE + 1];
+
+    FILE *fptr = fopen(path, "rb");
+
+    if (fptr == NULL)
+    {
+        printf("Invalid save state path: '%s'\n", path);
+        return -1;
+    }
+
+    // Read one byte more than expected to notice files that are too long
+    size_t size = fread(buffer, 1, sizeof(buffer), fptr);
+
+    fclose(fptr);
+
+    if (decode_state(buffer, size, &snapshot) != 0)
+    {
+        printf("Not a version %d save state: '%s'\n", SAVE_STATE_VERSION, path);
+        return -1;
+    }
+
+    restore_snapshot(chip8, &snapshot);
+
+    return 0;
+}
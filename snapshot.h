@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_HEADER
+#define SNAPSHOT_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Save-state files start with the magic and the format version, so older
+// files can be recognised once the format changes
+#define SAVE_STATE_MAGIC "C8SS"
+#define SAVE_STATE_VERSION 4
+
+// Magic, version and payload size, the payload, then an FNV-1a checksum
+#define SAVE_STATE_HEADER_SIZE 12
+#define SAVE_STATE_PAYLOAD_SIZE (8 + V_SIZE + STACK_SIZE * 2 + 3 + MEMORY_SIZE + DISPLAY_HEIGHT * 8 + 8 + 1)
+#define SAVE_STATE_SIZE (SAVE_STATE_HEADER_SIZE + SAVE_STATE_PAYLOAD_SIZE + 8)
+
+// Everything that decides how a machine runs from here on. The decoded
+// instructions are left out, since they are rebuilt from memory.
+typedef struct
+{
+    unsigned short PC;
+    unsigned short SP;
+    unsigned short I;
+    unsigned char DT;
+    unsigned char ST;
+
+    unsigned char V[V_SIZE];
+    unsigned short stack[STACK_SIZE];
+    uint16_t keypad;
+    unsigned char key_wait;
+
+    unsigned char memory[MEMORY_SIZE];
+    uint64_t display[DISPLAY_HEIGHT];
+
+    uint64_t random_state;
+    unsigned char quirks;
+} SNAPSHOT;
+
+void take_snapshot(const CHP *chip8, SNAPSHOT *snapshot);
+
+// Only copies and invalidates the parts of memory that differ, so going
+// back to a snapshot of the same program keeps most decoded instructions.
+// Never allocates. Callers using a JIT must flush it afterwards.
+void restore_snapshot(CHP *chip8, const SNAPSHOT *snapshot);
+
+// Writes SAVE_STATE_SIZE bytes, little endian whatever the host
+void encode_state(const SNAPSHOT *snapshot, unsigned char *buffer);
+
+// Returns -1 when the buffer is not a save state this version understands
+int decode_state(const unsigned char *buffer, size_t size, SNAPSHOT *snapshot);
+
+int save_state(const char *path, const CHP *chip8);
+
+int load_state(const char *path, CHP *chip8);
+
+#endif